@@ -3,31 +3,190 @@
 #include <iterator>
 #include <chrono>
 #include <vector>
+#include <memory>
+#include <future>
+#include <string>
+#include <deque>
+#include <limits>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <tuple>
+#include <utility>
 #include <csignal>
+#include <ctime>
 #include <unistd.h>
 #include "mlscrcap.h"
 #include "mltimer.h"
 #include "mlinput.h"
 #include "mlimage.h"
+#include "mlframe.h"
+#include "mlchange.h"
+#include "mlroi.h"
+#include "mldataset.h"
+#include "mlstore.h"
+#include "mldedup.h"
 using namespace std;
 //using namespace std::literals::chrono_literals;
 
-template <typename Data_Con, typename Label>
-void write_data(ofstream&, 
-                ofstream&, 
-                Data_Con&&,
-                Label&&);
-
 void signal_handle(int);
 
+void usage(const char*);
+
+string session_name();
+
 volatile sig_atomic_t quit = 0;
 
-int main()
+int main(int argc, char *argv[])
 {
-    ofstream data_fs("data.csv", /*ios::app |*/ ios::out);
-    ofstream data_label_fs("data_label.csv", /*ios::app |*/ ios::out);
-    data_label_fs << fixed;
+    // -o path        : binary dataset to write, "data.bin" by default
+    // -y seconds     : write and fsync buffered samples at least every given
+    //                  seconds, 1 by default, 0 writes without fsync
+    // -z             : compress samples as deltas of 16 bit features
+    // -s directory   : append the session to the dataset store in directory
+    //                  as new shards instead of writing -o
+    // -n samples     : start a new shard every given samples, 0 (default)
+    //                  writes the session into a single shard
+    // -d threshold   : drop near-duplicate samples, a sample of the same
+    //                  label is written only if more than threshold coarse
+    //                  features differ from every recent one written
+    // -c damage|hash : skip extraction of frames which haven't changed
+    // -k             : drop unchanged frames instead of repeating the last sample
+    // -f mode        : feature mode, "fused" (default), "reference" or "multi";
+    //                  fused computes the reference features in a single pass
+    //                  and is recorded as reference
+    // -w             : show debug images of extraction in preview windows
+    // -j workers     : extract frames with given number of worker threads
+    // -q capacity    : frames waiting for a worker, as many as workers by default
+    // -b policy      : "block" (default), "oldest" or "newest", which frame to
+    //                  drop when the queue of workers is full
+    // -i how         : "on" or "verify", recompute only boxes whose source tile
+    //                  changed, verify checks reused boxes; multi always
+    //                  extracts everything
+    // -r seconds     : look for a moved game every given seconds, 2 by default,
+    //                  0 keeps the area found at start
+    bool detect_change = false;
+    size_t workers = 1;
+    size_t capacity = 0;
+    backpressure policy = backpressure::BLOCK;
+    bool show_preview = false;
+    feature_mode mode = feature_mode::FUSED;
+    incremental_mode incremental = incremental_mode::OFF;
+    bool skip_unchanged = false;
+    change_mode detect_mode = change_mode::DAMAGE;
+    double roi_interval = 2;
+    string out_path = "data.bin";
+    string store_path;
+    size_t shard_records = 0;
+    unique_ptr<MlDuplicateFilter> dedup;
+    async_writer_options writer_options;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:y:zs:n:d:c:kf:wj:q:b:i:r:")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'y': {
+            double interval = stod(optarg);
+            writer_options.sync = interval > 0;
+            if (interval > 0)
+                writer_options.flush_interval = chrono::duration_cast<chrono::milliseconds>(chrono::duration<double>(interval));
+            break;
+        }
+        case 'z':
+            writer_options.dtype = dataset_dtype::DELTA_U16;
+            break;
+        case 's':
+            store_path = optarg;
+            break;
+        case 'n':
+            shard_records = stoul(optarg);
+            break;
+        case 'd': {
+            dedup_options options;
+            options.threshold = stoul(optarg);
+            dedup = make_unique<MlDuplicateFilter>(options);
+            break;
+        }
+        case 'c':
+            detect_change = true;
+            if (string(optarg) == "damage") {
+                detect_mode = change_mode::DAMAGE;
+            } else if (string(optarg) == "hash") {
+                detect_mode = change_mode::TILE_HASH;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            skip_unchanged = true;
+            break;
+        case 'f':
+            if (string(optarg) == "fused") {
+                mode = feature_mode::FUSED;
+            } else if (string(optarg) == "reference") {
+                mode = feature_mode::REFERENCE;
+            } else if (string(optarg) == "multi") {
+                mode = feature_mode::MULTI_SCALE;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            show_preview = true;
+            break;
+        case 'i':
+            if (string(optarg) == "on") {
+                incremental = incremental_mode::ON;
+            } else if (string(optarg) == "verify") {
+                incremental = incremental_mode::VERIFY;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            roi_interval = stod(optarg);
+            break;
+        case 'j':
+            workers = stoul(optarg);
+            break;
+        case 'q':
+            capacity = stoul(optarg);
+            break;
+        case 'b':
+            if (string(optarg) == "block") {
+                policy = backpressure::BLOCK;
+            } else if (string(optarg) == "oldest") {
+                policy = backpressure::DROP_OLDEST;
+            } else if (string(optarg) == "newest") {
+                policy = backpressure::DROP_NEWEST;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    // -k drops the samples change detection finds unchanged, without -c there are none
+    if (skip_unchanged && !detect_change) {
+        cerr << "-k requires -c." << endl;
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (workers == 0 || roi_interval < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (capacity == 0)
+        capacity = workers;
+
     struct sigaction sa;
     sa.sa_handler = signal_handle;
     sa.sa_flags = 0;
@@ -45,7 +204,27 @@ int main()
 
 	MlInputListener input(display);
 	MlScreenCapturer screen(display);
-    MlImageProcessor img_proc("settings.json");
+    MlImageProcessor img_proc("setting.json", workers, capacity, policy);
+    img_proc.set_feature_mode(mode);
+    img_proc.set_incremental(incremental);
+    // the header of the dataset records the grid, train reads it back from there.
+    // samples are written from another thread so the disk never stalls capture
+    dataset_geometry geometry{ img_proc.get_geometry(), img_proc.get_feature_size(), recorded_mode(mode) };
+    unique_ptr<MlDatasetStore> store;
+    unique_ptr<MlShardWriter> shard_writer;
+    unique_ptr<MlAsyncDatasetWriter> data_writer;
+    if (!store_path.empty()) {
+        store = make_unique<MlDatasetStore>(store_path);
+        shard_writer = make_unique<MlShardWriter>(*store, session_name(), geometry, shard_records, writer_options);
+    } else {
+        data_writer = make_unique<MlAsyncDatasetWriter>(out_path, geometry, writer_options);
+    }
+    auto write_sample = [&](const vector<float>& features, bool click, chrono::system_clock::time_point captured) {
+        if (shard_writer)
+            shard_writer->write(features, click, captured);
+        else
+            data_writer->write(features, click, captured);
+    };
     cout << "pass" << endl;
     //screen.size_captured = true;
 	
@@ -62,50 +241,191 @@ int main()
 
 	auto t = [] { return std::chrono::steady_clock::now(); };
 	screen.capture_screen_size(get_click, get_pos);	
-    img_proc.set_roi(screen.screenshot());
+    auto browser = screen.get_capture_area();
+    auto roi = img_proc.find_roi(screen.screenshot(), show_preview);
+
+    // from now on only the pixels of the game are transferred from the X server,
+    // so the frames handed to the extractor are already cropped
+    screen.set_capture_area(roi + browser.tl());
+    img_proc.set_roi(cv::Rect(cv::Point(0, 0), roi.size()));
+    // the preview windows belong to the visualizer thread from now on
+    if (show_preview)
+        img_proc.set_visualizer(make_shared<PreviewVisualizer>());
+
+    // one frame being captured while the others are being extracted or
+    // queued, plus a spare so capture never waits on the pool
+    auto frames = make_unique<MlFramePool>(workers > 1 ? workers + capacity + 2 : 3, screen.get_capture_size());
+
+    unique_ptr<MlChangeDetector> detector;
+    if (detect_change)
+        detector = make_unique<MlChangeDetector>(display, screen.get_capture_area(), detect_mode);
+
+    // the tracker searches the whole browser area with its own capturer,
+    // the capture loop picks a moved roi up between two frames
+    MlScreenCapturer scan(display);
+    scan.set_capture_area(browser);
+    mutex moved_m;
+    cv::Rect moved_roi = roi;
+    atomic_bool has_moved{false};
+    unique_ptr<MlRoiTracker> tracker;
+    if (roi_interval > 0) {
+        tracker = make_unique<MlRoiTracker>(
+            [&scan] { return scan.screenshot(); },
+            [&](const cv::Rect& r) {
+                lock_guard<mutex> lck{moved_m};
+                moved_roi = r;
+                has_moved.store(true, memory_order_release);
+            },
+            roi,
+            chrono::duration_cast<chrono::milliseconds>(chrono::duration<double>(roi_interval)));
+    }
+    vector<float> features;
+    bool submitted = false;
+
+    // samples waiting for their features with their label and capture
+    // time, in capture order. an invalid future repeats the features of
+    // the previous sample.
+    deque<tuple<future<vector<float>>, bool, chrono::system_clock::time_point>> pending;
+
+    // the single slot executor takes a frame only once the previous one is
+    // done; a blocking pool is bounded by its queue, a dropping one by itself
+    size_t max_pending = workers == 1 ? 1 :
+                         policy == backpressure::BLOCK ? workers + capacity :
+                         numeric_limits<size_t>::max();
+    size_t dropped = 0;
+
+    // write samples in capture order while more than keep are pending,
+    // and any further ones whose features are ready
+    auto drain = [&](size_t keep) {
+        while (!pending.empty()) {
+            auto& [result_future, click, captured] = pending.front();
+            if (pending.size() <= keep && result_future.valid() &&
+                result_future.wait_for(0s) != future_status::ready)
+                break;
+
+            bool write = true;
+            if (result_future.valid()) {
+                try {
+                    features = result_future.get();
+                } catch (dropped_frame&) {
+                    ++dropped;
+                    write = false;
+                } catch (std::runtime_error& ex) {
+                    std::cerr << ex.what() << std::endl;
+                    write = false;
+                }
+            } else if (skip_unchanged) {
+                write = false;
+            }
+            if (write && !features.empty() && (!dedup || dedup->keep(features, click)))
+                write_sample(features, click, captured);
+            pending.pop_front();
+        }
+    };
 
 	input.get_press('b');
 
 
 	while (!quit) { 
 		timer.start();
-		auto pic = screen.screenshot();
-        auto result_future = img_proc.extract_feature_async(pic);
+        if (has_moved.exchange(false, memory_order_acq_rel)) {
+            cv::Rect r;
+            {
+                lock_guard<mutex> lck{moved_m};
+                r = moved_roi;
+            }
+            auto area = r + browser.tl();
+            if (r.size() != screen.get_capture_size()) {
+                // frames still in flight keep the old pool alive
+                frames = make_unique<MlFramePool>(frames->size(), r.size());
+                img_proc.update_roi(cv::Rect(cv::Point(0, 0), r.size()));
+            }
+            screen.set_capture_area(area);
+            if (detector)
+                detector->set_area(area);
+            cout << "game moved to " << area << endl;
+        }
+        if (detector)
+            detector->before_capture();
+		auto frame = screen.screenshot(*frames);
+        auto captured = chrono::system_clock::now();
+        bool changed = !detector || detector->changed(frame.mat()) || !submitted;
+        future<vector<float>> result_future;
+        if (changed) {
+            result_future = img_proc.extract_feature_async(std::move(frame));
+            submitted = true;
+        } else {
+            frame.release();
+        }
        	try {
             bool click = input.global_wait_click(input.LEFT_CLICK, timer.remaining());
-            auto r = result_future.get();
-            write_data(data_fs, data_label_fs, r, click);
+            pending.emplace_back(std::move(result_future), click, captured);
+            drain(max_pending - 1);
 
 	    } catch (std::runtime_error& ex) {
 		    std::cerr << ex.what() << std::endl;
 	    } 
 	}
+    tracker.reset();
+    drain(0);
+    try {
+        if (shard_writer)
+            shard_writer->close();
+        else
+            data_writer->close();
+    } catch (std::runtime_error& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+    if (shard_writer) {
+        cout << shard_writer->size() << " samples written to " << shard_writer->shards()
+             << " shards of " << store_path << " (" << store->size() << " samples in "
+             << store->shards().size() << " shards), " << shard_writer->dropped()
+             << " dropped by a slow disk, at most " << shard_writer->high_water() << " of "
+             << writer_options.buffers << " buffers waiting." << endl;
+    } else {
+        cout << data_writer->size() << " samples written to " << out_path
+             << ", " << data_writer->dropped() << " dropped by a slow disk, at most "
+             << data_writer->high_water() << " of " << writer_options.buffers
+             << " buffers waiting." << endl;
+    }
+    if (dropped)
+        cout << dropped << " frames dropped by backpressure." << endl;
+    if (dedup) {
+        const auto& stats = dedup->stats();
+        cout << "dedup: " << stats.kept << " of " << stats.seen << " samples kept, "
+             << stats.exact << " repeated and " << stats.near << " near-duplicates dropped, reduction ratio "
+             << stats.reduction_ratio() << endl;
+    }
+    if (incremental != incremental_mode::OFF) {
+        auto stats = img_proc.get_incremental_stats();
+        cout << "incremental: " << stats->reused << " boxes reused, "
+             << stats->recomputed << " recomputed, reuse ratio " << stats->reuse_ratio();
+        if (incremental == incremental_mode::VERIFY)
+            cout << ", " << stats->mismatched << " mismatched";
+        cout << endl;
+    }
 
 	return 0;
 }
 
-void signal_handle(int sig)
+void usage(const char* prog)
 {
-    if (sig == SIGINT)
-        quit = 1;
+    cerr << "usage: " << prog << " [-o data.bin] [-y seconds] [-z] [-s directory] [-n samples] [-d threshold] [-c damage|hash] [-k] [-f fused|reference|multi] [-w] [-j workers] [-q capacity] [-b block|oldest|newest] [-i on|verify] [-r seconds]" << endl;
 }
 
-template<typename Data_Con, typename Label>
-void write_data(ofstream& data_writer, 
-                ofstream& label_writer, 
-                Data_Con&& data,
-                Label&& label)
+// sessions are named by their local start time, e.g. 20240131-174502
+string session_name()
 {
-    ostringstream data_line;
-    bool not_first_write = false;
-    for (const auto& region : data) {
-        if (not_first_write) {
-            data_line << ',';
-        } else {
-            not_first_write = true;
-        }
-        data_line << region; // display all floating point
-    }
-    data_writer << data_line.str() << '\n';
-    label_writer << label << '\n';
+    time_t now = chrono::system_clock::to_time_t(chrono::system_clock::now());
+    tm local;
+    localtime_r(&now, &local);
+    char name[32];
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &local);
+    return name;
+}
+
+void signal_handle(int sig)
+{
+    if (sig == SIGINT)
+        quit = 1;
 }
@@ -0,0 +1,48 @@
+#ifndef BOXCOUNTER_H
+#define BOXCOUNTER_H
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Number of boxes a region of interest is split into along x and y.
+ * Boxes don't have to divide the roi evenly; box i along x spans
+ * [i * width / cols, (i + 1) * width / cols).
+ */
+struct grid_size {
+    int cols;
+    int rows;
+};
+
+/**
+ * IntegralBoxCounter reduces the path and player masks into summed-area
+ * tables once, after which the number of set pixels of any box is four
+ * lookups, so any number of grid resolutions cost O(1) per box.
+ */
+class IntegralBoxCounter {
+public:
+    /**
+     * build the summed-area tables of two equally sized 8-bit masks,
+     * pixels being either 0 or 255.
+     */
+    void reset(const cv::Mat& path_mask, const cv::Mat& player_mask);
+
+    /**
+     * append path counts then player counts of every box of the grid,
+     * column-major over boxes like the single scale features.
+     */
+    void count(const grid_size&, std::vector<float>&) const;
+
+    /**
+     * returns number of features count() appends for the given grids.
+     */
+    static std::size_t size(const std::vector<grid_size>&) noexcept;
+
+private:
+    void count_mask(const cv::Mat&, const std::vector<int>&, const std::vector<int>&,
+                    std::vector<float>&) const;
+
+    cv::Mat path_sum, player_sum;
+};
+
+#endif // BOXCOUNTER_H
@@ -0,0 +1,71 @@
+#ifndef COLORLUT_H
+#define COLORLUT_H
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "FeatureKernel.h"
+
+/**
+ * ColorLut is a quantized BGR lookup table of color_class masks, built once
+ * from feature_thresholds, HSV player rule included. Classifying a pixel is
+ * then a single load instead of three range tests and a BGR to HSV
+ * conversion, whatever the number of classes.
+ * Each channel keeps its top bits bits. At the default 8 bits (a 16 MiB
+ * table) every cell is a single colour and the table is exact. Below, a
+ * cell takes every class any of its colours has, so a class is never
+ * lost, but colours next to a class bound may be given it too.
+ */
+class ColorLut {
+public:
+    static constexpr int default_bits = 8;
+
+    explicit ColorLut(const feature_thresholds&, int bits = default_bits);
+
+    /**
+     * returns the default table of given thresholds, built once and shared
+     * by every thread; it's only built again for other thresholds.
+     */
+    static std::shared_ptr<const ColorLut> shared(const feature_thresholds&);
+
+    std::uint8_t classify(int b, int g, int r) const noexcept
+    {
+        return table[(((b >> shift) << bits) | (g >> shift)) << bits | (r >> shift)];
+    }
+
+    /**
+     * writes the masks of the reference chain for an 8-bit BGRA image:
+     * 255 in path where a pixel is path or coin, 255 in player where it's
+     * player, 0 elsewhere.
+     */
+    void classify_masks(const cv::Mat& bgra, cv::Mat& path, cv::Mat& player) const;
+
+    const feature_thresholds& get_thresholds() const noexcept;
+    int get_bits() const noexcept;
+
+private:
+    feature_thresholds thresholds;
+    int bits;
+    int shift;
+    std::vector<std::uint8_t> table;
+};
+
+/**
+ * color_class bits a ColorLut gets wrong for at least one colour.
+ * lost  : bits the colour has but its cell doesn't.
+ * extra : bits its cell has but the colour doesn't.
+ */
+struct color_lut_errors {
+    std::uint8_t lost = 0;
+    std::uint8_t extra = 0;
+
+    bool exact() const noexcept { return !lost && !extra; }
+};
+
+/**
+ * checks the table against feature_thresholds::classify on every 8-bit
+ * colour.
+ */
+color_lut_errors check_color_lut(const ColorLut&);
+
+#endif // COLORLUT_H
@@ -7,138 +7,229 @@
 #include <atomic>
 #include <memory>
 #include <condition_variable>
+#include <type_traits>
+#include "mlframe.h"
+#include "GridGeometry.h"
+#include "FeatureKernel.h"
+#include "ColorLut.h"
+#include "MaskKernels.h"
+#include "BoxCounter.h"
+#include "IncrementalBoxCounter.h"
+#include "PreviewVisualizer.h"
 
 enum class exec_status : std::int8_t { EMPTY, READY, ONGOING };
 
+/**
+ * REFERENCE : the original OpenCV chain (resize, median blur, closing,
+ *             classification, non-zero count per box), pixels classified
+ *             by the shared ColorLut, counts done by the mask kernels of
+ *             the CPU.
+ * FUSED     : single pass over the capture, see fused_box_counts().
+ *             Same features as REFERENCE, without its images.
+ * LUT       : same as FUSED, pixels classified by the shared ColorLut
+ *             instead of range tests and an HSV conversion each.
+ * MULTI_SCALE : masks of the reference chain over the roi of
+ *             default_geometry, whatever the geometry, reduced into
+ *             summed-area tables, then counted for every grid given by
+ *             set_grids().
+ */
+enum class feature_mode : std::int8_t { REFERENCE, FUSED, MULTI_SCALE, LUT };
+
 class ExtractFeatureExecutor {
 public:
     typedef std::vector<cv::Point> contour_type;
-    typedef std::unordered_map<std::string, std::unordered_map<std::string, cv::Scalar>> settings_type;
+    typedef feature_thresholds settings_type;
 
 
     ExtractFeatureExecutor();
     ~ExtractFeatureExecutor();
 
     exec_status get_status() noexcept;
-    void start(const cv::Rect&, settings_type&);
+    feature_mode get_mode() noexcept;
+    void set_mode(feature_mode) noexcept;
+    std::vector<grid_size> get_grids();
+    void set_grids(const std::vector<grid_size>&);
+    grid_geometry get_geometry();
+
+    /**
+     * Geometry of the box features, default_geometry by default.
+     * Throws std::invalid_argument if the boxes don't divide the roi.
+     */
+    void set_geometry(const grid_geometry&);
+
+    /**
+     * Incremental extraction applies to every mode but MULTI_SCALE, OFF
+     * by default. REFERENCE recomputes changed boxes with a FusedChain,
+     * which gives the pixels of its OpenCV calls, except while debug
+     * images are shown.
+     */
+    incremental_mode get_incremental() noexcept;
+    void set_incremental(incremental_mode) noexcept;
+
+    /**
+     * counters of the incremental extraction of this executor.
+     */
+    std::shared_ptr<const incremental_stats> get_incremental_stats() const noexcept;
+
+    /**
+     * Debug images of the reference chain are posted to the given
+     * visualizer. Passing nullptr (the default) disables them entirely.
+     */
+    void set_visualizer(std::shared_ptr<PreviewVisualizer>);
+    /**
+     * settings are copied, the executor never refers back to its caller.
+     */
+    void start(const cv::Rect&, const settings_type&);
+
+    /**
+     * Publish a new cropper, e.g. after the game moved. Frames submitted
+     * from now on are cropped by it, the ones already submitted aren't.
+     */
+    void set_cropper(const cv::Rect&);
+    cv::Rect get_cropper();
     void end();
 
-    template <std::size_t box_h = 40,
-              std::size_t box_w = 40, 
-              std::size_t roi_h = 840,
-              std::size_t roi_w = 480>
     std::future<std::vector<float>> operator()(const cv::Mat&);
 
+    /**
+     * Same as above but the frame handle is kept by the executor and
+     * released once its features are produced.
+     */
+    std::future<std::vector<float>> operator()(MlFrame);
+
+    struct task_options;
+    typedef std::vector<float> (*kernel_type)(const cv::Mat&,
+                                              const cv::Rect&,
+                                              const settings_type&,
+                                              const task_options&);
+
+    /**
+     * snapshot of the options a task runs with, taken at submission.
+     * kernel is the one find_kernel() returns for geometry.
+     */
+    struct task_options {
+        cv::Rect cropper;
+        feature_mode mode;
+        grid_geometry geometry;
+        kernel_type kernel;
+        incremental_mode incremental;
+        std::shared_ptr<incremental_stats> stats;
+        std::shared_ptr<const std::vector<grid_size>> grids;
+        std::shared_ptr<PreviewVisualizer> visualizer;
+    };
+
+    /**
+     * Extract the features of one image on the calling thread.
+     * This is what every task of the executor runs.
+     */
+    static std::vector<float> extract(const cv::Mat&,
+                                      const cv::Rect&,
+                                      const settings_type&,
+                                      const task_options&);
+
+    /**
+     * returns the kernel specialized at compile time for given geometry,
+     * or the generic one if there is none.
+     */
+    static kernel_type find_kernel(const grid_geometry&) noexcept;
+
+    /**
+     * returns the options a task submitted now would run with.
+     */
+    task_options get_task_options();
+
 private:
-    std::packaged_task<std::vector<float>(const cv::Rect&, settings_type&)> task;
+
+    std::future<std::vector<float>> submit(std::packaged_task<std::vector<float>(const settings_type&)>&&);
+
+    template <typename Geometry>
+    static std::vector<float> extract_with(const cv::Mat&,
+                                           const cv::Rect&,
+                                           const settings_type&,
+                                           const task_options&);
+
+    static std::vector<float> extract_reference(const cv::Mat&,
+                                                const cv::Rect&,
+                                                const settings_type&,
+                                                const grid_geometry&,
+                                                PreviewVisualizer*);
+
+    static std::vector<float> extract_multi_scale(const cv::Mat&,
+                                                  const cv::Rect&,
+                                                  const settings_type&,
+                                                  const std::vector<grid_size>&,
+                                                  PreviewVisualizer*);
+
+    /**
+     * returns the ColorLut of settings, shared by every worker.
+     */
+    static const ColorLut& color_lut(const settings_type&);
+
+    static void make_masks(const cv::Mat&,
+                           const cv::Rect&,
+                           const settings_type&,
+                           const grid_geometry&,
+                           cv::Mat&,
+                           cv::Mat&,
+                           PreviewVisualizer*);
+
+    std::packaged_task<std::vector<float>(const settings_type&)> task;
     std::atomic<exec_status> status;
+    std::atomic<feature_mode> mode;
+    cv::Rect cropper;
+    grid_geometry geometry;
+    kernel_type kernel;
+    std::atomic<incremental_mode> incremental;
+    std::shared_ptr<incremental_stats> stats;
+    std::shared_ptr<const std::vector<grid_size>> grids;
+    std::shared_ptr<PreviewVisualizer> visualizer;
+    std::mutex options_m;
     std::atomic_bool stop;
     std::condition_variable cv;
     std::mutex buffer_m;
     std::thread local_thread;
 };
 
-template <std::size_t box_h,
-          std::size_t box_w, 
-          std::size_t roi_h,
-          std::size_t roi_w>
-std::future<std::vector<float>>  ExtractFeatureExecutor::operator()(const cv::Mat& img)
+template <typename Geometry>
+std::vector<float> ExtractFeatureExecutor::extract_with(const cv::Mat& img,
+                                                        const cv::Rect& cropper,
+                                                        const settings_type& settings,
+                                                        const task_options& options)
 {
-
-    if (stop.load(std::memory_order_acquire))
-        throw std::logic_error("ExtractFeatureExecuter is suspended but being invoked.");
-    if (status.load(std::memory_order_acquire) != exec_status::EMPTY)
-        throw std::logic_error("buffer of ExtractFeatureExecuter is not empty but being revised.");
-
-    decltype(task) new_task([&](const cv::Rect& cropper, settings_type& settings) {
-
-            cv::Mat resized_img;
-            cv::Mat target_img;
-            cv::Mat coin_img, path_img, player_img;
-            cv::Mat pathway_img;
-            std::vector<contour_type> contours;
-
-            
-            // crop image
-            cv::Mat roi = img(cropper);
-
-            // resize image
-            constexpr int roi_area = roi_w * roi_h;
-        
-            constexpr double threshold_perc = 25 / 100;
-            constexpr int box_area = box_w * box_h;
-            constexpr int num_box_in_roi = roi_area / box_area;
-            constexpr int threshold = static_cast<int>(box_w * box_h * threshold_perc);
-            std::vector<float> features(num_box_in_roi * 2, 0.0f);
-
-            cv::cvtColor(roi, roi, cv::COLOR_BGRA2BGR);
-            cv::resize(roi, resized_img, cv::Size(roi_w, roi_h), 0, 0, CV_INTER_LINEAR);
-            cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT,
-                                                       cv::Size(2, 2));
-
-            cv::medianBlur(resized_img, resized_img, 3);
-            cv::morphologyEx(resized_img, target_img, cv::MORPH_CLOSE, kernel);
-            cv::imshow("preview", target_img);
-            auto& map_coin = settings["coin"];
-            auto& map_path = settings["path"];
-            auto& map_player = settings["player"];
-
-            //cv::inRange(target_img, cv::Scalar(0, 0, 0, 0), cv::Scalar(255, 255, 255, 255), coin_img);
-            cv::inRange(target_img, map_coin["min"], map_coin["max"], coin_img);
-            //cv::inRange(target_img, cv::Scalar(0, 200, 200), cv::Scalar(100, 255, 255), coin_img);
-            //cv::imshow("coin", coin_img);
-            cv::inRange(target_img, map_path["min"], map_path["max"], path_img);
-            cv::bitwise_or(coin_img, path_img, pathway_img);
-            cv::imshow("path", pathway_img);
-            cv::cvtColor(target_img, player_img, cv::COLOR_BGR2HSV);
-            cv::inRange(player_img, map_player["min"], map_player["max"], player_img);
-            //cv::inRange(player_img, cv::Scalar(0, 0, 0), cv::Scalar(255, 50, 255), player_img);
-            cv::imshow("player", player_img);
-            cv::waitKey(10);
-        
-            std::size_t index = 0;
-            // extract feature of pathway
-            for (int i = 0; i != pathway_img.cols; i += box_w) {
-                for (int j = 0; j != pathway_img.rows; j += box_h) {
-                    cv::Rect sub_roi_cropper(i, j, box_w, box_h);
-                    cv::Mat sub_roi = pathway_img(sub_roi_cropper);
-        
-                    /*
-                    if (cv::countNonZero(sub_roi) > threshold)
-                        features[index] = region_type::PATH;
-                    */
-                    features[index] = cv::countNonZero(sub_roi);
-        
-                    ++index;
-                }
-            }
-
-            // extract feature of player
-            for (int i = 0; i != player_img.cols; i += box_w) {
-                for (int j = 0; j != player_img.rows; j += box_h) {
-                    cv::Rect sub_roi_cropper(i, j, box_w, box_h);
-                    cv::Mat sub_roi = player_img(sub_roi_cropper);
-        
-                    /*
-                    if (cv::countNonZero(sub_roi) > threshold)
-                        features[index] = region_type::PLAYER;
-                    */
-                    features[index] = cv::countNonZero(sub_roi);
-        
-                    ++index;
-                }
-            }
-
-        
-            // hopefully NRVO applies here
-            return features;
-
-    });
-    task = std::move(new_task);
-    status.store(exec_status::READY, std::memory_order_release);
-    cv.notify_one();
-    return task.get_future();
-
+    // a fixed_geometry carries its values in its type
+    Geometry geometry;
+    if constexpr (std::is_same_v<Geometry, grid_geometry>)
+        geometry = options.geometry;
+
+    auto visualizer = options.visualizer.get();
+
+    switch (options.mode) {
+    case feature_mode::FUSED:
+        // the debug images only exist in the reference chain, which gives
+        // the same features
+        if (visualizer)
+            return extract_reference(img, cropper, settings, geometry, visualizer);
+        if (options.incremental != incremental_mode::OFF) {
+            thread_local IncrementalBoxCounter counter;
+            return counter.count(img(cropper), geometry, settings, settings, options.incremental, *options.stats);
+        }
+        return fused_box_counts(img(cropper), geometry, settings);
+    case feature_mode::LUT:
+        if (options.incremental != incremental_mode::OFF) {
+            thread_local IncrementalBoxCounter counter;
+            return counter.count(img(cropper), geometry, color_lut(settings), settings, options.incremental, *options.stats);
+        }
+        return fused_box_counts(img(cropper), geometry, color_lut(settings));
+    case feature_mode::MULTI_SCALE:
+        return extract_multi_scale(img, cropper, settings, *options.grids, visualizer);
+    default:
+        // the debug images need the whole chain
+        if (options.incremental != incremental_mode::OFF && !visualizer) {
+            thread_local IncrementalBoxCounter counter;
+            return counter.count(img(cropper), geometry, color_lut(settings), settings, options.incremental, *options.stats);
+        }
+        return extract_reference(img, cropper, settings, geometry, visualizer);
+    }
 }
 
 #endif
@@ -0,0 +1,124 @@
+#ifndef EXTRACTFEATUREPOOL_H
+#define EXTRACTFEATUREPOOL_H
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "mlframe.h"
+#include "ExtractFeatureExecutor.h"
+
+/**
+ * What ExtractFeaturePool does with a submission while its queue is full.
+ * BLOCK       : the submitting thread waits for a free place.
+ * DROP_OLDEST : the oldest queued frame is dropped to make room.
+ * DROP_NEWEST : the submitted frame itself is dropped.
+ */
+enum class backpressure : std::int8_t { BLOCK, DROP_OLDEST, DROP_NEWEST };
+
+/**
+ * dropped_frame is stored in the future of a frame dropped by backpressure.
+ */
+class dropped_frame : public std::runtime_error {
+public:
+    explicit dropped_frame(const std::string&);
+};
+
+/**
+ * ExtractFeaturePool is the N-worker counterpart of ExtractFeatureExecutor.
+ * Frames wait in a bounded queue and are extracted by any free worker, but
+ * their futures become ready strictly in submission order, so consuming
+ * them one after another never sees a later frame before an earlier one.
+ */
+class ExtractFeaturePool {
+public:
+    typedef ExtractFeatureExecutor::settings_type settings_type;
+
+    /**
+     * Constructor requires the number of workers and the number of frames
+     * which can wait in the queue.
+     */
+    ExtractFeaturePool(std::size_t workers,
+                       std::size_t capacity,
+                       backpressure = backpressure::BLOCK);
+    ~ExtractFeaturePool();
+
+    feature_mode get_mode() noexcept;
+    void set_mode(feature_mode) noexcept;
+    std::vector<grid_size> get_grids();
+    void set_grids(const std::vector<grid_size>&);
+    grid_geometry get_geometry();
+    void set_geometry(const grid_geometry&);
+    incremental_mode get_incremental() noexcept;
+    void set_incremental(incremental_mode) noexcept;
+    std::shared_ptr<const incremental_stats> get_incremental_stats() const noexcept;
+    void set_visualizer(std::shared_ptr<PreviewVisualizer>);
+    void start(const cv::Rect&, const settings_type&);
+    void set_cropper(const cv::Rect&);
+    cv::Rect get_cropper();
+    void end();
+
+    /**
+     * returns number of frames dropped by backpressure so far.
+     */
+    std::size_t dropped() const noexcept;
+
+    /**
+     * returns number of workers.
+     */
+    std::size_t size() const noexcept;
+
+    std::future<std::vector<float>> operator()(const cv::Mat&);
+    std::future<std::vector<float>> operator()(MlFrame);
+
+private:
+    typedef std::function<std::vector<float>(const settings_type&)> work_type;
+
+    struct job {
+        std::uint64_t seq;
+        work_type work;
+        std::promise<std::vector<float>> result;
+    };
+
+    ExtractFeatureExecutor::task_options get_task_options();
+    std::future<std::vector<float>> submit(work_type&&);
+    void run();
+    void publish(job&, std::vector<float>&&, std::exception_ptr);
+    void skip(std::uint64_t);
+
+    const std::size_t n_workers;
+    const std::size_t capacity;
+    const backpressure policy;
+
+    std::deque<job> queue;
+    std::uint64_t next_seq, next_publish;
+    std::set<std::uint64_t> skipped;
+
+    settings_type settings;
+
+    std::atomic<feature_mode> mode;
+    cv::Rect cropper;
+    grid_geometry geometry;
+    ExtractFeatureExecutor::kernel_type kernel;
+    std::atomic<incremental_mode> incremental;
+    std::shared_ptr<incremental_stats> stats;
+    std::shared_ptr<const std::vector<grid_size>> grids;
+    std::shared_ptr<PreviewVisualizer> visualizer;
+    std::mutex options_m;
+
+    std::atomic_bool stop;
+    std::atomic<std::size_t> dropped_count;
+    std::mutex m;
+    std::condition_variable not_empty, not_full, turn;
+    std::vector<std::thread> workers;
+};
+
+#endif // EXTRACTFEATUREPOOL_H
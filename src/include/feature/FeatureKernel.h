@@ -0,0 +1,176 @@
+#ifndef FEATUREKERNEL_H
+#define FEATUREKERNEL_H
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "GridGeometry.h"
+#include "FusedChain.h"
+
+/**
+ * Inclusive per-channel range of a colour class, channels in the same
+ * order as the pixels being tested (B, G, R or H, S, V).
+ */
+struct color_range {
+    std::uint8_t min[3];
+    std::uint8_t max[3];
+
+    constexpr bool contains(int c0, int c1, int c2) const noexcept
+    {
+        return min[0] <= c0 && c0 <= max[0] &&
+               min[1] <= c1 && c1 <= max[1] &&
+               min[2] <= c2 && c2 <= max[2];
+    }
+
+    constexpr bool valid() const noexcept
+    {
+        return min[0] <= max[0] && min[1] <= max[1] && min[2] <= max[2];
+    }
+
+    /**
+     * bounds for cv::inRange.
+     */
+    cv::Scalar lower() const { return cv::Scalar(min[0], min[1], min[2]); }
+    cv::Scalar upper() const { return cv::Scalar(max[0], max[1], max[2]); }
+};
+
+/**
+ * Bits of a colour class mask, as returned by the classifiers below.
+ */
+struct color_class {
+    static constexpr std::uint8_t PATH = 1 << 0;
+    static constexpr std::uint8_t COIN = 1 << 1;
+    static constexpr std::uint8_t PLAYER = 1 << 2;
+};
+
+/**
+ * Colour classes used by the features, compiled once from the settings
+ * file and copied into every executor.
+ * path and coin are tested in BGR, player is tested in HSV.
+ */
+struct feature_thresholds {
+    color_range path;
+    color_range coin;
+    color_range player;
+
+    constexpr bool valid() const noexcept
+    {
+        return path.valid() && coin.valid() && player.valid();
+    }
+
+    /**
+     * returns the color_class mask of one BGR pixel.
+     */
+    std::uint8_t classify(int b, int g, int r) const noexcept;
+};
+
+inline bool operator==(const color_range& lhs, const color_range& rhs) noexcept
+{
+    return std::equal(lhs.min, lhs.min + 3, rhs.min) &&
+           std::equal(lhs.max, lhs.max + 3, rhs.max);
+}
+
+inline bool operator==(const feature_thresholds& lhs, const feature_thresholds& rhs) noexcept
+{
+    return lhs.path == rhs.path && lhs.coin == rhs.coin && lhs.player == rhs.player;
+}
+
+/**
+ * convert one 8-bit BGR pixel to 8-bit HSV exactly like
+ * cv::cvtColor(..., cv::COLOR_BGR2HSV) does, i.e. H in [0, 180).
+ */
+inline void bgr_to_hsv(int b, int g, int r, int& h, int& s, int& v) noexcept
+{
+    constexpr int hsv_shift = 12;
+    constexpr int round_delta = 1 << (hsv_shift - 1);
+
+    // same fixed point division tables as OpenCV
+    static const auto tables = [] {
+        std::array<std::array<int, 256>, 2> t{};
+        for (int i = 1; i != 256; ++i) {
+            t[0][i] = static_cast<int>(std::lrint((255 << hsv_shift) / (1. * i)));
+            t[1][i] = static_cast<int>(std::lrint((180 << hsv_shift) / (6. * i)));
+        }
+        return t;
+    }();
+    const auto& sdiv_table = tables[0];
+    const auto& hdiv_table = tables[1];
+
+    v = std::max(b, std::max(g, r));
+    int vmin = std::min(b, std::min(g, r));
+    int diff = v - vmin;
+    int vr = v == r ? -1 : 0;
+    int vg = v == g ? -1 : 0;
+
+    s = (diff * sdiv_table[v] + round_delta) >> hsv_shift;
+    h = (vr & (g - b)) + (~vr & ((vg & (b - r + 2 * diff)) + ((~vg) & (r - g + 4 * diff))));
+    h = (h * hdiv_table[diff] + round_delta) >> hsv_shift;
+    h += h < 0 ? 180 : 0;
+}
+
+inline std::uint8_t feature_thresholds::classify(int b, int g, int r) const noexcept
+{
+    int h, s, v;
+    bgr_to_hsv(b, g, r, h, s, v);
+
+    return (path.contains(b, g, r) ? color_class::PATH : 0) |
+           (coin.contains(b, g, r) ? color_class::COIN : 0) |
+           (player.contains(h, s, v) ? color_class::PLAYER : 0);
+}
+
+/**
+ * Fused feature kernel.
+ * It computes the reference chain, i.e. linear resize onto the
+ * roi_w x roi_h grid of the geometry, 3x3 median blur and 2x2 closing,
+ * in a single pass over the cropped BGRA capture with a FusedChain,
+ * classifies each output pixel as it comes out and accumulates per-box
+ * path and player counts directly, without intermediate images.
+ * The pixels are bit-equal to the reference ones, so given the
+ * feature_thresholds as classifier these are the reference features.
+ * Features are laid out the same as the reference:
+ * path counts then player counts, each column-major over boxes.
+ * Geometry is either a grid_geometry or a fixed_geometry, the latter giving
+ * the compiler constant loop bounds.
+ * Pixels are classified by classes.classify(b, g, r), which is either the
+ * feature_thresholds themselves or a ColorLut compiled from them.
+ */
+template <typename Geometry, typename Classifier>
+std::vector<float> fused_box_counts(const cv::Mat& roi, const Geometry& geometry, const Classifier& classes)
+{
+    const int box_h = geometry.box_h;
+    const int box_w = geometry.box_w;
+    const int boxes_y = geometry.rows();
+    const int boxes_x = geometry.cols();
+    const int num_box_in_roi = geometry.boxes();
+
+    // chain buffers and the counts, reused between frames of this thread
+    thread_local FusedChain chain;
+    thread_local std::vector<int> counts;
+    chain.prepare(roi.size(), cv::Size(geometry.roi_w, geometry.roi_h));
+    counts.assign(num_box_in_roi * 2, 0);
+
+    chain.run(roi, cv::Rect(0, 0, geometry.roi_w, geometry.roi_h), [&](int y, const std::uint8_t *row) {
+        int by = y / box_h;
+
+        for (int bx = 0; bx != boxes_x; ++bx) {
+            int path_count = 0, player_count = 0;
+
+            for (int x = bx * box_w; x != (bx + 1) * box_w; ++x) {
+                const std::uint8_t *px = row + x * 4;
+                std::uint8_t mask = classes.classify(px[0], px[1], px[2]);
+
+                path_count += (mask & (color_class::PATH | color_class::COIN)) != 0;
+                player_count += (mask & color_class::PLAYER) != 0;
+            }
+            counts[bx * boxes_y + by] += path_count;
+            counts[num_box_in_roi + bx * boxes_y + by] += player_count;
+        }
+    });
+
+    return std::vector<float>(counts.begin(), counts.end());
+}
+
+#endif // FEATUREKERNEL_H
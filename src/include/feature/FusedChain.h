@@ -0,0 +1,72 @@
+#ifndef FUSEDCHAIN_H
+#define FUSEDCHAIN_H
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/**
+ * FusedChain computes the image the reference chain classifies, i.e. the
+ * BGRA crop resized to the roi with cv::INTER_LINEAR, then
+ * cv::medianBlur(3), then cv::morphologyEx(cv::MORPH_CLOSE) with a 2x2
+ * rect, without any intermediate image: output rows are streamed through
+ * a few rolling row buffers per step.
+ * The arithmetic is OpenCV's own, i.e. its fixed point resize
+ * coefficients and rounding, and its borders for the median (replicated)
+ * and the closing (ignored). So every pixel is bit-equal to the one the
+ * OpenCV calls give.
+ * Any rect of the output can be computed on its own, e.g. a single box,
+ * and gets the same pixels the whole image has there.
+ * It isn't shared, every worker thread keeps one.
+ */
+class FusedChain {
+public:
+    /**
+     * receives row y of the rect being computed, its BGRA pixels from the
+     * left edge of the rect.
+     */
+    typedef std::function<void(int y, const std::uint8_t *row)> row_callback;
+
+    /**
+     * an output pixel depends on resized pixels up to halo_before rows
+     * and columns before it and halo_after after it.
+     */
+    static constexpr int halo_before = 3;
+    static constexpr int halo_after = 1;
+
+    /**
+     * sets the size of the crop and of the output, the coefficients are
+     * only computed again if either changed.
+     */
+    void prepare(const cv::Size& src, const cv::Size& dst);
+
+    /**
+     * computes the rows of area, top to bottom, from the BGRA crop of
+     * the size given to prepare().
+     */
+    void run(const cv::Mat& src, const cv::Rect& area, const row_callback&);
+
+    /**
+     * returns the rect of the crop the pixels of area are computed from.
+     */
+    cv::Rect source_area(const cv::Rect& area) const;
+
+    const cv::Size& src_size() const noexcept { return src; }
+    const cv::Size& dst_size() const noexcept { return dst; }
+
+private:
+    const std::int32_t *horizontal(const cv::Mat&, int sy, int x0, int x1);
+
+    cv::Size src, dst;
+    // source column and row, and the weights of it and the next one
+    std::vector<int> x_ofs, y_ofs;
+    std::vector<std::int16_t> alpha, beta;
+
+    // horizontally resized source rows, tagged by their row
+    std::vector<std::int32_t> h_rows[2];
+    int h_tags[2] = { -1, -1 };
+    int h_next = 0;
+    std::vector<std::uint8_t> resized[3], median[2], dilated[2], closed;
+};
+
+#endif // FUSEDCHAIN_H
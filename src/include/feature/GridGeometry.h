@@ -0,0 +1,78 @@
+#ifndef GRIDGEOMETRY_H
+#define GRIDGEOMETRY_H
+#include <cstddef>
+
+/**
+ * Geometry of the box features: the roi is resized to roi_w x roi_h and
+ * split into boxes of box_w x box_h, which have to divide it evenly.
+ * Every box gives a path count and a player count.
+ */
+struct grid_geometry {
+    int box_h;
+    int box_w;
+    int roi_h;
+    int roi_w;
+
+    constexpr int cols() const noexcept { return roi_w / box_w; }
+    constexpr int rows() const noexcept { return roi_h / box_h; }
+    constexpr int boxes() const noexcept { return cols() * rows(); }
+
+    /**
+     * returns number of features, i.e. 2 per box.
+     */
+    constexpr std::size_t size() const noexcept { return 2 * static_cast<std::size_t>(boxes()); }
+
+    constexpr bool valid() const noexcept
+    {
+        return box_h > 0 && box_w > 0 && roi_h > 0 && roi_w > 0 &&
+               roi_h % box_h == 0 && roi_w % box_w == 0;
+    }
+
+    /**
+     * geometry of a grid of cols x rows boxes over given roi size.
+     */
+    static constexpr grid_geometry from_grid(int cols, int rows, int roi_w, int roi_h) noexcept
+    {
+        return { rows > 0 ? roi_h / rows : 0, cols > 0 ? roi_w / cols : 0, roi_h, roi_w };
+    }
+};
+
+constexpr bool operator==(const grid_geometry& lhs, const grid_geometry& rhs) noexcept
+{
+    return lhs.box_h == rhs.box_h && lhs.box_w == rhs.box_w &&
+           lhs.roi_h == rhs.roi_h && lhs.roi_w == rhs.roi_w;
+}
+
+constexpr bool operator!=(const grid_geometry& lhs, const grid_geometry& rhs) noexcept
+{
+    return !(lhs == rhs);
+}
+
+/**
+ * Same interface as grid_geometry but known at compile time, so kernels
+ * instantiated with it get constant loop bounds.
+ */
+template <int box_h_, int box_w_, int roi_h_, int roi_w_>
+struct fixed_geometry {
+    static_assert(roi_h_ % box_h_ == 0 && roi_w_ % box_w_ == 0,
+                  "roi has to be divisible into boxes");
+
+    static constexpr int box_h = box_h_;
+    static constexpr int box_w = box_w_;
+    static constexpr int roi_h = roi_h_;
+    static constexpr int roi_w = roi_w_;
+
+    static constexpr int cols() noexcept { return roi_w / box_w; }
+    static constexpr int rows() noexcept { return roi_h / box_h; }
+    static constexpr int boxes() noexcept { return cols() * rows(); }
+    static constexpr std::size_t size() noexcept { return 2 * static_cast<std::size_t>(boxes()); }
+
+    constexpr operator grid_geometry() const noexcept { return { box_h, box_w, roi_h, roi_w }; }
+};
+
+/**
+ * 12 x 21 boxes of 40 x 40 over a 480 x 840 roi, the original features.
+ */
+typedef fixed_geometry<40, 40, 840, 480> default_geometry;
+
+#endif // GRIDGEOMETRY_H
@@ -0,0 +1,135 @@
+#ifndef INCREMENTALBOXCOUNTER_H
+#define INCREMENTALBOXCOUNTER_H
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "GridGeometry.h"
+#include "FeatureKernel.h"
+#include "FusedChain.h"
+#include "TileHash.h"
+
+/**
+ * OFF    : every box is computed from scratch.
+ * ON     : boxes whose source tile didn't change reuse their last counts.
+ * VERIFY : same as ON, but reused boxes are computed anyway and compared,
+ *          mismatches are counted and the computed counts win.
+ */
+enum class incremental_mode : std::int8_t { OFF, ON, VERIFY };
+
+/**
+ * Counters of the incremental extraction, shared by every worker.
+ */
+struct incremental_stats {
+    std::atomic<std::size_t> reused{0};
+    std::atomic<std::size_t> recomputed{0};
+    std::atomic<std::size_t> mismatched{0};
+
+    /**
+     * returns the share of reused boxes, 0 before any box is counted.
+     */
+    double reuse_ratio() const noexcept;
+};
+
+/**
+ * IncrementalBoxCounter gives the same counts as fused_box_counts() but
+ * keeps them between frames. Every box hashes its source tile, i.e. the
+ * pixels of the capture its pixels are computed from, including the ones
+ * the median blur and closing reach beyond the box, and only boxes whose
+ * hash changed are computed and classified again. A different roi size,
+ * geometry or thresholds start over.
+ * It isn't shared, every worker thread keeps one.
+ */
+class IncrementalBoxCounter {
+public:
+    template <typename Geometry, typename Classifier>
+    std::vector<float> count(const cv::Mat& roi,
+                             const Geometry&,
+                             const Classifier&,
+                             const feature_thresholds&,
+                             incremental_mode,
+                             incremental_stats&);
+
+private:
+    void prepare(const cv::Mat&, const grid_geometry&, const feature_thresholds&);
+
+    template <typename Geometry, typename Classifier>
+    void count_box(const cv::Mat&, const Geometry&, const Classifier&,
+                   int bx, int by, int& path_count, int& player_count);
+
+    grid_geometry geometry{};
+    cv::Size roi_size;
+    feature_thresholds thresholds{};
+    bool primed = false;
+    FusedChain chain;
+    std::vector<cv::Range> tile_cols, tile_rows;
+    std::vector<std::uint64_t> hashes, new_hashes;
+    std::vector<int> counts;
+};
+
+template <typename Geometry, typename Classifier>
+std::vector<float> IncrementalBoxCounter::count(const cv::Mat& roi,
+                                                const Geometry& geometry,
+                                                const Classifier& classes,
+                                                const feature_thresholds& settings,
+                                                incremental_mode mode,
+                                                incremental_stats& stats)
+{
+    prepare(roi, geometry, settings);
+    hash_tiles(roi, tile_cols, tile_rows, new_hashes);
+
+    const int boxes_x = geometry.cols();
+    const int boxes_y = geometry.rows();
+    const int num_box_in_roi = geometry.boxes();
+    std::size_t reused = 0, mismatched = 0;
+
+    for (int bx = 0; bx != boxes_x; ++bx) {
+        for (int by = 0; by != boxes_y; ++by) {
+            const int i = bx * boxes_y + by;
+            bool same = primed && hashes[i] == new_hashes[i];
+            reused += same;
+            if (same && mode != incremental_mode::VERIFY)
+                continue;
+
+            int path_count, player_count;
+            count_box(roi, geometry, classes, bx, by, path_count, player_count);
+            if (same)
+                mismatched += path_count != counts[i] || player_count != counts[num_box_in_roi + i];
+            counts[i] = path_count;
+            counts[num_box_in_roi + i] = player_count;
+        }
+    }
+    hashes.swap(new_hashes);
+    primed = true;
+
+    stats.reused.fetch_add(reused, std::memory_order_relaxed);
+    stats.recomputed.fetch_add(num_box_in_roi - reused, std::memory_order_relaxed);
+    stats.mismatched.fetch_add(mismatched, std::memory_order_relaxed);
+
+    return std::vector<float>(counts.begin(), counts.end());
+}
+
+template <typename Geometry, typename Classifier>
+void IncrementalBoxCounter::count_box(const cv::Mat& roi,
+                                      const Geometry& geometry,
+                                      const Classifier& classes,
+                                      int bx, int by,
+                                      int& path_count, int& player_count)
+{
+    const int box_h = geometry.box_h;
+    const int box_w = geometry.box_w;
+    path_count = player_count = 0;
+
+    chain.run(roi, cv::Rect(bx * box_w, by * box_h, box_w, box_h), [&](int, const std::uint8_t *row) {
+        for (int x = 0; x != box_w; ++x) {
+            const std::uint8_t *px = row + x * 4;
+            std::uint8_t mask = classes.classify(px[0], px[1], px[2]);
+
+            path_count += (mask & (color_class::PATH | color_class::COIN)) != 0;
+            player_count += (mask & color_class::PLAYER) != 0;
+        }
+    });
+}
+
+#endif // INCREMENTALBOXCOUNTER_H
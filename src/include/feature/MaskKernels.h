@@ -0,0 +1,65 @@
+#ifndef MASKKERNELS_H
+#define MASKKERNELS_H
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "FeatureKernel.h"
+
+/**
+ * Instruction sets the mask kernels are written for, from slowest to fastest.
+ */
+enum class simd_level : std::int8_t { SCALAR, SSE42, AVX2, AVX512 };
+
+/**
+ * One implementation of the mask kernels.
+ *
+ * range_mask : for n BGRA pixels, writes 255 where B, G, R is in either of
+ *              the two ranges and 0 elsewhere, alpha is ignored. Same result
+ *              as cv::inRange on the BGR image of each range, or'ed.
+ * pack_bits  : for n bytes, sets bit i % 64 of bits[i / 64] where byte i is
+ *              non-zero. bits has to hold (n + 63) / 64 words.
+ */
+struct mask_kernels {
+    simd_level level;
+    void (*range_mask)(const std::uint8_t *bgra, std::size_t n,
+                       const color_range&, const color_range&,
+                       std::uint8_t *mask);
+    void (*pack_bits)(const std::uint8_t *src, std::size_t n, std::uint64_t *bits);
+};
+
+/**
+ * returns the fastest level supported by this CPU, detected once.
+ */
+simd_level best_simd_level() noexcept;
+
+/**
+ * returns the kernels of given level.
+ * Throws std::invalid_argument if the CPU doesn't support it.
+ */
+const mask_kernels& get_mask_kernels(simd_level);
+
+/**
+ * returns the kernels of best_simd_level().
+ */
+const mask_kernels& get_mask_kernels() noexcept;
+
+/**
+ * path mask of a BGRA image: 255 where the pixel is path or coin.
+ */
+void range_mask(const cv::Mat& bgra, const color_range&, const color_range&, cv::Mat& mask);
+
+/**
+ * adds the number of non-zero pixels of every box_w x box_h box of an 8-bit
+ * mask to counts, column-major like the features, i.e.
+ * counts[bx * boxes_y + by]. The mask has to be divisible into boxes.
+ */
+void count_boxes(const cv::Mat& mask, int box_w, int box_h, float *counts);
+
+/**
+ * checks every level supported by this CPU is bit-exact against SCALAR on
+ * random and edge case input. Returns the levels which are not.
+ */
+std::vector<simd_level> check_mask_kernels();
+
+#endif // MASKKERNELS_H
@@ -0,0 +1,60 @@
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Runs body(i) for every i in [0, n) on given number of threads, the calling
+ * thread being one of them; 0 threads means one per core.
+ * Every thread starts with an even share of the indices and, once it runs
+ * out, steals half of what is left to another thread, so uneven costs
+ * don't leave cores idle.
+ * If a body throws, no new indices are started and the first exception is
+ * rethrown once every thread has finished.
+ */
+void parallel_for(std::size_t n, std::size_t threads, const std::function<void(std::size_t)>& body);
+
+struct parallel_job;
+
+/**
+ * ParallelWorkers is parallel_for() on threads started once, so many runs
+ * in a row share the same threads and with them their thread_local state,
+ * e.g. the ColorLut and IncrementalBoxCounter of the kernels.
+ * init is called once on every thread before its first body. The calling
+ * thread of run() only waits, and one run() is done at a time.
+ */
+class ParallelWorkers {
+public:
+    /**
+     * 0 threads means one per core.
+     */
+    explicit ParallelWorkers(std::size_t threads = 0, std::function<void()> init = nullptr);
+    ParallelWorkers(const ParallelWorkers&) = delete;
+    ParallelWorkers& operator=(const ParallelWorkers&) = delete;
+    ~ParallelWorkers();
+
+    /**
+     * same as parallel_for() on these threads.
+     */
+    void run(std::size_t n, const std::function<void(std::size_t)>& body);
+    std::size_t size() const noexcept;
+
+private:
+    void work(std::size_t self, const std::function<void()>& init);
+
+    std::vector<std::thread> workers;
+    std::mutex run_m;
+    std::mutex m;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    parallel_job *job;
+    std::size_t generation;
+    std::size_t pending;
+    bool stop;
+};
+
+#endif // PARALLELFOR_H
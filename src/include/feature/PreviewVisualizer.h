@@ -0,0 +1,54 @@
+#ifndef PREVIEWVISUALIZER_H
+#define PREVIEWVISUALIZER_H
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * PreviewVisualizer shows debug images in HighGUI windows from its own
+ * thread, so that extraction never pumps GUI events itself.
+ * Posting an image only copies it into the window's mailbox; if the
+ * previous image of that window hasn't been shown yet it is dropped.
+ */
+class PreviewVisualizer {
+public:
+    PreviewVisualizer();
+    PreviewVisualizer(const PreviewVisualizer&) = delete;
+    PreviewVisualizer& operator=(const PreviewVisualizer&) = delete;
+    ~PreviewVisualizer();
+
+    /**
+     * post the latest image of given window. Never waits for the GUI.
+     */
+    void post(const std::string&, const cv::Mat&);
+
+    /**
+     * returns number of posted images replaced before being shown.
+     */
+    std::size_t dropped() const noexcept;
+
+private:
+    struct mailbox {
+        cv::Mat pending;
+        cv::Mat shown;
+        bool fresh = false;
+    };
+
+    void run();
+
+    std::map<std::string, mailbox> windows;
+    // some window has a fresh image, wakes up run()
+    bool posted = false;
+    std::atomic<std::size_t> dropped_count;
+    std::atomic_bool stop;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread local_thread;
+};
+
+#endif // PREVIEWVISUALIZER_H
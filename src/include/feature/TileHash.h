@@ -0,0 +1,34 @@
+#ifndef TILEHASH_H
+#define TILEHASH_H
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Cheap, non-cryptographic hash of every tile of an 8-bit image.
+ * Tiles are given by their edges: tile (i, j) spans columns
+ * [col_edges[i], col_edges[i + 1]) and rows [row_edges[j], row_edges[j + 1]).
+ * Hashes are written column-major, i.e. hashes[i * (row_edges.size() - 1) + j],
+ * which is the same order as the box features.
+ */
+void hash_tiles(const cv::Mat&,
+                const std::vector<int>& col_edges,
+                const std::vector<int>& row_edges,
+                std::vector<std::uint64_t>& hashes);
+
+/**
+ * Same as hash_tiles but tile (i, j) spans cols[i] and rows[j], which may
+ * overlap or leave gaps between tiles.
+ */
+void hash_tiles(const cv::Mat&,
+                const std::vector<cv::Range>& cols,
+                const std::vector<cv::Range>& rows,
+                std::vector<std::uint64_t>& hashes);
+
+/**
+ * returns edges splitting given length into tiles of given size.
+ * The last tile is shorter if the length isn't a multiple of the tile size.
+ */
+std::vector<int> uniform_tile_edges(int length, int tile);
+
+#endif // TILEHASH_H
@@ -0,0 +1,97 @@
+#ifndef MLCHANGE_H
+#define MLCHANGE_H
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "mldisplay.h"
+
+class MlChangeDetector;
+struct damage_tracker;
+
+/**
+ * change_mode decides how MlChangeDetector finds out whether the captured
+ * area has changed since the previous frame.
+ * 	DAMAGE	  : ask the X server through the DAMAGE extension, which costs
+ * 		    nothing per pixel.
+ * 	TILE_HASH : hash every tile of the captured frame and compare it
+ * 		    with the hashes of the previous frame.
+ */
+enum class change_mode : std::int8_t { DAMAGE, TILE_HASH };
+
+/**
+ * MlChangeDetector reports whether the captured area changed since
+ * the last frame, so that unchanged frames don't have to be processed.
+ */
+class MlChangeDetector {
+public:
+	/**
+	 * Constructor requires the display object the frames are captured
+	 * from and the area of screen to watch in root window coordinates.
+	 * If change_mode::DAMAGE is requested but the X server doesn't
+	 * offer DAMAGE, the detector falls back to change_mode::TILE_HASH.
+	 */
+	MlChangeDetector(MlDisplay&, const cv::Rect&, change_mode = change_mode::DAMAGE);
+
+	/**
+	 * Copying is disabled since a damage object is bound to this object.
+	 */
+	MlChangeDetector(const MlChangeDetector&) = delete;
+	MlChangeDetector& operator=(const MlChangeDetector&) = delete;
+	~MlChangeDetector();
+
+	// public member functions
+
+	/**
+	 * This function resets area of screen being watched.
+	 * The next call of changed() always returns true.
+	 */
+	void set_area(const cv::Rect&);
+
+	/**
+	 * This function is called right before a frame of the watched area
+	 * is captured. In change_mode::DAMAGE it collects the damage reported
+	 * so far, which the frame about to be captured contains.
+	 * It does nothing in change_mode::TILE_HASH.
+	 */
+	void before_capture();
+
+	/**
+	 * This function is called right after a frame of the watched area
+	 * has been captured. It returns false only if the frame is the same
+	 * as the previous one. The first frame always counts as changed.
+	 * In change_mode::DAMAGE, the frame itself isn't read. The damage
+	 * collected here landed during or after the capture, so it makes
+	 * both this frame and the next one count as changed. Without
+	 * before_capture() every damage is collected here.
+	 */
+	bool changed(const cv::Mat&);
+
+	/**
+	 * This function returns the change mode actually in use.
+	 */
+	change_mode get_mode() const noexcept;
+
+	/**
+	 * size of square tiles being hashed in change_mode::TILE_HASH.
+	 */
+	static constexpr int tile_size = 40;
+private:
+	// private member functions
+	bool damage_changed();
+	bool drain_damage();
+	bool tile_hash_changed(const cv::Mat&);
+
+	// private data variables
+	MlDisplay& display;
+	cv::Rect area;
+	change_mode mode;
+	bool primed;
+	bool dirty;
+	bool carry;
+	std::unique_ptr<damage_tracker> damage;
+	std::vector<std::uint64_t> hashes, prev_hashes;
+	std::vector<int> col_edges, row_edges;
+};
+
+#endif // MLCHANGE_H
@@ -0,0 +1,74 @@
+#ifndef MLCODEC_H
+#define MLCODEC_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Compact encoding of dataset records, dataset_dtype::DELTA_U16.
+ * Features are box pixel counts, so they are quantized to uint16, which
+ * is exact for every box of up to 65535 pixels. Every record stores the
+ * zigzag delta of each feature against the previous record of its block,
+ * as varints: the length of a run of unchanged features, then the delta
+ * of the next changed one, and so on. Timestamp and label are zigzag
+ * varint deltas as well.
+ * A block is a block_header and records encoded against one another, the
+ * first one against zeros, so blocks can be decoded on their own.
+ */
+struct block_header {
+    std::uint32_t bytes;     // encoded records following the header
+    std::uint32_t records;
+};
+
+static_assert(sizeof(block_header) == 8, "block_header is written as is");
+
+class FeatureEncoder {
+public:
+    explicit FeatureEncoder(std::size_t features);
+
+    /**
+     * starts a new block.
+     */
+    void reset();
+
+    /**
+     * encodes a record into out, which has max_record_size() bytes,
+     * and returns its size.
+     */
+    std::size_t encode(const float* features, int label, std::int64_t timestamp, char* out);
+
+    /**
+     * returns the largest size of an encoded record of given features.
+     */
+    static std::size_t max_record_size(std::size_t features) noexcept;
+
+private:
+    std::vector<std::uint16_t> prev;
+    std::int64_t prev_timestamp;
+    int prev_label;
+};
+
+class FeatureDecoder {
+public:
+    explicit FeatureDecoder(std::size_t features);
+
+    /**
+     * starts a new block.
+     */
+    void reset();
+
+    /**
+     * decodes the record at p, which ends before end, into features,
+     * label and timestamp and returns where the next record starts.
+     * Throws std::runtime_error if the record is corrupt.
+     */
+    const char* decode(const char* p, const char* end, float* features, int& label, std::int64_t& timestamp);
+
+private:
+    std::vector<std::uint16_t> prev;
+    std::vector<std::uint16_t> delta;
+    std::int64_t prev_timestamp;
+    int prev_label;
+};
+
+#endif // MLCODEC_H
@@ -8,7 +8,28 @@
 #include <random>
 #include <iterator>
 #include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <string>
 #include <type_traits>
+#include "mlmatrix.h"
+
+/**
+ * Reads a csv file of numbers into a FeatureMatrix, one row per line.
+ * The file is memory mapped and split into newline aligned chunks, which
+ * are parsed in parallel on given number of threads (0 for one per core).
+ * Empty lines are skipped.
+ * Throws std::runtime_error if it can't be read, a field isn't a number
+ * or the rows don't have the same number of fields.
+ */
+FeatureMatrix load_csv(const std::string&, std::size_t threads = 0);
+
+/**
+ * Same as load_data() but keeps the features in one FeatureMatrix.
+ */
+std::tuple<FeatureMatrix, std::vector<int>>
+load_matrix(const std::string& X_path, const std::string& Y_path);
 
 template <template <typename> typename XType=std::vector,
           template <typename> typename XLineType=std::vector,
@@ -41,38 +62,157 @@ template <typename XType,
           typename YTypeRaw = std::decay_t<YType>>
 std::tuple<XTypeRaw, YTypeRaw> balance_dataset(XType&&, YType&&);
 
-template <template <typename> typename XType=std::vector,
-          template <typename> typename XLineType=std::vector,
-          typename XValueType=float,
-          template <typename> typename YType=std::vector,
-          typename YValueType=int>
+/**
+ * dataset_view is a list of row indices into a dataset it doesn't own,
+ * so shuffling, splitting and balancing a view only moves indices.
+ * Views made from one another share their index where they can: a split
+ * is two spans of the same index. The dataset has to outlive its views.
+ */
+template <typename XType, typename YType>
+class dataset_view {
+public:
+    typedef std::vector<std::size_t> index_type;
+
+    /**
+     * all rows of the dataset in order.
+     */
+    dataset_view(const XType& X, const YType& Y)
+        : X(&X), Y(&Y), first(0), last(Y.size())
+    {
+        auto all = std::make_shared<index_type>(Y.size());
+        for (std::size_t i = 0; i != all->size(); ++i)
+            (*all)[i] = i;
+        index = std::move(all);
+    }
+
+    /**
+     * rows index[first, last) of the dataset.
+     */
+    dataset_view(const XType& X,
+                 const YType& Y,
+                 std::shared_ptr<const index_type> index,
+                 std::size_t first,
+                 std::size_t last)
+        : X(&X), Y(&Y), index(std::move(index)), first(first), last(last) { }
+
+    std::size_t size() const noexcept { return last - first; }
+    bool empty() const noexcept { return first == last; }
+
+    /**
+     * returns the row of the dataset the i-th row of the view refers to.
+     */
+    std::size_t source_row(std::size_t i) const noexcept { return (*index)[first + i]; }
+    decltype(auto) x(std::size_t i) const { return (*X)[source_row(i)]; }
+    decltype(auto) y(std::size_t i) const { return (*Y)[source_row(i)]; }
+
+    /**
+     * rows [begin, end) of this view, sharing its index.
+     */
+    dataset_view subview(std::size_t begin, std::size_t end) const
+    {
+        return dataset_view(*X, *Y, index, first + begin, first + end);
+    }
+
+    /**
+     * a view of given rows of this view, with an index of its own.
+     */
+    template <typename Pred>
+    dataset_view filter(Pred&& keep) const
+    {
+        auto kept = std::make_shared<index_type>();
+        kept->reserve(size());
+        for (std::size_t i = 0; i != size(); ++i) {
+            if (keep(i))
+                kept->push_back(source_row(i));
+        }
+        std::size_t n = kept->size();
+        return dataset_view(*X, *Y, std::move(kept), 0, n);
+    }
+
+    /**
+     * the rows of this view in random order, with an index of its own.
+     */
+    template <typename Engine>
+    dataset_view shuffled(Engine& engine) const
+    {
+        auto order = std::make_shared<index_type>(index->begin() + first, index->begin() + last);
+        std::shuffle(order->begin(), order->end(), engine);
+        std::size_t n = order->size();
+        return dataset_view(*X, *Y, std::move(order), 0, n);
+    }
+
+    /**
+     * copies the rows of the view into containers of the dataset's types.
+     */
+    std::tuple<XType, YType> materialize() const
+    {
+        XType new_X;
+        YType new_Y;
+        new_X.reserve(size());
+        new_Y.reserve(size());
+        for (std::size_t i = 0; i != size(); ++i) {
+            new_X.push_back(x(i));
+            new_Y.push_back(y(i));
+        }
+        return std::make_tuple(std::move(new_X), std::move(new_Y));
+    }
+
+private:
+    const XType* X;
+    const YType* Y;
+    std::shared_ptr<const index_type> index;
+    std::size_t first, last;
+};
+
+template <typename XType, typename YType>
+void dataset_shuffle(dataset_view<XType, YType>&);
+
+/**
+ * shuffles the view and returns (train, cv), cv taking percent of it.
+ */
+template <typename XType, typename YType>
+std::tuple<dataset_view<XType, YType>, dataset_view<XType, YType>>
+cv_split(const dataset_view<XType, YType>&, double percent);
+
+/**
+ * returns (train, test) of fold k of a k-fold split of the view, which is
+ * expected to be shuffled already so that every fold uses the same order.
+ */
+template <typename XType, typename YType>
+std::tuple<dataset_view<XType, YType>, dataset_view<XType, YType>>
+k_fold_split(const dataset_view<XType, YType>&, std::size_t folds, std::size_t k);
+
+template <typename XType, typename YType>
+dataset_view<XType, YType>
+stripe_extra(const dataset_view<XType, YType>&, typename YType::value_type, double);
+
+template <typename XType, typename YType>
+dataset_view<XType, YType> balance_dataset(const dataset_view<XType, YType>&);
+
+template <template <typename> typename XType,
+          template <typename> typename XLineType,
+          typename XValueType,
+          template <typename> typename YType,
+          typename YValueType>
 std::tuple<XType<XLineType<XValueType>>, YType<YValueType>>
 load_data(const std::string& X_path, const std::string& Y_path)
 {
-    std::ifstream X_file(X_path);
-    std::ifstream Y_file(Y_path);
-    std::string line;
+    // both files are parsed by load_csv(), this only lays them out
+    auto X_csv = load_csv(X_path);
+    auto Y_csv = load_csv(Y_path);
     XType<XLineType<XValueType>> X;
     YType<YValueType> Y;
 
-    while (std::getline(X_file, line)) {
-        std::stringstream X_line_stream(line);
-        XLineType<XValueType> X_line;
-        std::string feature;
-
-        while (std::getline(X_line_stream, feature, ',')) {
-            std::stringstream feature_stream(feature);
-            YValueType feature_val;
-            feature_stream >> feature_val;
-            X_line.push_back(feature_val);
-        }
-        X.push_back(std::move(X_line));
-    }
+    X.reserve(X_csv.rows());
+    for (std::size_t i = 0; i != X_csv.rows(); ++i)
+        X.emplace_back(X_csv[i].begin(), X_csv[i].end());
 
-    std::istream_iterator<YValueType> Y_itr(Y_file);
-    std::copy(Y_itr, std::istream_iterator<int>(), std::back_inserter(Y));
+    Y.reserve(Y_csv.rows() * Y_csv.cols());
+    std::for_each(Y_csv.data(), Y_csv.data() + Y_csv.rows() * Y_csv.cols(), [&](float label) {
+        Y.push_back(static_cast<YValueType>(label));
+    });
 
-    return std::make_tuple(X, Y);
+    return std::make_tuple(std::move(X), std::move(Y));
 }
 
 template <typename XType, typename YType>
@@ -90,98 +230,116 @@ void dataset_shuffle(XType& X, YType& Y) {
     }
 }
 
+namespace mldata_detail {
+    inline std::mt19937_64& engine()
+    {
+        static thread_local std::mt19937_64 engine(std::random_device{}());
+        return engine;
+    }
+}
+
 template <typename XType, typename YType>
-std::tuple<std::decay_t<XType>,
-           std::decay_t<YType>, 
-           std::decay_t<XType>, 
-           std::decay_t<YType>>
-cv_split(XType&& X, YType&& Y, double percent) {
-    auto n = X.size();
+void dataset_shuffle(dataset_view<XType, YType>& view)
+{
+    view = view.shuffled(mldata_detail::engine());
+}
 
-    dataset_shuffle(X, Y);
+template <typename XType, typename YType>
+std::tuple<dataset_view<XType, YType>, dataset_view<XType, YType>>
+cv_split(const dataset_view<XType, YType>& view, double percent)
+{
+    auto shuffled = view.shuffled(mldata_detail::engine());
+    auto n = shuffled.size();
+    std::size_t cv_size = static_cast<std::size_t>(std::round(n * percent));
 
-    size_t cv_size = static_cast<size_t>(round(n * percent));
+    return std::make_tuple(shuffled.subview(cv_size, n), shuffled.subview(0, cv_size));
+}
 
-    std::decay_t<XType> train_X, cv_X;
-    std::decay_t<YType> train_Y, cv_Y;
+template <typename XType, typename YType>
+std::tuple<dataset_view<XType, YType>, dataset_view<XType, YType>>
+k_fold_split(const dataset_view<XType, YType>& view, std::size_t folds, std::size_t k)
+{
+    auto n = view.size();
+    std::size_t begin = n * k / folds;
+    std::size_t end = n * (k + 1) / folds;
 
-    for (size_t i = 0; i != cv_size; ++i) {
-        cv_X.push_back(std::move(X[i]));
-        cv_Y.push_back(std::move(Y[i]));
-    }
+    auto train = view.filter([&](std::size_t i) { return i < begin || i >= end; });
+    return std::make_tuple(std::move(train), view.subview(begin, end));
+}
 
-    for (size_t i = cv_size; i != n; ++i) {
-        train_X.push_back(std::move(X[i]));
-        train_Y.push_back(std::move(Y[i]));
+template <typename XType, typename YType>
+dataset_view<XType, YType>
+stripe_extra(const dataset_view<XType, YType>& view, typename YType::value_type label, double percent)
+{
+    // keep the first percent x n rows of label in random order, drop the rest
+    auto shuffled = view.shuffled(mldata_detail::engine());
+    std::size_t keep = static_cast<std::size_t>(std::ceil(shuffled.size() * percent));
+    std::size_t c = 0;
+
+    return shuffled.filter([&](std::size_t i) {
+        return shuffled.y(i) != label || c++ < keep;
+    });
+}
+
+template <typename XType, typename YType>
+dataset_view<XType, YType> balance_dataset(const dataset_view<XType, YType>& view)
+{
+    auto n = view.size();
+    std::size_t pos_n = 0;
+    for (std::size_t i = 0; i != n; ++i) {
+        if (view.y(i) == 1)
+            ++pos_n;
     }
+    std::size_t neg_n = n - pos_n;
+
+    if (pos_n == 0 || neg_n == 0)
+        return view;
+    if (static_cast<double>(pos_n) / n > 0.75)
+        return stripe_extra(view, 1, 0.7);
+    if (static_cast<double>(neg_n) / n > 0.75)
+        return stripe_extra(view, 0, 0.7);
+    return view;
+}
+
+// the container versions below copy the rows they return once, the
+// shuffling and selecting happens on a view
 
-    return std::make_tuple(train_X, train_Y, cv_X, cv_Y);
+template <typename XType, typename YType>
+std::tuple<std::decay_t<XType>,
+           std::decay_t<YType>, 
+           std::decay_t<XType>, 
+           std::decay_t<YType>>
+cv_split(XType&& X, YType&& Y, double percent) {
+    dataset_view<std::decay_t<XType>, std::decay_t<YType>> view(X, Y);
+    auto [train, cv] = cv_split(view, percent);
+    auto [train_X, train_Y] = train.materialize();
+    auto [cv_X, cv_Y] = cv.materialize();
+
+    return std::make_tuple(std::move(train_X), std::move(train_Y), std::move(cv_X), std::move(cv_Y));
 }
 
 template <typename XType, 
           typename YType,
-          typename XTypeRaw = std::decay_t<XType>, 
-          typename YTypeRaw = std::decay_t<YType>>
+          typename XTypeRaw, 
+          typename YTypeRaw>
 std::tuple<XTypeRaw, YTypeRaw>
 stripe_extra(XType&& X, YType&& Y, typename YTypeRaw::value_type label, double percent)
 {
-    XTypeRaw new_X;
-    YTypeRaw new_Y;
-
-    auto n = Y.size();
-    auto new_n = n * percent;
-
-    dataset_shuffle(X, Y);
-
-    std::size_t i = 0, c = 0;
-    while (c != new_n) {
-        if (Y[i] == label)
-            ++c;
-        new_X.push_back(std::move(X[i]));
-        new_Y.push_back(std::move(Y[i]));
-        ++i;
-    }
-    while (i != n) {
-        if (Y[i] != label) {
-            new_X.push_back(std::move(X[i]));
-            new_Y.push_back(std::move(Y[i]));
-        }
-        ++i;
-    }
-
-    return std::tuple<XType, YType>(new_X, new_Y);
+    dataset_view<XTypeRaw, YTypeRaw> view(X, Y);
+    return stripe_extra(view, label, percent).materialize();
 }
 
 template <typename XType,
           typename YType, 
-          typename XTypeRaw = std::decay_t<XType>,
-          typename YTypeRaw = std::decay_t<YType>>
+          typename XTypeRaw,
+          typename YTypeRaw>
 std::tuple<XTypeRaw, YTypeRaw> balance_dataset(XType&& X, YType&& Y)
 {
-    auto n = Y.size();
-    auto pos_n = std::count_if(Y.cbegin(), Y.cend(), [] (const auto& y) { return y == 1; });
-    decltype(pos_n) neg_n = Y.size() - pos_n;
-
-    double pos_n_d = static_cast<double>(pos_n);
-    double neg_n_d = static_cast<double>(neg_n);
-
-    if (pos_n == 0 || neg_n == 0)
-        goto no_stripe;
-
-    if (pos_n_d / n > 0.75)
-        goto stripe_pos;
-    else if (neg_n_d / n > 0.75)
-        goto stripe_neg;
-    else
-        goto no_stripe;
-
-stripe_pos:
-    return stripe_extra(X, Y, 1, 0.7);
-stripe_neg:
-    return stripe_extra(X, Y, 0, 0.7);
-no_stripe:
-    return std::tuple<XType, YType>(std::forward<XType>(X), std::forward<YType>(Y));
-
+    dataset_view<XTypeRaw, YTypeRaw> view(X, Y);
+    auto balanced = balance_dataset(view);
+    if (balanced.size() == view.size())
+        return std::tuple<XTypeRaw, YTypeRaw>(std::forward<XType>(X), std::forward<YType>(Y));
+    return balanced.materialize();
 }
 
 #endif // MLDATA_H
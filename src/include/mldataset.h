@@ -0,0 +1,402 @@
+#ifndef MLDATASET_H
+#define MLDATASET_H
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "mlimage.h"
+#include "mlcodec.h"
+#include "mlmatrix.h"
+
+/**
+ * Binary dataset written by collect and read by train.
+ * The file is a dataset_header followed by fixed size records:
+ *
+ *     std::int64_t timestamp;   // capture time, microseconds since epoch
+ *     std::int32_t label;       // 1 if the player clicked
+ *     std::int32_t reserved;    // 0, keeps the features 8 byte aligned
+ *     float features[header.features];
+ *
+ * All fields are in host byte order, the header records which one that is.
+ *
+ * With dataset_dtype::DELTA_U16 the records are variable sized instead,
+ * grouped into blocks as described in mlcodec.h, and record_size is 0.
+ */
+enum class dataset_dtype : std::uint16_t { FLOAT32 = 1, DELTA_U16 = 2 };
+
+struct dataset_header {
+    char magic[4];              // "ELDS"
+    std::uint32_t byte_order;   // dataset_header::byte_order_mark as written
+    std::uint16_t version;
+    std::uint16_t dtype;        // dataset_dtype
+    std::uint32_t channels;     // 2 (path, player) for box features, 1 if flat
+    std::uint32_t cols;
+    std::uint32_t rows;
+    std::uint32_t roi_w;
+    std::uint32_t roi_h;
+    std::uint32_t features;     // floats per record
+    std::uint32_t record_size;  // bytes per record, 0 if they vary
+    std::uint16_t mode;         // feature_mode, 0 (reference) in older files
+    std::uint8_t reserved[22];
+
+    static constexpr std::uint32_t byte_order_mark = 0x01020304;
+    static constexpr std::uint16_t current_version = 1;
+    static constexpr std::size_t record_head = 16;
+
+    static dataset_header make(const dataset_geometry&, dataset_dtype = dataset_dtype::FLOAT32);
+
+    /**
+     * Throws std::runtime_error if the header isn't one this version reads.
+     */
+    void check(const std::string& path) const;
+
+    dataset_geometry geometry() const noexcept;
+
+    /**
+     * returns true if records are encoded by FeatureEncoder.
+     */
+    bool compressed() const noexcept;
+
+    /**
+     * writes one FLOAT32 record into out, which has record_size bytes.
+     */
+    void encode(const std::vector<float>& features, int label,
+                std::chrono::system_clock::time_point, char* out) const;
+};
+
+static_assert(sizeof(dataset_header) == 64, "dataset_header is written as is");
+
+/**
+ * MlDatasetWriter appends records to a binary dataset. Every record is
+ * assembled in a preallocated buffer and handed to the stream in one write;
+ * compressed records are collected into blocks of block_records first.
+ */
+class MlDatasetWriter {
+public:
+    typedef std::chrono::system_clock::time_point time_point;
+
+    /**
+     * Constructor truncates path and writes the header.
+     * Throws std::runtime_error if the file can't be written.
+     */
+    MlDatasetWriter(const std::string&, const dataset_geometry&, dataset_dtype = dataset_dtype::FLOAT32);
+    MlDatasetWriter(const MlDatasetWriter&) = delete;
+    MlDatasetWriter& operator=(const MlDatasetWriter&) = delete;
+
+    /**
+     * Destructor writes the last block, but swallows its errors.
+     */
+    ~MlDatasetWriter();
+
+    static constexpr std::size_t block_records = 256;
+
+    /**
+     * Throws std::invalid_argument if features don't match the header,
+     * std::runtime_error if the write fails.
+     */
+    void write(const std::vector<float>& features, int label, time_point);
+    /**
+     * writes the pending block, if any, and flushes the stream.
+     */
+    void flush();
+
+    /**
+     * returns number of records written.
+     */
+    std::size_t size() const noexcept;
+    const dataset_header& header() const noexcept;
+
+private:
+    void write_block();
+
+    std::string path;
+    std::ofstream fs;
+    dataset_header head;
+    std::vector<char> record;
+    std::size_t count;
+
+    FeatureEncoder encoder;
+    std::vector<char> block;
+    block_header block_head;
+};
+
+/**
+ * Tuning of MlAsyncDatasetWriter.
+ * buffers        : swap buffers, at least 2. While all of them wait for
+ *                  the disk, further samples are dropped.
+ * buffer_records : records per buffer, a full buffer is one write.
+ * flush_interval : a partly filled buffer is written at least this often.
+ * sync           : fsync the file after every group of writes.
+ * dtype          : DELTA_U16 makes every buffer one block of the codec.
+ */
+struct async_writer_options {
+    std::size_t buffers = 3;
+    std::size_t buffer_records = 256;
+    std::chrono::milliseconds flush_interval = std::chrono::seconds(1);
+    bool sync = true;
+    dataset_dtype dtype = dataset_dtype::FLOAT32;
+};
+
+/**
+ * MlAsyncDatasetWriter writes the same file as MlDatasetWriter from its
+ * own thread. write() only copies the record into the buffer being filled,
+ * it never waits for the disk; full buffers are written in groups and the
+ * samples that find no free buffer are dropped and counted.
+ */
+class MlAsyncDatasetWriter {
+public:
+    typedef std::chrono::system_clock::time_point time_point;
+
+    /**
+     * Constructor truncates path and writes the header.
+     * Throws std::runtime_error if the file can't be written,
+     * std::invalid_argument if options are unusable.
+     */
+    MlAsyncDatasetWriter(const std::string&,
+                         const dataset_geometry&,
+                         const async_writer_options& = async_writer_options());
+    MlAsyncDatasetWriter(const MlAsyncDatasetWriter&) = delete;
+    MlAsyncDatasetWriter& operator=(const MlAsyncDatasetWriter&) = delete;
+
+    /**
+     * Destructor closes the writer, but swallows its errors.
+     */
+    ~MlAsyncDatasetWriter();
+
+    /**
+     * returns false if the sample was dropped.
+     * Throws std::invalid_argument if features don't match the header and
+     * rethrows an error of the writer thread.
+     */
+    bool write(const std::vector<float>& features, int label, time_point);
+
+    /**
+     * writes whatever is buffered, syncs and stops the writer thread.
+     * Rethrows an error of the writer thread.
+     */
+    void close();
+
+    /**
+     * returns number of records written to the file so far.
+     */
+    std::size_t size() const noexcept;
+
+    /**
+     * returns number of samples dropped because no buffer was free.
+     */
+    std::size_t dropped() const noexcept;
+
+    /**
+     * returns the most buffers ever waiting for the disk at once.
+     */
+    std::size_t high_water() const noexcept;
+    const dataset_header& header() const noexcept;
+    const async_writer_options& options() const noexcept;
+
+private:
+    struct buffer {
+        std::vector<char> data;
+        std::size_t bytes = 0;
+        std::size_t records = 0;
+    };
+
+    void start_buffer(buffer&);
+
+    void run();
+    void write_out(const char*, std::size_t);
+
+    std::string path;
+    dataset_header head;
+    async_writer_options opts;
+    int fd;
+    FeatureEncoder encoder;
+
+    std::vector<buffer> buffers;
+    std::vector<buffer*> free_buffers;
+    std::deque<buffer*> full_buffers;
+    buffer* filling;
+    std::size_t writing;
+    std::exception_ptr error;
+
+    std::atomic<std::size_t> written_count;
+    std::atomic<std::size_t> dropped_count;
+    std::atomic<std::size_t> high_water_mark;
+    bool stop;
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread local_thread;
+};
+
+/**
+ * A whole binary dataset, one row of features per record.
+ */
+struct MlDataset {
+    dataset_header header;
+    FeatureMatrix features;
+    std::vector<int> labels;
+    std::vector<std::int64_t> timestamps;
+
+    std::size_t size() const noexcept { return labels.size(); }
+};
+
+/**
+ * Reads a binary dataset with one bulk read.
+ * Throws std::runtime_error if it can't be read or is invalid.
+ */
+MlDataset load_dataset(const std::string&);
+
+/**
+ * Reads a binary dataset straight into rows [first_row, first_row + rows)
+ * of dataset, which is already sized. The file has to have the geometry
+ * and feature mode of dataset.header and exactly rows records. Files of
+ * different rows can be read into the same dataset at once.
+ * Throws std::runtime_error if it can't be read, is invalid or doesn't
+ * match, std::out_of_range if the rows are beyond the dataset.
+ */
+void load_dataset_rows(const std::string&, MlDataset& dataset, std::size_t first_row, std::size_t rows);
+
+/**
+ * returns true if the file starts with the magic of a binary dataset.
+ */
+bool is_binary_dataset(const std::string&);
+
+/**
+ * Tuning of MlDatasetStream.
+ * memory  : bytes of records the stream holds at once, read buffer and
+ *           shuffle buffer together, so it bounds the memory of a pass
+ *           whatever the size of the dataset.
+ * shuffle : hand records out in approximately random order through a
+ *           shuffle buffer taking most of memory, otherwise in file order.
+ * seed    : of the shuffle buffer, 0 for a random one.
+ */
+struct stream_options {
+    std::size_t memory = std::size_t(256) << 20;
+    bool shuffle = false;
+    std::uint64_t seed = 0;
+};
+
+/**
+ * MlDatasetStream reads a binary dataset in passes of bounded memory,
+ * chunk by chunk, for datasets which don't fit in memory as MlDataset.
+ * A filter picks the records of a pass by their position and label
+ * before their features are copied; split_filter() and balance_filter()
+ * do what cv_split() and balance_dataset() do for a loaded dataset.
+ */
+class MlDatasetStream {
+public:
+    typedef std::function<bool(std::size_t record, int label)> filter_type;
+
+    /**
+     * Throws std::runtime_error if the file can't be read or is invalid.
+     */
+    MlDatasetStream(const std::string&, const stream_options& = stream_options());
+    MlDatasetStream(const MlDatasetStream&) = delete;
+    MlDatasetStream& operator=(const MlDatasetStream&) = delete;
+
+    const dataset_header& header() const noexcept;
+
+    /**
+     * returns number of records in the file.
+     */
+    std::size_t size() const noexcept;
+
+    /**
+     * applies from the next pass on, an empty filter takes every record.
+     */
+    void set_filter(filter_type);
+
+    /**
+     * starts a new pass.
+     */
+    void rewind();
+
+    /**
+     * appends up to n records of the pass to X and Y and returns how many,
+     * 0 once the pass is over.
+     */
+    std::size_t next(FeatureMatrix& X, std::vector<int>& Y, std::size_t n);
+
+    /**
+     * returns number of records of every label, in a pass of its own
+     * which ignores the filter. The current pass is restarted.
+     */
+    std::map<int, std::size_t> count_labels();
+
+private:
+    bool next_record(const char*&, int&);
+    bool fill();
+    bool fill_block();
+
+    std::string path;
+    std::ifstream fs;
+    dataset_header head;
+    std::size_t records;
+    stream_options opts;
+    filter_type filter, pass_filter;
+
+    std::vector<char> chunk;
+    std::size_t chunk_records, chunk_pos, chunk_first, next_chunk;
+
+    // compressed datasets are read a block at a time, next_chunk is then
+    // the file offset of the next block
+    FeatureDecoder decoder;
+    FeatureMatrix decoded;
+    std::vector<int> decoded_labels;
+
+    FeatureMatrix pool;
+    std::vector<int> pool_labels;
+    std::size_t pool_size;
+    std::mt19937_64 engine;
+};
+
+/**
+ * keeps the records of the cv part of a split taking percent of them,
+ * or the records of the train part. Records are assigned by a hash of
+ * their position, so every pass and both parts split alike.
+ */
+MlDatasetStream::filter_type split_filter(double percent, bool cv, std::uint64_t seed = 0);
+
+/**
+ * balance_dataset() for a stream: if one label has more than 75% of the
+ * records, each of them is kept with the probability leaving 70% of all
+ * records with that label, again by a hash of the position.
+ */
+MlDatasetStream::filter_type balance_filter(const std::map<int, std::size_t>& counts, std::uint64_t seed = 0);
+
+/**
+ * Same result as load_data() of mldata.h but from a binary dataset.
+ */
+template <template <typename> typename XType=std::vector,
+          template <typename> typename XLineType=std::vector,
+          typename XValueType=float,
+          template <typename> typename YType=std::vector,
+          typename YValueType=int>
+std::tuple<XType<XLineType<XValueType>>, YType<YValueType>>
+load_binary_data(const MlDataset& dataset)
+{
+    XType<XLineType<XValueType>> X;
+    YType<YValueType> Y;
+
+    X.reserve(dataset.size());
+    Y.reserve(dataset.size());
+    for (std::size_t i = 0; i != dataset.size(); ++i) {
+        X.emplace_back(dataset.features[i].begin(), dataset.features[i].end());
+        Y.push_back(static_cast<YValueType>(dataset.labels[i]));
+    }
+
+    return std::make_tuple(std::move(X), std::move(Y));
+}
+
+#endif // MLDATASET_H
@@ -0,0 +1,84 @@
+#ifndef MLDEDUP_H
+#define MLDEDUP_H
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+/**
+ * Tuning of MlDuplicateFilter.
+ * step      : features are coarsened to feature / step, so a few pixels
+ *             more or less in a box don't make a sample new.
+ * threshold : a sample is new if more than this many coarse features
+ *             differ from every recent sample kept.
+ * window    : number of recent samples kept compared with.
+ */
+struct dedup_options {
+    float step = 32.0f;
+    std::size_t threshold = 4;
+    std::size_t window = 8;
+};
+
+/**
+ * Counters of MlDuplicateFilter.
+ * seen       : samples offered to keep().
+ * kept       : samples kept, including those of a changed label.
+ * exact      : samples dropped because their coarse features hash to
+ *              those of a recent sample.
+ * near       : samples dropped within threshold of a recent sample.
+ */
+struct dedup_stats {
+    std::size_t seen = 0;
+    std::size_t kept = 0;
+    std::size_t exact = 0;
+    std::size_t near = 0;
+
+    /**
+     * returns the share of samples dropped, 0 before any sample is seen.
+     */
+    double reduction_ratio() const noexcept;
+};
+
+/**
+ * MlDuplicateFilter drops samples which add nothing to a dataset: at a
+ * frame every 30 ms most consecutive samples show the same screen with
+ * the same label. A sample is kept if its label differs from the previous
+ * sample's, or if its coarse features differ from every one of the recent
+ * samples kept. Every kept sample is hashed, so exact repeats are found
+ * without comparing features.
+ * It isn't shared, samples have to be offered in capture order.
+ */
+class MlDuplicateFilter {
+public:
+    explicit MlDuplicateFilter(const dedup_options& = dedup_options());
+
+    /**
+     * returns true if the sample is to be written.
+     */
+    bool keep(const std::vector<float>& features, int label);
+
+    /**
+     * forgets recent samples, the next one is kept.
+     */
+    void reset();
+
+    const dedup_stats& stats() const noexcept;
+    const dedup_options& options() const noexcept;
+
+private:
+    struct recent_sample {
+        std::uint64_t hash;
+        std::vector<std::uint16_t> coarse;
+    };
+
+    bool near_recent(std::uint64_t hash);
+
+    dedup_options opts;
+    dedup_stats counters;
+    std::deque<recent_sample> recent;
+    std::vector<std::uint16_t> coarse;
+    int prev_label;
+    bool primed;
+};
+
+#endif // MLDEDUP_H
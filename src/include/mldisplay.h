@@ -24,6 +24,7 @@ public:
 class MlDisplay {
 friend class MlScreenCapturer;
 friend class MlInputListener;
+friend class MlChangeDetector;
 
 public:
 	// constructor
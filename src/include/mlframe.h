@@ -0,0 +1,111 @@
+#ifndef MLFRAME_H
+#define MLFRAME_H
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class MlFrame;
+class MlFramePool;
+
+/**
+ * MlFrame is a lightweight ref-counted handle to one slot of a MlFramePool.
+ * Copying a MlFrame shares the slot, and the slot is given back to the pool
+ * once the last handle referring to it is released or destroyed.
+ * Acquiring, copying and releasing a frame never allocates.
+ */
+class MlFrame {
+friend class MlFramePool;
+
+public:
+	/**
+	 * Default constructor creates an empty handle.
+	 */
+	MlFrame() noexcept = default;
+	MlFrame(const MlFrame&) noexcept;
+	MlFrame(MlFrame&&) noexcept;
+	MlFrame& operator=(const MlFrame&) noexcept;
+	MlFrame& operator=(MlFrame&&) noexcept;
+	~MlFrame();
+
+	/**
+	 * Access the pixels of the slot. The cv::Mat must not be
+	 * reallocated by the caller (e.g. by assigning a differently
+	 * sized image to it), otherwise the pool loses its buffer.
+	 */
+	cv::Mat& mat() noexcept;
+	const cv::Mat& mat() const noexcept;
+
+	/**
+	 * returns true if this handle refers to a slot.
+	 */
+	explicit operator bool() const noexcept;
+
+	/**
+	 * Drop this handle. The slot goes back to the pool if this was
+	 * the last handle referring to it.
+	 */
+	void release() noexcept;
+
+private:
+	struct slot_type;
+	struct pool_state;
+
+	MlFrame(std::shared_ptr<pool_state>, slot_type*) noexcept;
+
+	std::shared_ptr<pool_state> pool;
+	slot_type *slot = nullptr;
+};
+
+/**
+ * MlFramePool preallocates a fixed number of equally sized frame buffers
+ * which are handed out as MlFrame and reused once they are released,
+ * so that the steady-state capture loop doesn't allocate.
+ */
+class MlFramePool {
+public:
+	/**
+	 * Constructor allocates given number of frames of given size and type.
+	 */
+	MlFramePool(std::size_t, const cv::Size&, int = CV_8UC4);
+
+	/**
+	 * This function takes a free frame out of the pool.
+	 * It blocks until a frame is released if all of them are in use.
+	 */
+	MlFrame acquire();
+
+	/**
+	 * This function takes a free frame out of the pool without blocking.
+	 * An empty MlFrame is returned if all of them are in use.
+	 */
+	MlFrame try_acquire();
+
+	/**
+	 * returns number of frames currently not in use.
+	 */
+	std::size_t available() const;
+
+	/**
+	 * returns number of frames owned by the pool.
+	 */
+	std::size_t size() const noexcept;
+
+	/**
+	 * returns size of each frame.
+	 */
+	cv::Size frame_size() const noexcept;
+
+	/**
+	 * returns OpenCV type of each frame.
+	 */
+	int frame_type() const noexcept;
+
+private:
+	std::shared_ptr<MlFrame::pool_state> state;
+};
+
+#endif // MLFRAME_H
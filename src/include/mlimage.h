@@ -6,24 +6,141 @@
 #include <cstdint>
 #include <future>
 #include <thread>
+#include <memory>
+#include <mutex>
 #include "feature/ExtractFeatureExecutor.h"
+#include "feature/ExtractFeaturePool.h"
+#include "feature/ParallelFor.h"
+#include "mlframe.h"
+#include "mlsource.h"
 #include <iostream>
 
+/**
+ * Geometry a dataset was extracted with, written next to it so training
+ * doesn't have to assume one. features is the length of every sample,
+ * which differs from geometry.size() for feature_mode::MULTI_SCALE.
+ * mode tells features of different kernels apart, datasets of different
+ * modes aren't mixed.
+ * The file uses the same keys as setting.json.
+ */
+struct dataset_geometry {
+    grid_geometry geometry;
+    std::size_t features;
+    feature_mode mode = feature_mode::REFERENCE;
+};
+
+inline bool operator==(const dataset_geometry& lhs, const dataset_geometry& rhs) noexcept
+{
+    return lhs.geometry == rhs.geometry && lhs.features == rhs.features && lhs.mode == rhs.mode;
+}
+
+inline bool operator!=(const dataset_geometry& lhs, const dataset_geometry& rhs) noexcept
+{
+    return !(lhs == rhs);
+}
+
+/**
+ * returns the mode a dataset records for features extracted in given mode,
+ * i.e. REFERENCE for FUSED and LUT, which compute the same features.
+ */
+inline feature_mode recorded_mode(feature_mode mode) noexcept
+{
+    return mode == feature_mode::MULTI_SCALE ? mode : feature_mode::REFERENCE;
+}
+
+void save_dataset_geometry(const std::string&, const dataset_geometry&);
+
+/**
+ * Throws std::runtime_error if the file can't be read or is invalid.
+ */
+dataset_geometry load_dataset_geometry(const std::string&);
+
 class MlImageProcessor {
 public:
-    typedef std::unordered_map<std::string, std::unordered_map<std::string, cv::Scalar>> settings_type;
+    typedef ExtractFeatureExecutor::settings_type settings_type;
     typedef std::vector<cv::Point> contour_type;
 
+    /**
+     * Constructor requires the path of the settings file, which is parsed
+     * and validated once here. Throws std::runtime_error if it can't be.
+     */
     MlImageProcessor(const std::string&);
 
-    void set_roi(const cv::Mat&);
+    /**
+     * With more than one worker, frames are extracted by an
+     * ExtractFeaturePool with a queue of given capacity instead of the
+     * single slot ExtractFeatureExecutor.
+     */
+    MlImageProcessor(const std::string&,
+                     std::size_t workers,
+                     std::size_t capacity,
+                     backpressure = backpressure::BLOCK);
+
+    /**
+     * returns the bounding rect of the largest bright area, i.e. the game.
+     * With a scale below 1 it's searched on a downsampled copy, the rect
+     * is still in pixels of the given image.
+     * Throws std::runtime_error if there is none.
+     */
+    static cv::Rect find_roi(const cv::Mat&, bool preview = true, double scale = 1.0);
+    void set_roi(const cv::Mat&, bool preview = true);
+    void set_roi(const cv::Rect&);
+
+    /**
+     * Move the roi of a started processor, frames submitted afterwards are
+     * cropped by the new one. Safe to call from any thread.
+     */
+    void update_roi(const cv::Rect&);
+    cv::Rect get_roi() const;
+    void set_feature_mode(feature_mode);
+    feature_mode get_feature_mode();
+    void set_grids(const std::vector<grid_size>&);
+    std::vector<grid_size> get_grids();
+    grid_size get_setting_grid() const;
+    grid_geometry get_geometry() const;
+    const settings_type& get_settings() const noexcept;
+    void set_incremental(incremental_mode);
+    incremental_mode get_incremental();
+    std::shared_ptr<const incremental_stats> get_incremental_stats() const noexcept;
+
+    /**
+     * returns the length of the features of current mode.
+     */
+    std::size_t get_feature_size();
+    void set_visualizer(std::shared_ptr<PreviewVisualizer>);
+    std::size_t get_workers() const noexcept;
+    std::size_t dropped() const noexcept;
     std::vector<float> extract_feature(const cv::Mat&);
     std::future<std::vector<float>> extract_feature_async(const cv::Mat&);
+    std::vector<float> extract_feature(MlFrame);
+    std::future<std::vector<float>> extract_feature_async(MlFrame);
+
+    /**
+     * Extract the features of many frames at once, e.g. to re-process a
+     * recorded session, spread over given number of threads (0 means one
+     * per core) by ParallelWorkers, with OpenCV single threaded on them.
+     * Row i of the returned CV_32F matrix is the features of frame i.
+     * Debug images are never shown.
+     * Requires the roi to be set.
+     */
+    cv::Mat extract_features_batch(const std::vector<cv::Mat>&, std::size_t threads = 0);
+
+    /**
+     * Same as above for every remaining frame of a source. Frames are decoded
+     * chunk by chunk on the calling thread while the previous chunk is being
+     * extracted, every chunk by the same workers.
+     */
+    cv::Mat extract_features_batch(MlFrameSource&, std::size_t threads = 0, std::size_t chunk = 256);
 private:
     void load_settings(const std::string&);
+    cv::Mat extract_features_batch(const std::vector<cv::Mat>&, ParallelWorkers&);
 
     settings_type settings;
+    grid_geometry geometry;
+    cv::Rect roi;
+    mutable std::mutex roi_m;
     ExtractFeatureExecutor do_extract_feature;
+    std::unique_ptr<ExtractFeaturePool> do_extract_feature_pool;
 };
 
 #endif
@@ -0,0 +1,121 @@
+#ifndef MLMATRIX_H
+#define MLMATRIX_H
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/**
+ * A row of a FeatureMatrix. Copying a view doesn't copy the row, and
+ * swapping two views swaps the contents of the rows they refer to, so
+ * shuffling a matrix by swapping X[i] and X[j] works as for a vector
+ * of rows.
+ */
+template <typename T>
+class basic_row_view {
+public:
+    typedef std::remove_const_t<T> value_type;
+    typedef T* iterator;
+
+    constexpr basic_row_view() noexcept : p(nullptr), n(0) { }
+    constexpr basic_row_view(T* data, std::size_t size) noexcept : p(data), n(size) { }
+
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    constexpr basic_row_view(const basic_row_view<U>& other) noexcept : p(other.data()), n(other.size()) { }
+
+    template <typename A, typename U = T, typename = std::enable_if_t<std::is_const_v<U>>>
+    basic_row_view(const std::vector<value_type, A>& v) noexcept : p(v.data()), n(v.size()) { }
+
+    constexpr T* data() const noexcept { return p; }
+    constexpr std::size_t size() const noexcept { return n; }
+    constexpr bool empty() const noexcept { return n == 0; }
+    constexpr T* begin() const noexcept { return p; }
+    constexpr T* end() const noexcept { return p + n; }
+    constexpr T& operator[](std::size_t i) const noexcept { return p[i]; }
+
+private:
+    T* p;
+    std::size_t n;
+};
+
+typedef basic_row_view<float> row_view;
+typedef basic_row_view<const float> const_row_view;
+
+inline void swap(row_view lhs, row_view rhs) noexcept
+{
+    std::swap_ranges(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+/**
+ * FeatureMatrix holds rows x cols features in one 64 byte aligned,
+ * row-major buffer, one row per sample. It stands in for
+ * std::vector<std::vector<float>>: size() is the number of rows,
+ * X[i] is a row_view and push_back() appends a row, but the whole
+ * matrix can be copied with a single memcpy of data().
+ */
+class FeatureMatrix {
+public:
+    typedef row_view value_type;
+    static constexpr std::size_t alignment = 64;
+
+    FeatureMatrix() noexcept;
+
+    /**
+     * rows x cols zeros.
+     */
+    FeatureMatrix(std::size_t rows, std::size_t cols);
+    FeatureMatrix(const FeatureMatrix&);
+    FeatureMatrix(FeatureMatrix&&) noexcept;
+    FeatureMatrix& operator=(const FeatureMatrix&);
+    FeatureMatrix& operator=(FeatureMatrix&&) noexcept;
+    ~FeatureMatrix() = default;
+
+    std::size_t rows() const noexcept { return n_rows; }
+    std::size_t cols() const noexcept { return n_cols; }
+    std::size_t size() const noexcept { return n_rows; }
+    bool empty() const noexcept { return n_rows == 0; }
+
+    float* data() noexcept { return buffer.get(); }
+    const float* data() const noexcept { return buffer.get(); }
+
+    row_view operator[](std::size_t i) noexcept { return { data() + i * n_cols, n_cols }; }
+    const_row_view operator[](std::size_t i) const noexcept { return { data() + i * n_cols, n_cols }; }
+    row_view row(std::size_t i) noexcept { return (*this)[i]; }
+    const_row_view row(std::size_t i) const noexcept { return (*this)[i]; }
+
+    void reserve(std::size_t rows);
+
+    /**
+     * changes the number of rows, new ones are zeros.
+     */
+    void resize(std::size_t rows);
+    void clear() noexcept;
+
+    /**
+     * appends a copy of row. An empty matrix without columns takes the
+     * length of the first row appended.
+     * Throws std::invalid_argument if the length doesn't match cols().
+     */
+    void push_back(const_row_view row);
+
+    /**
+     * returns bytes in use, without the unused capacity.
+     */
+    std::size_t bytes() const noexcept { return n_rows * n_cols * sizeof(float); }
+
+private:
+    struct aligned_delete {
+        void operator()(float* p) const noexcept { ::operator delete(p, std::align_val_t(alignment)); }
+    };
+
+    void reallocate(std::size_t rows);
+
+    std::unique_ptr<float[], aligned_delete> buffer;
+    std::size_t n_rows;
+    std::size_t n_cols;
+    std::size_t capacity;
+};
+
+#endif // MLMATRIX_H
@@ -1,7 +1,12 @@
 #ifndef MLNET_H
 #define MLNET_H
 #include <caffe2/core/workspace.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
 #include <vector>
+#include "mlmatrix.h"
 
 class MlNet {
 public:
@@ -22,6 +27,16 @@ public:
                           const std::vector<std::vector<XValueType>>&,
                           int,
                           int);
+
+    /**
+     * The rows of X become a n x 1 x height x width float blob,
+     * copied with a single memcpy.
+     */
+    template <typename TensorType>
+    TensorType* add_blob_input(const std::string&,
+                               const FeatureMatrix& X,
+                               int height,
+                               int width);
     void add_FC_op(const std::string& blob_in, 
                    const std::string& blob_out,
                    TIndex dim_in, 
@@ -58,22 +73,36 @@ TensorType* MlNet::add_blob_input(const std::string& name,
                       int height, 
                       int width)
 {
-    std::vector<XValueType> reshaped;
-    reshaped.reserve(X.size() * X[0].size());
+    FeatureMatrix reshaped(X.size(), X.empty() ? 0 : X[0].size());
     
-    for (const auto& line : X) {
-        std::memcpy(reshaped.data(), line.data(), line.size());
+    for (std::size_t i = 0; i != X.size(); ++i) {
+        if (X[i].size() != reshaped.cols())
+            throw std::invalid_argument("rows of X differ in length.");
+        std::copy(X[i].begin(), X[i].end(), reshaped[i].begin());
     }
 
+    return add_blob_input<TensorType>(name, reshaped, height, width);
+}
+
+template <typename TensorType>
+TensorType* MlNet::add_blob_input(const std::string& name,
+                                  const FeatureMatrix& X,
+                                  int height,
+                                  int width)
+{
+    if (X.cols() != static_cast<std::size_t>(height) * width)
+        throw std::invalid_argument("rows of " + std::to_string(X.cols()) + " features don't fit a " +
+                                    std::to_string(height) + " x " + std::to_string(width) + " blob.");
+
     auto data = workspace.CreateBlob(name)->GetMutable<TensorType>();
 
-    int n = X.size();
+    int n = X.rows();
     int c = 1;
     int h = height;
     int w = width;
-    caffe2::TensorCPU input({n, c, h, w}, reshaped, nullptr);
+    data->Resize(n, c, h, w);
+    std::memcpy(data->template mutable_data<float>(), X.data(), X.bytes());
 
-    data->CopyFrom(input);
     return data;
 }
 
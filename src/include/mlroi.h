@@ -0,0 +1,70 @@
+#ifndef MLROI_H
+#define MLROI_H
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * MlRoiTracker detects the game again every interval on a background
+ * thread of idle priority, so a moved browser window doesn't spoil the
+ * rest of a collection.
+ * Detection runs MlImageProcessor::find_roi() on a downsampled frame.
+ * When the detected roi differs from the last one by more than the
+ * tolerance, its edges are found again at full resolution within a few
+ * pixels around it, and if only its position changed it keeps the size
+ * it had at startup. The callback is then invoked with it on the tracker
+ * thread; it's expected to only publish the roi, e.g.
+ * MlImageProcessor::update_roi().
+ */
+class MlRoiTracker {
+public:
+    typedef std::function<cv::Mat()> source_type;
+    typedef std::function<void(const cv::Rect&)> callback_type;
+
+    /**
+     * source returns a full frame to search, it's only called from the
+     * tracker thread. roi is the currently used one. A tolerance below 0
+     * means twice the size of a downsampled pixel.
+     */
+    MlRoiTracker(source_type source,
+                 callback_type callback,
+                 const cv::Rect& roi,
+                 std::chrono::milliseconds interval = std::chrono::seconds(2),
+                 double scale = 0.25,
+                 int tolerance = -1);
+    MlRoiTracker(const MlRoiTracker&) = delete;
+    MlRoiTracker& operator=(const MlRoiTracker&) = delete;
+    ~MlRoiTracker();
+
+    cv::Rect get_roi() const;
+
+    /**
+     * returns number of times the roi was found moved.
+     */
+    std::size_t moves() const noexcept;
+
+private:
+    void run();
+    bool moved(const cv::Rect&) const noexcept;
+    cv::Rect refine(const cv::Mat&, const cv::Rect&) const;
+
+    source_type source;
+    callback_type callback;
+    cv::Rect roi;
+    cv::Size initial_size;
+    std::chrono::milliseconds interval;
+    double scale;
+    int tolerance;
+    std::atomic<std::size_t> move_count;
+    std::atomic_bool stop;
+    mutable std::mutex m;
+    std::condition_variable cv;
+    std::thread local_thread;
+};
+
+#endif // MLROI_H
@@ -2,11 +2,26 @@
 #define MLSCRCAP_H
 #include <opencv2/opencv.hpp>
 #include <stdexcept>
+#include <memory>
+#include <cstdint>
 #include "position.h"
 #include "mldisplay.h"
+#include "mlframe.h"
+#include "mlsource.h"
 
 class MlScreenCapturer;
+struct shm_segment;
+struct _XImage;
+typedef struct _XImage XImage;
 
+/**
+ * capture_mode decides how MlScreenCapturer pulls pixels out of the X server.
+ * 	XGETIMAGE : every screenshot allocates a fresh XImage and copies it
+ * 		    into the returned cv::Mat.
+ * 	SHM	  : screenshots are read into a persistent MIT-SHM segment and
+ * 		    the returned cv::Mat wraps that segment without copying.
+ */
+enum class capture_mode : std::int8_t { XGETIMAGE, SHM };
 /**
  * This is a Struct to coordinates of 2 positions that User has clicked,
  * returned by MlScreen::capture_screen_size();
@@ -20,19 +35,24 @@ struct ScreenArea
 /**
  * MlScreenCapturer handles all of the Screenshot request
  * including selecting the size of screen to capture.
+ * As a MlFrameSource, it never runs out of frames.
  */
-class MlScreenCapturer {
+class MlScreenCapturer : public MlFrameSource {
 public:
 	/**
 	 * Constructor this object requires the display object.
 	 * When constructing object, a directory will be created if
 	 * the directory doesn't exist.
 	 * The directory name is stored in this::save_dir;
+	 * If capture_mode::SHM is requested but the X server doesn't offer
+	 * MIT-SHM (e.g. a remote display), the capturer falls back to
+	 * capture_mode::XGETIMAGE.
 	 */
-	MlScreenCapturer(MlDisplay&);
+	MlScreenCapturer(MlDisplay&, capture_mode = capture_mode::SHM);
 	
 	/**
 	 * Copy Constructor is enabled.
+	 * Note that copies share the same shared memory segment.
 	 */
 	MlScreenCapturer(const MlScreenCapturer&) = default;
 
@@ -55,13 +75,59 @@ public:
 	 */
 	ScreenArea get_screen_coordinate() const;
 
+	/**
+	 * This function returns the capture mode actually in use, which can
+	 * differ from the requested one after a fallback.
+	 */
+	capture_mode get_capture_mode() const noexcept;
+
+	/**
+	 * This function returns the size of screenshot going to be captured.
+	 */
+	cv::Size get_capture_size() const noexcept;
+
+	/**
+	 * This function returns the area of screenshot going to be captured
+	 * in root window coordinates.
+	 */
+	cv::Rect get_capture_area() const noexcept;
+
+	/**
+	 * This function replaces the area of screenshot going to be captured
+	 * with given rectangle in root window coordinates, e.g. to transfer
+	 * only the region of interest found in a previous screenshot.
+	 * The rectangle is clipped to the screen.
+	 */
+	void set_capture_area(const cv::Rect&);
+
 	/**
 	 * This function is called to operate a screenshot.
 	 * Before calling this function, function capture_screen_size(C1&&, C2&&)
 	 * has to be called otherwise it will capture a fullscreen screenshot.
+	 * In capture_mode::SHM the returned cv::Mat refers to the shared
+	 * segment, so it is only valid until the next call of screenshot();
+	 * clone() it if it has to outlive that.
 	 */
     cv::Mat screenshot();
 
+	/**
+	 * Same as above but the screenshot is written into a free frame of
+	 * the given pool instead of a newly allocated cv::Mat.
+	 * In capture_mode::SHM the segment is copied into the frame once;
+	 * in capture_mode::XGETIMAGE XGetSubImage() writes into the frame
+	 * directly, though Xlib still stages the reply in an image of its own.
+	 * The frame size of the pool has to match get_capture_size(),
+	 * otherwise std::logic_error is thrown.
+	 */
+	MlFrame screenshot(MlFramePool&);
+
+	/**
+	 * MlFrameSource interface, same as screenshot(MlFramePool&) and
+	 * get_capture_size() respectively.
+	 */
+	MlFrame next_frame(MlFramePool&) override;
+	cv::Size get_frame_size() const override;
+
 	// public member variable
 	
 	/**
@@ -70,12 +136,30 @@ public:
 	static const std::string save_dir;
 private:
     // private member functions
-    
+
+	/**
+	 * (re)attach the shared memory segment whenever the capture area
+	 * has changed size. Returns false if MIT-SHM can't be used.
+	 */
+	bool prepare_shm_segment(int, int);
+
+	/**
+	 * returns true if screenshots of given size go through the shared
+	 * memory segment, falling back to XGetImage for good if it can't
+	 * be attached.
+	 */
+	bool use_shm(int, int);
+
+	XImage* screenshot_shm();
+	cv::Mat screenshot_xgetimage(int, int);
+	void screenshot_xgetimage(cv::Mat&);
 
 	// private data variables
 	MlDisplay& display;
 	Position positions[2];
 	bool size_captured;
+	capture_mode mode;
+	std::shared_ptr<shm_segment> segment;
 };
 
 /// template function implementation
@@ -0,0 +1,83 @@
+#ifndef MLSOURCE_H
+#define MLSOURCE_H
+#include <opencv2/opencv.hpp>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "mlframe.h"
+
+class MlFrameSource;
+class MlImageDirSource;
+class MlVideoSource;
+
+/**
+ * MlFrameSource is an abstraction of anything producing BGRA frames
+ * for feature extraction, e.g. the screen or a recorded session.
+ * Its child class has to implement function :
+ * 	MlFrame next_frame(MlFramePool&);
+ * 	cv::Size get_frame_size() const;
+ */
+class MlFrameSource {
+public:
+	virtual ~MlFrameSource() = default;
+
+	/**
+	 * This function writes the next frame into a free frame of the given
+	 * pool, whose frame size has to match get_frame_size().
+	 * An empty MlFrame is returned once the source is exhausted.
+	 */
+	virtual MlFrame next_frame(MlFramePool&) = 0;
+
+	/**
+	 * This function returns the size of every frame of this source.
+	 */
+	virtual cv::Size get_frame_size() const = 0;
+};
+
+/**
+ * MlImageDirSource replays the images of a directory in file name order.
+ * Every image must have the same size.
+ */
+class MlImageDirSource : public MlFrameSource {
+public:
+	/**
+	 * Constructor requires the directory and a glob pattern of images.
+	 * std::runtime_error is thrown if no image matches.
+	 */
+	MlImageDirSource(const std::string&, const std::string& = "*.png");
+
+	MlFrame next_frame(MlFramePool&) override;
+	cv::Size get_frame_size() const override;
+
+	/**
+	 * returns number of images in the directory.
+	 */
+	std::size_t size() const noexcept;
+
+private:
+	std::vector<std::string> files;
+	std::size_t next;
+	cv::Size frame_size;
+};
+
+/**
+ * MlVideoSource replays the frames of a video file through cv::VideoCapture.
+ */
+class MlVideoSource : public MlFrameSource {
+public:
+	/**
+	 * Constructor requires the path of the video file.
+	 * std::runtime_error is thrown if the file can't be opened.
+	 */
+	explicit MlVideoSource(const std::string&);
+
+	MlFrame next_frame(MlFramePool&) override;
+	cv::Size get_frame_size() const override;
+
+private:
+	cv::VideoCapture capture;
+	cv::Mat buffer;
+	cv::Size frame_size;
+};
+
+#endif // MLSOURCE_H
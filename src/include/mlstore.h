@@ -0,0 +1,198 @@
+#ifndef MLSTORE_H
+#define MLSTORE_H
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "mldataset.h"
+
+/**
+ * A shard of an MlDatasetStore as its manifest records it, so shards
+ * can be picked and sized without opening them.
+ * file    : name of the binary dataset, relative to the store.
+ * session : collection the shard was written by, shards of a session
+ *           share it.
+ * labels  : number of records of every label.
+ */
+struct shard_info {
+    std::string file;
+    std::string session;
+    std::size_t records = 0;
+    std::map<int, std::size_t> labels;
+};
+
+/**
+ * MlDatasetStore is a directory of binary datasets, the shards, listed by
+ * manifest.json with their counts and label histograms. Shards are never
+ * changed once added, a new session only appends shards, and the manifest
+ * is replaced by a rename so a reader never sees it half written.
+ * Every shard has the geometry and feature mode of the first one.
+ * The store locks itself, one thread may add a shard while another one
+ * names the next. Several processes may collect into the same store:
+ * the manifest is read back and updated under a flock of <dir>/.lock,
+ * and every shard file is created exclusively.
+ */
+class MlDatasetStore {
+public:
+    typedef std::function<bool(const shard_info&)> filter_type;
+
+    /**
+     * Opens the store in directory, creating an empty one if it has no
+     * manifest yet.
+     * Throws std::runtime_error if the directory can't be created or the
+     * manifest is invalid.
+     */
+    explicit MlDatasetStore(const std::string& directory);
+    MlDatasetStore(const MlDatasetStore&) = delete;
+    MlDatasetStore& operator=(const MlDatasetStore&) = delete;
+
+    const std::string& directory() const noexcept;
+
+    /**
+     * returns false while the store has no shard, and so no geometry.
+     */
+    bool has_geometry() const;
+    dataset_geometry geometry() const;
+
+    std::vector<shard_info> shards() const;
+
+    /**
+     * returns number of records of the shards filter picks, all without
+     * a filter.
+     */
+    std::size_t size(const filter_type& = nullptr) const;
+    std::map<int, std::size_t> count_labels(const filter_type& = nullptr) const;
+
+    /**
+     * creates an empty file for a new shard and returns its path, a file
+     * name no shard of the store or of another process has.
+     * Throws std::runtime_error if the file can't be created.
+     */
+    std::string new_shard_path();
+
+    /**
+     * counts the records of a finished shard in the directory and adds it
+     * to the manifest, along with the shards other processes added since
+     * it was last read; an empty shard is removed instead. Returns true if
+     * the shard was added.
+     * Throws std::runtime_error if the shard can't be read or its
+     * geometry differs from the store's.
+     */
+    bool add_shard(const std::string& path, const std::string& session);
+
+private:
+    void load();
+    void save() const;
+
+    std::string dir;
+    dataset_geometry dataset;
+    std::vector<shard_info> shard_list;
+    std::size_t next_id;
+    mutable std::mutex m;
+};
+
+/**
+ * returns a filter picking the shards of given sessions.
+ */
+MlDatasetStore::filter_type session_filter(const std::vector<std::string>& sessions);
+
+/**
+ * Loads the shards filter picks, all without a filter, into one dataset
+ * in manifest order. The manifest sizes the dataset up front and every
+ * shard is read straight into its rows, threads shards at once; 0 threads
+ * means one per core.
+ * Throws std::runtime_error if a shard can't be read or doesn't match
+ * the manifest.
+ */
+MlDataset load_shards(const MlDatasetStore&, const MlDatasetStore::filter_type& = nullptr, std::size_t threads = 0);
+
+/**
+ * MlShardWriter writes a collection into new shards of a store through
+ * MlAsyncDatasetWriter, starting another shard every shard_records
+ * samples, or a single shard with 0. Full shards are queued to a single
+ * finisher thread, which closes them and adds them to the store one at a
+ * time in order, so write() never waits for a shard to be finished.
+ */
+class MlShardWriter {
+public:
+    typedef MlAsyncDatasetWriter::time_point time_point;
+
+    /**
+     * Throws std::runtime_error if the store has another geometry or
+     * feature mode, or if the first shard can't be opened.
+     */
+    MlShardWriter(MlDatasetStore&,
+                  const std::string& session,
+                  const dataset_geometry&,
+                  std::size_t shard_records = 0,
+                  const async_writer_options& = async_writer_options());
+    MlShardWriter(const MlShardWriter&) = delete;
+    MlShardWriter& operator=(const MlShardWriter&) = delete;
+
+    /**
+     * Destructor closes, but swallows errors.
+     */
+    ~MlShardWriter();
+
+    /**
+     * same as MlAsyncDatasetWriter::write(); also rethrows an error of
+     * finishing an earlier shard.
+     */
+    bool write(const std::vector<float>& features, int label, time_point);
+
+    /**
+     * finishes the current shard and waits until every shard is added.
+     * Rethrows the first error of finishing a shard not rethrown yet.
+     */
+    void close();
+
+    /**
+     * returns number of samples written, dropped and the high water mark
+     * over every shard.
+     */
+    std::size_t size() const noexcept;
+    std::size_t dropped() const noexcept;
+    std::size_t high_water() const noexcept;
+
+    /**
+     * returns number of shards started.
+     */
+    std::size_t shards() const noexcept;
+
+private:
+    void start();
+    void rotate();
+    void finish();
+    void rethrow();
+
+    MlDatasetStore& store;
+    std::string session;
+    dataset_geometry dataset;
+    std::size_t shard_records;
+    async_writer_options opts;
+
+    std::unique_ptr<MlAsyncDatasetWriter> writer;
+    std::string writer_path;
+    std::size_t accepted;
+
+    // full shards and their paths, the front one is being finished
+    std::deque<std::pair<std::unique_ptr<MlAsyncDatasetWriter>, std::string>> queued;
+    std::exception_ptr error;
+    bool stop;
+    mutable std::mutex m;
+    std::condition_variable cv;
+    std::thread finisher;
+
+    std::size_t written_count, dropped_count, high_water_mark, shard_count;
+};
+
+#endif // MLSTORE_H
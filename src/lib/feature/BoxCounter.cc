@@ -0,0 +1,62 @@
+#include "BoxCounter.h"
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    std::vector<int> grid_edges(int length, int n)
+    {
+        std::vector<int> edges(n + 1);
+        for (int i = 0; i <= n; ++i)
+            edges[i] = static_cast<int>(static_cast<std::int64_t>(i) * length / n);
+        return edges;
+    }
+}
+
+void IntegralBoxCounter::reset(const cv::Mat& path_mask, const cv::Mat& player_mask)
+{
+    if (path_mask.size() != player_mask.size())
+        throw std::invalid_argument("path and player masks differ in size.");
+
+    // 32-bit sums are exact for masks up to 2^31 / 255 pixels
+    cv::integral(path_mask, path_sum, CV_32S);
+    cv::integral(player_mask, player_sum, CV_32S);
+}
+
+void IntegralBoxCounter::count(const grid_size& grid, std::vector<float>& features) const
+{
+    if (grid.cols <= 0 || grid.rows <= 0)
+        throw std::invalid_argument("grid must have at least one box.");
+
+    auto col_edges = grid_edges(path_sum.cols - 1, grid.cols);
+    auto row_edges = grid_edges(path_sum.rows - 1, grid.rows);
+
+    count_mask(path_sum, col_edges, row_edges, features);
+    count_mask(player_sum, col_edges, row_edges, features);
+}
+
+std::size_t IntegralBoxCounter::size(const std::vector<grid_size>& grids) noexcept
+{
+    std::size_t n = 0;
+    for (const auto& grid : grids)
+        n += 2 * static_cast<std::size_t>(grid.cols) * grid.rows;
+    return n;
+}
+
+void IntegralBoxCounter::count_mask(const cv::Mat& sum,
+                                    const std::vector<int>& col_edges,
+                                    const std::vector<int>& row_edges,
+                                    std::vector<float>& features) const
+{
+    for (std::size_t i = 0; i + 1 != col_edges.size(); ++i) {
+        int x0 = col_edges[i], x1 = col_edges[i + 1];
+        for (std::size_t j = 0; j + 1 != row_edges.size(); ++j) {
+            const std::int32_t *top = sum.ptr<std::int32_t>(row_edges[j]);
+            const std::int32_t *bottom = sum.ptr<std::int32_t>(row_edges[j + 1]);
+
+            // masks hold 255 per set pixel
+            features.push_back((bottom[x1] - bottom[x0] - top[x1] + top[x0]) / 255);
+        }
+    }
+}
@@ -0,0 +1,117 @@
+#include "ColorLut.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+ColorLut::ColorLut(const feature_thresholds& thresholds, int bits)
+    : thresholds(thresholds),
+      bits(bits),
+      shift(8 - bits)
+{
+    if (bits < 1 || bits > 8)
+        throw std::invalid_argument("ColorLut requires 1 to 8 bits per channel.");
+
+    const int levels = 1 << bits;
+    const int width = 1 << shift;
+    table.resize(static_cast<std::size_t>(levels) * levels * levels);
+
+    // a BGR range overlaps a cell iff it overlaps the cell on every channel
+    auto overlaps = [&](const color_range& range, int b, int g, int r) {
+        const int lo[3] = { b << shift, g << shift, r << shift };
+        for (int c = 0; c != 3; ++c) {
+            if (range.max[c] < lo[c] || range.min[c] > lo[c] + width - 1)
+                return false;
+        }
+        return true;
+    };
+    // V is the largest channel, so the player can only be in a cell whose
+    // V span overlaps its V range; those cells are tested colour by colour
+    auto player_in = [&](int b, int g, int r) {
+        const int lo = std::max({ b, g, r }) << shift;
+        if (thresholds.player.max[2] < lo || thresholds.player.min[2] > lo + width - 1)
+            return false;
+        for (int cb = b << shift; cb != (b + 1) << shift; ++cb) {
+            for (int cg = g << shift; cg != (g + 1) << shift; ++cg) {
+                for (int cr = r << shift; cr != (r + 1) << shift; ++cr) {
+                    int h, s, v;
+                    bgr_to_hsv(cb, cg, cr, h, s, v);
+                    if (thresholds.player.contains(h, s, v))
+                        return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    std::size_t index = 0;
+    for (int b = 0; b != levels; ++b) {
+        for (int g = 0; g != levels; ++g) {
+            for (int r = 0; r != levels; ++r) {
+                table[index++] = (overlaps(thresholds.path, b, g, r) ? color_class::PATH : 0) |
+                                 (overlaps(thresholds.coin, b, g, r) ? color_class::COIN : 0) |
+                                 (player_in(b, g, r) ? color_class::PLAYER : 0);
+            }
+        }
+    }
+}
+
+std::shared_ptr<const ColorLut> ColorLut::shared(const feature_thresholds& thresholds)
+{
+    // built under the lock, workers asking meanwhile wait for this one
+    static std::mutex m;
+    static std::shared_ptr<const ColorLut> last;
+    std::lock_guard<std::mutex> lck{m};
+    if (!last || !(last->thresholds == thresholds))
+        last = std::make_shared<const ColorLut>(thresholds);
+    return last;
+}
+
+void ColorLut::classify_masks(const cv::Mat& bgra, cv::Mat& path, cv::Mat& player) const
+{
+    if (bgra.type() != CV_8UC4)
+        throw std::invalid_argument("ColorLut::classify_masks requires an 8-bit BGRA image.");
+
+    path.create(bgra.size(), CV_8UC1);
+    player.create(bgra.size(), CV_8UC1);
+    for (int y = 0; y != bgra.rows; ++y) {
+        const std::uint8_t *px = bgra.ptr<std::uint8_t>(y);
+        std::uint8_t *path_row = path.ptr<std::uint8_t>(y);
+        std::uint8_t *player_row = player.ptr<std::uint8_t>(y);
+        for (int x = 0; x != bgra.cols; ++x, px += 4) {
+            std::uint8_t mask = classify(px[0], px[1], px[2]);
+            path_row[x] = mask & (color_class::PATH | color_class::COIN) ? 255 : 0;
+            player_row[x] = mask & color_class::PLAYER ? 255 : 0;
+        }
+    }
+}
+
+const feature_thresholds& ColorLut::get_thresholds() const noexcept
+{
+    return thresholds;
+}
+
+int ColorLut::get_bits() const noexcept
+{
+    return bits;
+}
+
+color_lut_errors check_color_lut(const ColorLut& lut)
+{
+    const auto& thresholds = lut.get_thresholds();
+    color_lut_errors errors;
+    for (int b = 0; b != 256; ++b) {
+        for (int g = 0; g != 256; ++g) {
+            for (int r = 0; r != 256; ++r) {
+                std::uint8_t expected = thresholds.classify(b, g, r);
+                std::uint8_t actual = lut.classify(b, g, r);
+                errors.lost |= expected & ~actual;
+                errors.extra |= actual & ~expected;
+            }
+        }
+    }
+    return errors;
+}
@@ -4,18 +4,29 @@
 #include <vector>
 #include <future>
 #include <utility>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 
 ExtractFeatureExecutor::ExtractFeatureExecutor()
-    : stop(true), status(exec_status::EMPTY)
+    : stop(true),
+      status(exec_status::EMPTY),
+      mode(feature_mode::REFERENCE),
+      geometry(default_geometry()),
+      kernel(find_kernel(geometry)),
+      incremental(incremental_mode::OFF),
+      stats(std::make_shared<incremental_stats>()),
+      grids(std::make_shared<const std::vector<grid_size>>())
 {}
 
-void ExtractFeatureExecutor::start(const cv::Rect& cropper, settings_type& settings)
+void ExtractFeatureExecutor::start(const cv::Rect& new_cropper, const settings_type& settings)
 {
+    set_cropper(new_cropper);
 
     stop.store(false, std::memory_order_release);
     status.store(exec_status::EMPTY, std::memory_order_release);
     
-    local_thread = std::thread([&, cropper] {
+    local_thread = std::thread([this, settings] {
         std::unique_lock<std::mutex> lck{buffer_m};
         while (!stop.load(std::memory_order_acquire)) {
             cv.wait(lck, [&] { 
@@ -25,16 +36,41 @@ void ExtractFeatureExecutor::start(const cv::Rect& cropper, settings_type& setti
             if (stop.load(std::memory_order_acquire))
                 break;
             status.store(exec_status::ONGOING, std::memory_order_release);
-            task(cropper, settings);
+            task(settings);
             status.store(exec_status::EMPTY, std::memory_order_release);
         }
     });
             
 }
 
+std::future<std::vector<float>> 
+ExtractFeatureExecutor::submit(decltype(task)&& new_task)
+{
+    std::future<std::vector<float>> result;
+    {
+        // the worker holds buffer_m while it runs a task, so this waits
+        // for a task whose future has just been satisfied to be retired
+        std::lock_guard<std::mutex> lck{buffer_m};
+
+        if (stop.load(std::memory_order_acquire))
+            throw std::logic_error("ExtractFeatureExecuter is suspended but being invoked.");
+        if (status.load(std::memory_order_acquire) != exec_status::EMPTY)
+            throw std::logic_error("buffer of ExtractFeatureExecuter is not empty but being revised.");
+
+        task = std::move(new_task);
+        result = task.get_future();
+        status.store(exec_status::READY, std::memory_order_release);
+    }
+    cv.notify_one();
+    return result;
+}
+
 void ExtractFeatureExecutor::end()
 {
-    stop.store(true, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lck{buffer_m};
+        stop.store(true, std::memory_order_release);
+    }
     cv.notify_one();
     if (local_thread.joinable())
         local_thread.join();
@@ -50,3 +86,219 @@ exec_status ExtractFeatureExecutor::get_status() noexcept
     return status.load(std::memory_order_acquire);
 }
 
+
+feature_mode ExtractFeatureExecutor::get_mode() noexcept
+{
+    return mode.load(std::memory_order_acquire);
+}
+
+void ExtractFeatureExecutor::set_mode(feature_mode new_mode) noexcept
+{
+    mode.store(new_mode, std::memory_order_release);
+}
+
+std::vector<grid_size> ExtractFeatureExecutor::get_grids()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return *grids;
+}
+
+void ExtractFeatureExecutor::set_grids(const std::vector<grid_size>& new_grids)
+{
+    auto copy = std::make_shared<const std::vector<grid_size>>(new_grids);
+    std::lock_guard<std::mutex> lck{options_m};
+    grids = std::move(copy);
+}
+
+void ExtractFeatureExecutor::set_visualizer(std::shared_ptr<PreviewVisualizer> new_visualizer)
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    visualizer = std::move(new_visualizer);
+}
+
+void ExtractFeatureExecutor::set_cropper(const cv::Rect& new_cropper)
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    cropper = new_cropper;
+}
+
+cv::Rect ExtractFeatureExecutor::get_cropper()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return cropper;
+}
+
+grid_geometry ExtractFeatureExecutor::get_geometry()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return geometry;
+}
+
+void ExtractFeatureExecutor::set_geometry(const grid_geometry& new_geometry)
+{
+    if (!new_geometry.valid())
+        throw std::invalid_argument("boxes of grid_geometry don't divide its roi.");
+
+    auto new_kernel = find_kernel(new_geometry);
+    std::lock_guard<std::mutex> lck{options_m};
+    geometry = new_geometry;
+    kernel = new_kernel;
+}
+
+incremental_mode ExtractFeatureExecutor::get_incremental() noexcept
+{
+    return incremental.load(std::memory_order_acquire);
+}
+
+void ExtractFeatureExecutor::set_incremental(incremental_mode new_incremental) noexcept
+{
+    incremental.store(new_incremental, std::memory_order_release);
+}
+
+std::shared_ptr<const incremental_stats> ExtractFeatureExecutor::get_incremental_stats() const noexcept
+{
+    return stats;
+}
+
+ExtractFeatureExecutor::task_options ExtractFeatureExecutor::get_task_options()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return { cropper, get_mode(), geometry, kernel, get_incremental(), stats, grids, visualizer };
+}
+
+std::future<std::vector<float>> ExtractFeatureExecutor::operator()(const cv::Mat& img)
+{
+    decltype(task) new_task([img, options = get_task_options()](const settings_type& settings) {
+        return extract(img, options.cropper, settings, options);
+    });
+    return submit(std::move(new_task));
+}
+
+std::future<std::vector<float>> ExtractFeatureExecutor::operator()(MlFrame frame)
+{
+    decltype(task) new_task([frame = std::move(frame), options = get_task_options()](const settings_type& settings) mutable {
+        auto features = extract(frame.mat(), options.cropper, settings, options);
+        // hand the slot back to its pool as soon as the features are out
+        frame.release();
+        return features;
+    });
+    return submit(std::move(new_task));
+}
+
+std::vector<float> ExtractFeatureExecutor::extract(const cv::Mat& img,
+                                                   const cv::Rect& cropper,
+                                                   const settings_type& settings,
+                                                   const task_options& options)
+{
+    return options.kernel(img, cropper, settings, options);
+}
+
+ExtractFeatureExecutor::kernel_type ExtractFeatureExecutor::find_kernel(const grid_geometry& geometry) noexcept
+{
+    // geometries worth a kernel of their own: the original 12 x 21 grid,
+    // the other grids of feature_mode::MULTI_SCALE and the 24 x 60 grid
+    typedef fixed_geometry<20, 20, 840, 480> fine_geometry;
+    typedef fixed_geometry<84, 80, 840, 480> coarse_geometry;
+    typedef fixed_geometry<14, 20, 840, 480> dense_geometry;
+
+    static const std::pair<grid_geometry, kernel_type> kernels[] = {
+        { default_geometry(), &extract_with<default_geometry> },
+        { fine_geometry(), &extract_with<fine_geometry> },
+        { coarse_geometry(), &extract_with<coarse_geometry> },
+        { dense_geometry(), &extract_with<dense_geometry> },
+    };
+
+    for (const auto& [fixed, kernel] : kernels) {
+        if (fixed == geometry)
+            return kernel;
+    }
+    return &extract_with<grid_geometry>;
+}
+
+std::vector<float> ExtractFeatureExecutor::extract_multi_scale(const cv::Mat& img,
+                                                               const cv::Rect& cropper,
+                                                               const settings_type& settings,
+                                                               const std::vector<grid_size>& grids,
+                                                               PreviewVisualizer* visualizer)
+{
+    // the grids are over the default roi, not the one of the geometry
+    cv::Mat pathway_img, player_img;
+    make_masks(img, cropper, settings, default_geometry(), pathway_img, player_img, visualizer);
+
+    // one summed-area table per class, then every grid is O(1) per box
+    thread_local IntegralBoxCounter counter;
+    counter.reset(pathway_img, player_img);
+
+    std::vector<float> features;
+    features.reserve(counter.size(grids));
+    for (const auto& grid : grids)
+        counter.count(grid, features);
+
+    return features;
+}
+
+std::vector<float> ExtractFeatureExecutor::extract_reference(const cv::Mat& img,
+                                                             const cv::Rect& cropper,
+                                                             const settings_type& settings,
+                                                             const grid_geometry& geometry,
+                                                             PreviewVisualizer* visualizer)
+{
+
+    cv::Mat pathway_img, player_img;
+
+    const int num_box_in_roi = geometry.boxes();
+    std::vector<float> features(num_box_in_roi * 2, 0.0f);
+
+    make_masks(img, cropper, settings, geometry, pathway_img, player_img, visualizer);
+    
+    // non-zero pixels per box, column-major, pathway then player
+    count_boxes(pathway_img, geometry.box_w, geometry.box_h, features.data());
+    count_boxes(player_img, geometry.box_w, geometry.box_h, features.data() + num_box_in_roi);
+
+    
+    // hopefully NRVO applies here
+    return features;
+}
+
+const ColorLut& ExtractFeatureExecutor::color_lut(const settings_type& settings)
+{
+    // every worker keeps its own reference to the table
+    thread_local std::shared_ptr<const ColorLut> lut;
+    if (!lut || !(lut->get_thresholds() == settings))
+        lut = ColorLut::shared(settings);
+    return *lut;
+}
+
+void ExtractFeatureExecutor::make_masks(const cv::Mat& img,
+                                        const cv::Rect& cropper,
+                                        const settings_type& settings,
+                                        const grid_geometry& geometry,
+                                        cv::Mat& pathway_img,
+                                        cv::Mat& player_img,
+                                        PreviewVisualizer* visualizer)
+{
+    cv::Mat resized_img;
+    cv::Mat target_img;
+
+    // crop image
+    cv::Mat roi = img(cropper);
+
+    // resize image, staying BGRA: every step below is per channel and the
+    // range test ignores alpha, so the masks are the same as on BGR
+    cv::resize(roi, resized_img, cv::Size(geometry.roi_w, geometry.roi_h), 0, 0, CV_INTER_LINEAR);
+    cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT,
+                                               cv::Size(2, 2));
+
+    cv::medianBlur(resized_img, resized_img, 3);
+    cv::morphologyEx(resized_img, target_img, cv::MORPH_CLOSE, kernel);
+    if (visualizer)
+        visualizer->post("preview", target_img);
+
+    // one lookup per pixel instead of the BGR range tests, an HSV
+    // conversion and the HSV range test
+    color_lut(settings).classify_masks(target_img, pathway_img, player_img);
+    if (visualizer) {
+        visualizer->post("path", pathway_img);
+        visualizer->post("player", player_img);
+    }
+}
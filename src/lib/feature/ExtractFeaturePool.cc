@@ -0,0 +1,286 @@
+#include "ExtractFeaturePool.h"
+#include <opencv2/opencv.hpp>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+dropped_frame::dropped_frame(const std::string& s)
+    : std::runtime_error(s) { }
+
+ExtractFeaturePool::ExtractFeaturePool(std::size_t workers,
+                                       std::size_t capacity,
+                                       backpressure policy)
+    : n_workers(workers),
+      capacity(capacity),
+      policy(policy),
+      next_seq(0),
+      next_publish(0),
+      settings{},
+      mode(feature_mode::REFERENCE),
+      geometry(default_geometry()),
+      kernel(ExtractFeatureExecutor::find_kernel(geometry)),
+      incremental(incremental_mode::OFF),
+      stats(std::make_shared<incremental_stats>()),
+      grids(std::make_shared<const std::vector<grid_size>>()),
+      stop(true),
+      dropped_count(0)
+{
+    if (workers == 0 || capacity == 0)
+        throw std::invalid_argument("ExtractFeaturePool requires at least 1 worker and 1 queue slot.");
+}
+
+ExtractFeaturePool::~ExtractFeaturePool()
+{
+    end();
+}
+
+void ExtractFeaturePool::start(const cv::Rect& new_cropper, const settings_type& new_settings)
+{
+    end();
+
+    set_cropper(new_cropper);
+    settings = new_settings;
+    stop.store(false, std::memory_order_release);
+
+    for (std::size_t i = 0; i != n_workers; ++i)
+        workers.emplace_back([this] { run(); });
+}
+
+void ExtractFeaturePool::end()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        stop.store(true, std::memory_order_release);
+    }
+    not_empty.notify_all();
+    not_full.notify_all();
+    turn.notify_all();
+    for (auto& worker : workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+    workers.clear();
+
+    // whatever is still queued will never be extracted
+    std::lock_guard<std::mutex> lck{m};
+    for (auto& j : queue) {
+        j.result.set_exception(std::make_exception_ptr(dropped_frame("ExtractFeaturePool ended before the frame was extracted.")));
+    }
+    queue.clear();
+    skipped.clear();
+    next_publish = next_seq;
+}
+
+feature_mode ExtractFeaturePool::get_mode() noexcept
+{
+    return mode.load(std::memory_order_acquire);
+}
+
+void ExtractFeaturePool::set_mode(feature_mode new_mode) noexcept
+{
+    mode.store(new_mode, std::memory_order_release);
+}
+
+std::vector<grid_size> ExtractFeaturePool::get_grids()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return *grids;
+}
+
+void ExtractFeaturePool::set_grids(const std::vector<grid_size>& new_grids)
+{
+    auto copy = std::make_shared<const std::vector<grid_size>>(new_grids);
+    std::lock_guard<std::mutex> lck{options_m};
+    grids = std::move(copy);
+}
+
+void ExtractFeaturePool::set_cropper(const cv::Rect& new_cropper)
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    cropper = new_cropper;
+}
+
+cv::Rect ExtractFeaturePool::get_cropper()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return cropper;
+}
+
+grid_geometry ExtractFeaturePool::get_geometry()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return geometry;
+}
+
+void ExtractFeaturePool::set_geometry(const grid_geometry& new_geometry)
+{
+    if (!new_geometry.valid())
+        throw std::invalid_argument("boxes of grid_geometry don't divide its roi.");
+
+    auto new_kernel = ExtractFeatureExecutor::find_kernel(new_geometry);
+    std::lock_guard<std::mutex> lck{options_m};
+    geometry = new_geometry;
+    kernel = new_kernel;
+}
+
+incremental_mode ExtractFeaturePool::get_incremental() noexcept
+{
+    return incremental.load(std::memory_order_acquire);
+}
+
+void ExtractFeaturePool::set_incremental(incremental_mode new_incremental) noexcept
+{
+    incremental.store(new_incremental, std::memory_order_release);
+}
+
+std::shared_ptr<const incremental_stats> ExtractFeaturePool::get_incremental_stats() const noexcept
+{
+    return stats;
+}
+
+void ExtractFeaturePool::set_visualizer(std::shared_ptr<PreviewVisualizer> new_visualizer)
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    visualizer = std::move(new_visualizer);
+}
+
+ExtractFeatureExecutor::task_options ExtractFeaturePool::get_task_options()
+{
+    std::lock_guard<std::mutex> lck{options_m};
+    return { cropper, get_mode(), geometry, kernel, get_incremental(), stats, grids, visualizer };
+}
+
+std::future<std::vector<float>> ExtractFeaturePool::operator()(const cv::Mat& img)
+{
+    return submit([img, options = get_task_options()](const settings_type& settings) {
+        return ExtractFeatureExecutor::extract(img, options.cropper, settings, options);
+    });
+}
+
+std::future<std::vector<float>> ExtractFeaturePool::operator()(MlFrame frame)
+{
+    // std::function requires a copyable callable, MlFrame copies share the slot
+    return submit([frame = std::move(frame), options = get_task_options()](const settings_type& settings) {
+        return ExtractFeatureExecutor::extract(frame.mat(), options.cropper, settings, options);
+    });
+}
+
+std::size_t ExtractFeaturePool::dropped() const noexcept
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
+
+std::size_t ExtractFeaturePool::size() const noexcept
+{
+    return n_workers;
+}
+
+std::future<std::vector<float>> ExtractFeaturePool::submit(work_type&& work)
+{
+    std::unique_lock<std::mutex> lck{m};
+
+    if (stop.load(std::memory_order_acquire))
+        throw std::logic_error("ExtractFeaturePool is suspended but being invoked.");
+
+    if (queue.size() >= capacity) {
+        switch (policy) {
+        case backpressure::BLOCK:
+            not_full.wait(lck, [&] {
+                return queue.size() < capacity || stop.load(std::memory_order_acquire);
+            });
+            if (stop.load(std::memory_order_acquire))
+                throw std::logic_error("ExtractFeaturePool is suspended but being invoked.");
+            break;
+        case backpressure::DROP_OLDEST: {
+            auto& oldest = queue.front();
+            oldest.result.set_exception(std::make_exception_ptr(dropped_frame("frame dropped by ExtractFeaturePool.")));
+            skip(oldest.seq);
+            queue.pop_front();
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+        case backpressure::DROP_NEWEST: {
+            // never queued, so it takes no place in the completion order
+            std::promise<std::vector<float>> result;
+            result.set_exception(std::make_exception_ptr(dropped_frame("frame dropped by ExtractFeaturePool.")));
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            return result.get_future();
+        }
+        }
+    }
+
+    queue.push_back({ next_seq++, std::move(work), std::promise<std::vector<float>>() });
+    auto result = queue.back().result.get_future();
+    lck.unlock();
+    not_empty.notify_one();
+
+    return result;
+}
+
+void ExtractFeaturePool::run()
+{
+    while (true) {
+        job j;
+        {
+            std::unique_lock<std::mutex> lck{m};
+            not_empty.wait(lck, [&] {
+                return !queue.empty() || stop.load(std::memory_order_acquire);
+            });
+            if (stop.load(std::memory_order_acquire))
+                return;
+            j = std::move(queue.front());
+            queue.pop_front();
+        }
+        not_full.notify_one();
+
+        std::vector<float> features;
+        std::exception_ptr error;
+        try {
+            features = j.work(settings);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        // drop the captured frame before waiting for the turn to publish
+        j.work = nullptr;
+
+        publish(j, std::move(features), error);
+    }
+}
+
+void ExtractFeaturePool::publish(job& j, std::vector<float>&& features, std::exception_ptr error)
+{
+    std::unique_lock<std::mutex> lck{m};
+    turn.wait(lck, [&] {
+        return next_publish == j.seq || stop.load(std::memory_order_acquire);
+    });
+
+    if (error)
+        j.result.set_exception(error);
+    else
+        j.result.set_value(std::move(features));
+
+    if (next_publish == j.seq) {
+        ++next_publish;
+        while (skipped.erase(next_publish))
+            ++next_publish;
+    }
+    lck.unlock();
+    turn.notify_all();
+}
+
+void ExtractFeaturePool::skip(std::uint64_t seq)
+{
+    // called with m held
+    if (seq == next_publish) {
+        ++next_publish;
+        while (skipped.erase(next_publish))
+            ++next_publish;
+        turn.notify_all();
+    } else {
+        skipped.insert(seq);
+    }
+}
@@ -0,0 +1,327 @@
+#include "FusedChain.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+    // fixed point of cv::resize, weights are scaled by 2^11
+    constexpr int coef_bits = 11;
+    constexpr int coef_scale = 1 << coef_bits;
+
+    // source index and weights of every output index of one axis, the way
+    // cv::resize computes them for INTER_LINEAR. Along x an index beyond
+    // the source is moved onto its edge with all the weight; along y it's
+    // kept with its weights and only the rows read are clamped.
+    void linear_coefficients(int src_len, int dst_len, bool clamp,
+                             std::vector<int>& ofs, std::vector<std::int16_t>& weights)
+    {
+        const double scale = 1. / (static_cast<double>(dst_len) / src_len);
+        ofs.resize(dst_len);
+        weights.resize(2 * dst_len);
+
+        for (int d = 0; d != dst_len; ++d) {
+            float f = static_cast<float>((d + 0.5) * scale - 0.5);
+            int s = static_cast<int>(std::floor(f));
+            f -= s;
+            if (clamp && s < 0)
+                f = 0, s = 0;
+            if (clamp && s >= src_len - 1)
+                f = 0, s = src_len - 1;
+
+            ofs[d] = s;
+            weights[2 * d] = cv::saturate_cast<std::int16_t>((1.f - f) * coef_scale);
+            weights[2 * d + 1] = cv::saturate_cast<std::int16_t>(f * coef_scale);
+        }
+    }
+
+    inline void sort2(std::uint8_t& a, std::uint8_t& b)
+    {
+        std::uint8_t t = a;
+        a = std::min(a, b);
+        b = std::max(t, b);
+    }
+
+    // median of 9 as the middle of the column lows' max, the column
+    // middles' median and the column highs' min
+    inline std::uint8_t median9(std::uint8_t a0, std::uint8_t a1, std::uint8_t a2,
+                                std::uint8_t b0, std::uint8_t b1, std::uint8_t b2,
+                                std::uint8_t c0, std::uint8_t c1, std::uint8_t c2)
+    {
+        sort2(a0, a1); sort2(a1, a2); sort2(a0, a1);
+        sort2(b0, b1); sort2(b1, b2); sort2(b0, b1);
+        sort2(c0, c1); sort2(c1, c2); sort2(c0, c1);
+        std::uint8_t lo = std::max(std::max(a0, b0), c0);
+        std::uint8_t hi = std::min(std::min(a2, b2), c2);
+        std::uint8_t mid = std::max(std::min(a1, b1), std::min(std::max(a1, b1), c1));
+        sort2(lo, mid); sort2(mid, hi); sort2(lo, mid);
+        return mid;
+    }
+
+    // the rows below process [from, n) and return where they stopped, the
+    // caller finishes the rest with the scalar code
+#ifdef __SSE2__
+    inline __m128i load(const std::uint8_t *p)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    }
+
+    inline void store(std::uint8_t *p, __m128i v)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+    }
+
+    inline void sort2(__m128i& a, __m128i& b)
+    {
+        __m128i t = a;
+        a = _mm_min_epu8(a, b);
+        b = _mm_max_epu8(t, b);
+    }
+
+    // same network as median9(), 16 channels at a time
+    int median_row(const std::uint8_t *r0, const std::uint8_t *r, const std::uint8_t *r1,
+                   std::uint8_t *m, int from, int n)
+    {
+        int i = from;
+        for (; i + 16 + 4 <= n; i += 16) {
+            __m128i a0 = load(r0 + i - 4), a1 = load(r + i - 4), a2 = load(r1 + i - 4);
+            __m128i b0 = load(r0 + i), b1 = load(r + i), b2 = load(r1 + i);
+            __m128i c0 = load(r0 + i + 4), c1 = load(r + i + 4), c2 = load(r1 + i + 4);
+            sort2(a0, a1); sort2(a1, a2); sort2(a0, a1);
+            sort2(b0, b1); sort2(b1, b2); sort2(b0, b1);
+            sort2(c0, c1); sort2(c1, c2); sort2(c0, c1);
+            __m128i lo = _mm_max_epu8(_mm_max_epu8(a0, b0), c0);
+            __m128i hi = _mm_min_epu8(_mm_min_epu8(a2, b2), c2);
+            __m128i mid = _mm_max_epu8(_mm_min_epu8(a1, b1), _mm_min_epu8(_mm_max_epu8(a1, b1), c1));
+            sort2(lo, mid); sort2(mid, hi); sort2(lo, mid);
+            store(m + i, mid);
+        }
+        return i;
+    }
+
+    // max (or min) of a pixel and its left neighbour in two rows
+    template <bool dilate>
+    int close_row(const std::uint8_t *a, const std::uint8_t *b, std::uint8_t *out, int from, int n)
+    {
+        int i = from;
+        for (; i + 16 <= n; i += 16) {
+            __m128i x = load(a + i), xl = load(a + i - 4);
+            __m128i y = load(b + i), yl = load(b + i - 4);
+            if (dilate)
+                store(out + i, _mm_max_epu8(_mm_max_epu8(x, xl), _mm_max_epu8(y, yl)));
+            else
+                store(out + i, _mm_min_epu8(_mm_min_epu8(x, xl), _mm_min_epu8(y, yl)));
+        }
+        return i;
+    }
+
+    // the 16 bit multiply high and rounding shift cv::resize uses; the
+    // horizontal sums fit 16 bits after dropping 4, so the saturating
+    // packs never clip
+    int vertical_row(const std::int32_t *h0, const std::int32_t *h1, int b0, int b1,
+                     std::uint8_t *out, int n)
+    {
+        const __m128i w0 = _mm_set1_epi16(static_cast<short>(b0));
+        const __m128i w1 = _mm_set1_epi16(static_cast<short>(b1));
+        const __m128i two = _mm_set1_epi16(2);
+        auto half = [&](int i) {
+            auto lanes = [](const std::int32_t *h, int i) {
+                __m128i lo = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i)), 4);
+                __m128i hi = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(h + i + 4)), 4);
+                return _mm_packs_epi32(lo, hi);
+            };
+            __m128i v = _mm_add_epi16(_mm_mulhi_epi16(lanes(h0, i), w0), _mm_mulhi_epi16(lanes(h1, i), w1));
+            return _mm_srai_epi16(_mm_add_epi16(v, two), 2);
+        };
+
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+            store(out + i, _mm_packus_epi16(half(i), half(i + 8)));
+        return i;
+    }
+#else
+    int median_row(const std::uint8_t *, const std::uint8_t *, const std::uint8_t *,
+                   std::uint8_t *, int from, int)
+    {
+        return from;
+    }
+
+    template <bool dilate>
+    int close_row(const std::uint8_t *, const std::uint8_t *, std::uint8_t *, int from, int)
+    {
+        return from;
+    }
+
+    int vertical_row(const std::int32_t *, const std::int32_t *, int, int, std::uint8_t *, int)
+    {
+        return 0;
+    }
+#endif
+}
+
+void FusedChain::prepare(const cv::Size& new_src, const cv::Size& new_dst)
+{
+    if (new_src == src && new_dst == dst)
+        return;
+    if (new_src.width <= 0 || new_src.height <= 0 || new_dst.width <= 0 || new_dst.height <= 0)
+        throw std::invalid_argument("FusedChain requires non-empty images.");
+
+    src = new_src;
+    dst = new_dst;
+    linear_coefficients(src.width, dst.width, true, x_ofs, alpha);
+    linear_coefficients(src.height, dst.height, false, y_ofs, beta);
+}
+
+cv::Rect FusedChain::source_area(const cv::Rect& area) const
+{
+    const int x0 = std::max(area.x - halo_before, 0);
+    const int x1 = std::min(area.br().x + halo_after, dst.width);
+    const int y0 = std::max(area.y - halo_before, 0);
+    const int y1 = std::min(area.br().y + halo_after, dst.height);
+
+    const int sx0 = x_ofs[x0], sx1 = std::min(x_ofs[x1 - 1] + 2, src.width);
+    const int sy0 = std::max(y_ofs[y0], 0), sy1 = std::clamp(y_ofs[y1 - 1] + 2, 1, src.height);
+    return cv::Rect(sx0, sy0, sx1 - sx0, sy1 - sy0);
+}
+
+const std::int32_t *FusedChain::horizontal(const cv::Mat& img, int sy, int x0, int x1)
+{
+    for (int k = 0; k != 2; ++k) {
+        if (h_tags[k] == sy)
+            return h_rows[k].data();
+    }
+
+    // the older row makes room, rows are asked for top to bottom
+    auto& row = h_rows[h_next];
+    h_tags[h_next] = sy;
+    h_next ^= 1;
+
+    row.resize(4 * (x1 - x0));
+    const std::uint8_t *s = img.ptr<std::uint8_t>(sy);
+    const int last = src.width - 1;
+    int x = x0;
+#ifdef __SSE2__
+    // both pixels interleaved per channel against the weight pair
+    const __m128i zero = _mm_setzero_si128();
+    for (; x != x1; ++x) {
+        const int o0 = 4 * x_ofs[x], o1 = 4 * std::min(x_ofs[x] + 1, last);
+        std::int32_t p0, p1;
+        std::memcpy(&p0, s + o0, 4);
+        std::memcpy(&p1, s + o1, 4);
+        __m128i p = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p0), _mm_cvtsi32_si128(p1)), zero);
+        __m128i w = _mm_set1_epi32(static_cast<std::uint16_t>(alpha[2 * x]) |
+                                   static_cast<std::uint32_t>(static_cast<std::uint16_t>(alpha[2 * x + 1])) << 16);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row.data() + 4 * (x - x0)), _mm_madd_epi16(p, w));
+    }
+#endif
+    for (; x != x1; ++x) {
+        const std::uint8_t *p0 = s + 4 * x_ofs[x];
+        const std::uint8_t *p1 = s + 4 * std::min(x_ofs[x] + 1, last);
+        const int a0 = alpha[2 * x], a1 = alpha[2 * x + 1];
+        std::int32_t *d = row.data() + 4 * (x - x0);
+        for (int c = 0; c != 4; ++c)
+            d[c] = p0[c] * a0 + p1[c] * a1;
+    }
+    return row.data();
+}
+
+void FusedChain::run(const cv::Mat& img, const cv::Rect& area, const row_callback& callback)
+{
+    if (img.cols != src.width || img.rows != src.height)
+        throw std::invalid_argument("FusedChain::run requires the source size given to prepare().");
+    if ((area & cv::Rect(0, 0, dst.width, dst.height)) != area || area.empty())
+        throw std::invalid_argument("FusedChain::run requires a non-empty area within the output.");
+
+    // resized pixels the area depends on; the edges of this range are
+    // treated as image borders, which is only wrong for pixels the area
+    // doesn't depend on
+    const int x0 = std::max(area.x - halo_before, 0);
+    const int x1 = std::min(area.br().x + halo_after, dst.width);
+    const int y0 = std::max(area.y - halo_before, 0);
+    const int y1 = std::min(area.br().y + halo_after, dst.height);
+    const int n = 4 * (x1 - x0);
+
+    for (auto& row : resized)
+        row.resize(n);
+    for (int k = 0; k != 2; ++k) {
+        median[k].resize(n);
+        dilated[k].resize(n);
+    }
+    closed.resize(n);
+    h_tags[0] = h_tags[1] = -1;
+
+    // vertical pass of cv::resize, which drops the low 4 bits of both rows
+    // and keeps the high half of the products before rounding
+    auto resize_row = [&](int y, std::uint8_t *out) {
+        const int sy = y_ofs[y];
+        const std::int32_t *h0 = horizontal(img, std::clamp(sy, 0, src.height - 1), x0, x1);
+        const std::int32_t *h1 = horizontal(img, std::clamp(sy + 1, 0, src.height - 1), x0, x1);
+        const int b0 = beta[2 * y], b1 = beta[2 * y + 1];
+
+        for (int i = vertical_row(h0, h1, b0, b1, out, n); i != n; ++i) {
+            int v = (((h0[i] >> 4) * b0) >> 16) + (((h1[i] >> 4) * b1) >> 16);
+            out[i] = static_cast<std::uint8_t>(std::clamp((v + 2) >> 2, 0, 255));
+        }
+    };
+
+    int next_resized = y0;
+    auto resized_row = [&](int y) -> const std::uint8_t * {
+        y = std::clamp(y, y0, y1 - 1);
+        while (next_resized <= y) {
+            resize_row(next_resized, resized[next_resized % 3].data());
+            ++next_resized;
+        }
+        return resized[y % 3].data();
+    };
+
+    for (int y = y0; y != y1; ++y) {
+        std::uint8_t *m = median[y & 1].data();
+        std::uint8_t *d = dilated[y & 1].data();
+        const std::uint8_t *m_prev = y > y0 ? median[~y & 1].data() : m;
+        const std::uint8_t *d_prev = y > y0 ? dilated[~y & 1].data() : d;
+
+        // 3x3 median, borders replicated
+        const std::uint8_t *r1 = resized_row(y + 1);
+        const std::uint8_t *r0 = resized_row(y - 1);
+        const std::uint8_t *r = resized_row(y);
+        auto median_at = [&](int i) {
+            const int l = i >= 4 ? i - 4 : i;
+            const int h = i < n - 4 ? i + 4 : i;
+            m[i] = median9(r0[l], r[l], r1[l], r0[i], r[i], r1[i], r0[h], r[h], r1[h]);
+        };
+        const int edge = std::min(4, n);
+        for (int i = 0; i != edge; ++i)
+            median_at(i);
+        for (int i = median_row(r0, r, r1, m, 4, n); i < n - 4; ++i) {
+            m[i] = median9(r0[i - 4], r[i - 4], r1[i - 4], r0[i], r[i], r1[i],
+                           r0[i + 4], r[i + 4], r1[i + 4]);
+        }
+        for (int i = std::max(n - 4, edge); i < n; ++i)
+            median_at(i);
+
+        // closing by a 2x2 rect anchored at its bottom right, i.e. max and
+        // then min over the pixel, its left, upper and upper left
+        // neighbours; neighbours outside the image are ignored
+        for (int i = 0; i != edge; ++i)
+            d[i] = std::max(m[i], m_prev[i]);
+        for (int i = close_row<true>(m, m_prev, d, 4, n); i < n; ++i)
+            d[i] = std::max(std::max(m[i], m[i - 4]), std::max(m_prev[i], m_prev[i - 4]));
+        if (y < area.y)
+            continue;
+        if (y >= area.br().y)
+            break;
+        for (int i = 0; i != edge; ++i)
+            closed[i] = std::min(d[i], d_prev[i]);
+        for (int i = close_row<false>(d, d_prev, closed.data(), 4, n); i < n; ++i)
+            closed[i] = std::min(std::min(d[i], d[i - 4]), std::min(d_prev[i], d_prev[i - 4]));
+        callback(y, closed.data() + 4 * (area.x - x0));
+    }
+}
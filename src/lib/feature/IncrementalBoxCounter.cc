@@ -0,0 +1,39 @@
+#include "IncrementalBoxCounter.h"
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+double incremental_stats::reuse_ratio() const noexcept
+{
+    double reused_boxes = reused.load(std::memory_order_relaxed);
+    double boxes = reused_boxes + recomputed.load(std::memory_order_relaxed);
+    return boxes ? reused_boxes / boxes : 0.0;
+}
+
+void IncrementalBoxCounter::prepare(const cv::Mat& roi,
+                                    const grid_geometry& new_geometry,
+                                    const feature_thresholds& settings)
+{
+    if (primed && roi.size() == roi_size && new_geometry == geometry && settings == thresholds)
+        return;
+
+    geometry = new_geometry;
+    roi_size = roi.size();
+    thresholds = settings;
+    primed = false;
+
+    chain.prepare(roi_size, cv::Size(geometry.roi_w, geometry.roi_h));
+
+    // the source rows and columns of a box don't depend on the other axis
+    tile_cols.clear();
+    for (int bx = 0; bx != geometry.cols(); ++bx) {
+        auto area = chain.source_area(cv::Rect(bx * geometry.box_w, 0, geometry.box_w, 1));
+        tile_cols.emplace_back(area.x, area.br().x);
+    }
+    tile_rows.clear();
+    for (int by = 0; by != geometry.rows(); ++by) {
+        auto area = chain.source_area(cv::Rect(0, by * geometry.box_h, 1, geometry.box_h));
+        tile_rows.emplace_back(area.y, area.br().y);
+    }
+
+    counts.assign(geometry.size(), 0);
+}
@@ -0,0 +1,346 @@
+#include "MaskKernels.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ML_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+    // bounds of a range as one BGRA pixel, alpha always passes
+    std::uint32_t lower_word(const color_range& range) noexcept
+    {
+        return range.min[0] | range.min[1] << 8 | range.min[2] << 16;
+    }
+
+    std::uint32_t upper_word(const color_range& range) noexcept
+    {
+        return range.max[0] | range.max[1] << 8 | range.max[2] << 16 | 0xffu << 24;
+    }
+
+    void range_mask_scalar(const std::uint8_t *bgra, std::size_t n,
+                           const color_range& a, const color_range& b,
+                           std::uint8_t *mask)
+    {
+        for (std::size_t i = 0; i != n; ++i, bgra += 4) {
+            bool in = a.contains(bgra[0], bgra[1], bgra[2]) ||
+                      b.contains(bgra[0], bgra[1], bgra[2]);
+            mask[i] = in ? 255 : 0;
+        }
+    }
+
+    void pack_bits_scalar(const std::uint8_t *src, std::size_t n, std::uint64_t *bits)
+    {
+        std::fill(bits, bits + (n + 63) / 64, 0);
+        for (std::size_t i = 0; i != n; ++i) {
+            if (src[i])
+                bits[i / 64] |= std::uint64_t(1) << (i % 64);
+        }
+    }
+
+    // bits [from, n) only, whole words before it are already written
+    void pack_bits_tail(const std::uint8_t *src, std::size_t from, std::size_t n, std::uint64_t *bits)
+    {
+        if (from == n)
+            return;
+        bits[from / 64] = 0;
+        for (std::size_t i = from; i != n; ++i) {
+            if (src[i])
+                bits[i / 64] |= std::uint64_t(1) << (i % 64);
+        }
+    }
+
+#ifdef ML_X86_KERNELS
+    // 0xffffffff for every pixel whose B, G, R are within [lo, hi]
+    __attribute__((target("sse4.2")))
+    inline __m128i in_range_sse42(__m128i px, __m128i lo, __m128i hi)
+    {
+        __m128i ok = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(px, lo), px),
+                                   _mm_cmpeq_epi8(_mm_min_epu8(px, hi), px));
+        return _mm_cmpeq_epi32(ok, _mm_set1_epi32(-1));
+    }
+
+    __attribute__((target("sse4.2")))
+    void range_mask_sse42(const std::uint8_t *bgra, std::size_t n,
+                          const color_range& a, const color_range& b,
+                          std::uint8_t *mask)
+    {
+        const __m128i lo_a = _mm_set1_epi32(lower_word(a)), hi_a = _mm_set1_epi32(upper_word(a));
+        const __m128i lo_b = _mm_set1_epi32(lower_word(b)), hi_b = _mm_set1_epi32(upper_word(b));
+
+        std::size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i r[4];
+            for (int k = 0; k != 4; ++k) {
+                __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bgra + 4 * (i + 4 * k)));
+                r[k] = _mm_or_si128(in_range_sse42(px, lo_a, hi_a), in_range_sse42(px, lo_b, hi_b));
+            }
+            // signed saturation keeps -1 as -1, down to one byte per pixel
+            __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(r[0], r[1]), _mm_packs_epi32(r[2], r[3]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(mask + i), bytes);
+        }
+        range_mask_scalar(bgra + 4 * i, n - i, a, b, mask + i);
+    }
+
+    __attribute__((target("sse4.2")))
+    void pack_bits_sse42(const std::uint8_t *src, std::size_t n, std::uint64_t *bits)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        std::size_t i = 0;
+        for (; i + 64 <= n; i += 64) {
+            std::uint64_t word = 0;
+            for (int k = 0; k != 4; ++k) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16 * k));
+                std::uint64_t m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xffff;
+                word |= m << (16 * k);
+            }
+            bits[i / 64] = word;
+        }
+        pack_bits_tail(src, i, n, bits);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i in_range_avx2(__m256i px, __m256i lo, __m256i hi)
+    {
+        __m256i ok = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(px, lo), px),
+                                      _mm256_cmpeq_epi8(_mm256_min_epu8(px, hi), px));
+        return _mm256_cmpeq_epi32(ok, _mm256_set1_epi32(-1));
+    }
+
+    __attribute__((target("avx2")))
+    void range_mask_avx2(const std::uint8_t *bgra, std::size_t n,
+                         const color_range& a, const color_range& b,
+                         std::uint8_t *mask)
+    {
+        const __m256i lo_a = _mm256_set1_epi32(lower_word(a)), hi_a = _mm256_set1_epi32(upper_word(a));
+        const __m256i lo_b = _mm256_set1_epi32(lower_word(b)), hi_b = _mm256_set1_epi32(upper_word(b));
+        // packs work within 128-bit lanes, this puts the 4-pixel groups back in order
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+        std::size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i r[4];
+            for (int k = 0; k != 4; ++k) {
+                __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bgra + 4 * (i + 8 * k)));
+                r[k] = _mm256_or_si256(in_range_avx2(px, lo_a, hi_a), in_range_avx2(px, lo_b, hi_b));
+            }
+            __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(r[0], r[1]), _mm256_packs_epi32(r[2], r[3]));
+            bytes = _mm256_permutevar8x32_epi32(bytes, order);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(mask + i), bytes);
+        }
+        range_mask_scalar(bgra + 4 * i, n - i, a, b, mask + i);
+    }
+
+    __attribute__((target("avx2")))
+    void pack_bits_avx2(const std::uint8_t *src, std::size_t n, std::uint64_t *bits)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        std::size_t i = 0;
+        for (; i + 64 <= n; i += 64) {
+            __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+            std::uint64_t m0 = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero)));
+            std::uint64_t m1 = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, zero)));
+            bits[i / 64] = (m0 & 0xffffffff) | m1 << 32;
+        }
+        pack_bits_tail(src, i, n, bits);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    inline std::uint64_t in_range_avx512(__m512i px, __m512i lo, __m512i hi)
+    {
+        __mmask64 ok = _mm512_cmpge_epu8_mask(px, lo) & _mm512_cmple_epu8_mask(px, hi);
+        return _mm512_cmpeq_epi32_mask(_mm512_movm_epi8(ok), _mm512_set1_epi32(-1));
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    void range_mask_avx512(const std::uint8_t *bgra, std::size_t n,
+                           const color_range& a, const color_range& b,
+                           std::uint8_t *mask)
+    {
+        const __m512i lo_a = _mm512_set1_epi32(lower_word(a)), hi_a = _mm512_set1_epi32(upper_word(a));
+        const __m512i lo_b = _mm512_set1_epi32(lower_word(b)), hi_b = _mm512_set1_epi32(upper_word(b));
+
+        std::size_t i = 0;
+        for (; i + 64 <= n; i += 64) {
+            std::uint64_t pixels = 0;
+            for (int k = 0; k != 4; ++k) {
+                __m512i px = _mm512_loadu_si512(bgra + 4 * (i + 16 * k));
+                pixels |= (in_range_avx512(px, lo_a, hi_a) | in_range_avx512(px, lo_b, hi_b)) << (16 * k);
+            }
+            _mm512_storeu_si512(mask + i, _mm512_movm_epi8(pixels));
+        }
+        range_mask_scalar(bgra + 4 * i, n - i, a, b, mask + i);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    void pack_bits_avx512(const std::uint8_t *src, std::size_t n, std::uint64_t *bits)
+    {
+        std::size_t i = 0;
+        for (; i + 64 <= n; i += 64) {
+            __m512i v = _mm512_loadu_si512(src + i);
+            bits[i / 64] = _mm512_test_epi8_mask(v, v);
+        }
+        pack_bits_tail(src, i, n, bits);
+    }
+#endif
+
+    const mask_kernels scalar_kernels{ simd_level::SCALAR, range_mask_scalar, pack_bits_scalar };
+#ifdef ML_X86_KERNELS
+    const mask_kernels sse42_kernels{ simd_level::SSE42, range_mask_sse42, pack_bits_sse42 };
+    const mask_kernels avx2_kernels{ simd_level::AVX2, range_mask_avx2, pack_bits_avx2 };
+    const mask_kernels avx512_kernels{ simd_level::AVX512, range_mask_avx512, pack_bits_avx512 };
+#endif
+
+    // number of set bits of bits [from, to)
+    int count_bits(const std::uint64_t *bits, std::size_t from, std::size_t to) noexcept
+    {
+        int n = 0;
+        while (from != to) {
+            std::size_t end = std::min(to, (from / 64 + 1) * 64);
+            std::uint64_t word = bits[from / 64] >> (from % 64);
+            if (end - from != 64)
+                word &= (std::uint64_t(1) << (end - from)) - 1;
+            n += __builtin_popcountll(word);
+            from = end;
+        }
+        return n;
+    }
+}
+
+simd_level best_simd_level() noexcept
+{
+    static const simd_level level = [] {
+#ifdef ML_X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+            return simd_level::AVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return simd_level::AVX2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return simd_level::SSE42;
+#endif
+        return simd_level::SCALAR;
+    }();
+    return level;
+}
+
+const mask_kernels& get_mask_kernels(simd_level level)
+{
+    if (level > best_simd_level())
+        throw std::invalid_argument("mask kernels of given simd_level aren't supported by this CPU.");
+
+    switch (level) {
+#ifdef ML_X86_KERNELS
+    case simd_level::AVX512:
+        return avx512_kernels;
+    case simd_level::AVX2:
+        return avx2_kernels;
+    case simd_level::SSE42:
+        return sse42_kernels;
+#endif
+    default:
+        return scalar_kernels;
+    }
+}
+
+const mask_kernels& get_mask_kernels() noexcept
+{
+    static const mask_kernels& best = get_mask_kernels(best_simd_level());
+    return best;
+}
+
+void range_mask(const cv::Mat& bgra, const color_range& a, const color_range& b, cv::Mat& mask)
+{
+    if (bgra.type() != CV_8UC4)
+        throw std::invalid_argument("range_mask requires an 8-bit BGRA image.");
+
+    const auto& kernels = get_mask_kernels();
+    mask.create(bgra.size(), CV_8UC1);
+    for (int y = 0; y != bgra.rows; ++y)
+        kernels.range_mask(bgra.ptr<std::uint8_t>(y), bgra.cols, a, b, mask.ptr<std::uint8_t>(y));
+}
+
+void count_boxes(const cv::Mat& mask, int box_w, int box_h, float *counts)
+{
+    if (mask.type() != CV_8UC1 || mask.cols % box_w || mask.rows % box_h)
+        throw std::invalid_argument("count_boxes requires an 8-bit mask divisible into boxes.");
+
+    const auto& kernels = get_mask_kernels();
+    const int boxes_x = mask.cols / box_w;
+    const int boxes_y = mask.rows / box_h;
+
+    // one bit per pixel of the current row
+    thread_local std::vector<std::uint64_t> bits;
+    bits.resize((mask.cols + 63) / 64);
+
+    for (int y = 0; y != mask.rows; ++y) {
+        kernels.pack_bits(mask.ptr<std::uint8_t>(y), mask.cols, bits.data());
+        int by = y / box_h;
+        for (int bx = 0; bx != boxes_x; ++bx)
+            counts[bx * boxes_y + by] += count_bits(bits.data(), bx * box_w, (bx + 1) * box_w);
+    }
+}
+
+std::vector<simd_level> check_mask_kernels()
+{
+    std::mt19937 gen(12345);
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    // values near the bounds are the interesting ones
+    auto near = [&](int bound) {
+        return std::clamp(bound + byte(gen) % 5 - 2, 0, 255);
+    };
+    auto make_range = [&] {
+        color_range range;
+        for (int c = 0; c != 3; ++c) {
+            int lo = byte(gen), hi = byte(gen);
+            range.min[c] = std::min(lo, hi);
+            range.max[c] = byte(gen) % 8 ? std::max(lo, hi) : std::min(lo, hi);
+        }
+        return range;
+    };
+
+    std::vector<simd_level> failed;
+    const auto& reference = get_mask_kernels(simd_level::SCALAR);
+
+    for (auto level : { simd_level::SSE42, simd_level::AVX2, simd_level::AVX512 }) {
+        if (level > best_simd_level())
+            break;
+        const auto& kernels = get_mask_kernels(level);
+        bool ok = true;
+
+        for (std::size_t n = 0; n != 300 && ok; ++n) {
+            color_range a = make_range(), b = make_range();
+            std::vector<std::uint8_t> bgra(4 * n), expected(n), actual(n);
+            for (std::size_t i = 0; i != n; ++i) {
+                const color_range& r = i % 2 ? a : b;
+                for (int c = 0; c != 3; ++c)
+                    bgra[4 * i + c] = near(byte(gen) % 2 ? r.min[c] : r.max[c]);
+                bgra[4 * i + 3] = byte(gen);
+            }
+
+            reference.range_mask(bgra.data(), n, a, b, expected.data());
+            kernels.range_mask(bgra.data(), n, a, b, actual.data());
+            ok = expected == actual;
+
+            // garbage in the output, pack_bits has to overwrite every word
+            std::size_t words = (bgra.size() + 63) / 64;
+            std::vector<std::uint64_t> expected_bits(words), actual_bits(words, ~std::uint64_t(0));
+            for (auto& v : bgra)
+                v = byte(gen) % 3 ? 0 : byte(gen);
+            reference.pack_bits(bgra.data(), bgra.size(), expected_bits.data());
+            kernels.pack_bits(bgra.data(), bgra.size(), actual_bits.data());
+            ok = ok && expected_bits == actual_bits;
+        }
+        if (!ok)
+            failed.push_back(level);
+    }
+    return failed;
+}
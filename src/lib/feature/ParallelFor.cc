@@ -0,0 +1,192 @@
+#include "ParallelFor.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+    // indices [begin, end) not started yet, the owner takes them from the
+    // front and thieves from the back
+    struct alignas(64) index_range {
+        std::mutex m;
+        std::size_t begin = 0;
+        std::size_t end = 0;
+    };
+
+    bool pop(index_range& range, std::size_t& i)
+    {
+        std::lock_guard<std::mutex> lck{range.m};
+        if (range.begin == range.end)
+            return false;
+        i = range.begin++;
+        return true;
+    }
+
+    bool steal(std::vector<index_range>& ranges, std::size_t self)
+    {
+        for (std::size_t k = 1; k != ranges.size(); ++k) {
+            auto& victim = ranges[(self + k) % ranges.size()];
+            std::size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lck{victim.m};
+                if (victim.begin == victim.end)
+                    continue;
+                end = victim.end;
+                begin = victim.begin + (victim.end - victim.begin) / 2;
+                victim.end = begin;
+            }
+            // the stolen indices are out of every range until here, but
+            // nobody else is waiting for them
+            std::lock_guard<std::mutex> lck{ranges[self].m};
+            ranges[self].begin = begin;
+            ranges[self].end = end;
+            return true;
+        }
+        return false;
+    }
+
+    std::size_t thread_count(std::size_t threads)
+    {
+        return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+// the indices of one parallel_for() or ParallelWorkers::run() split over
+// threads, each of them calls work() with its own number
+struct parallel_job {
+    parallel_job(std::size_t n, std::size_t threads, const std::function<void(std::size_t)>& body)
+        : ranges(threads), body(body), failed(false)
+    {
+        for (std::size_t t = 0; t != threads; ++t) {
+            ranges[t].begin = n * t / threads;
+            ranges[t].end = n * (t + 1) / threads;
+        }
+    }
+
+    void work(std::size_t self)
+    {
+        while (!failed.load(std::memory_order_acquire)) {
+            std::size_t i;
+            if (!pop(ranges[self], i)) {
+                if (!steal(ranges, self))
+                    break;
+                continue;
+            }
+            try {
+                body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lck{error_m};
+                if (!error)
+                    error = std::current_exception();
+                failed.store(true, std::memory_order_release);
+            }
+        }
+    }
+
+    void rethrow()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    std::vector<index_range> ranges;
+    const std::function<void(std::size_t)>& body;
+    std::atomic_bool failed;
+    std::exception_ptr error;
+    std::mutex error_m;
+};
+
+void parallel_for(std::size_t n, std::size_t threads, const std::function<void(std::size_t)>& body)
+{
+    threads = std::min(thread_count(threads), n);
+    if (threads == 0)
+        return;
+
+    parallel_job job(n, threads, body);
+    std::vector<std::thread> helpers;
+    for (std::size_t t = 1; t != threads; ++t)
+        helpers.emplace_back([&job, t] { job.work(t); });
+    job.work(0);
+    for (auto& helper : helpers)
+        helper.join();
+
+    job.rethrow();
+}
+
+ParallelWorkers::ParallelWorkers(std::size_t threads, std::function<void()> init)
+    : job(nullptr),
+      generation(0),
+      pending(0),
+      stop(false)
+{
+    threads = thread_count(threads);
+    for (std::size_t t = 0; t != threads; ++t)
+        workers.emplace_back([this, t, init] { work(t, init); });
+}
+
+ParallelWorkers::~ParallelWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        stop = true;
+    }
+    start_cv.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+}
+
+void ParallelWorkers::run(std::size_t n, const std::function<void(std::size_t)>& body)
+{
+    if (n == 0)
+        return;
+
+    std::lock_guard<std::mutex> run_lck{run_m};
+    parallel_job current(n, std::min(workers.size(), n), body);
+    {
+        std::lock_guard<std::mutex> lck{m};
+        job = &current;
+        pending = workers.size();
+        ++generation;
+    }
+    start_cv.notify_all();
+    {
+        std::unique_lock<std::mutex> lck{m};
+        done_cv.wait(lck, [&] { return pending == 0; });
+        job = nullptr;
+    }
+    current.rethrow();
+}
+
+std::size_t ParallelWorkers::size() const noexcept
+{
+    return workers.size();
+}
+
+void ParallelWorkers::work(std::size_t self, const std::function<void()>& init)
+{
+    if (init)
+        init();
+
+    std::size_t seen = 0;
+    while (true) {
+        parallel_job *current;
+        {
+            std::unique_lock<std::mutex> lck{m};
+            start_cv.wait(lck, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+            current = job;
+        }
+        // a run of fewer indices than threads leaves the rest idle
+        if (self < current->ranges.size())
+            current->work(self);
+
+        std::lock_guard<std::mutex> lck{m};
+        if (--pending == 0)
+            done_cv.notify_one();
+    }
+}
@@ -0,0 +1,76 @@
+#include "PreviewVisualizer.h"
+#include <opencv2/opencv.hpp>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+PreviewVisualizer::PreviewVisualizer()
+    : dropped_count(0), stop(false)
+{
+    local_thread = std::thread([this] { run(); });
+}
+
+PreviewVisualizer::~PreviewVisualizer()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        stop.store(true, std::memory_order_release);
+    }
+    cv.notify_one();
+    if (local_thread.joinable())
+        local_thread.join();
+}
+
+void PreviewVisualizer::post(const std::string& window, const cv::Mat& img)
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        auto& box = windows[window];
+
+        // copyTo reuses the mailbox buffer once it has the right size
+        img.copyTo(box.pending);
+        if (box.fresh)
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+        box.fresh = true;
+        posted = true;
+    }
+    cv.notify_one();
+}
+
+std::size_t PreviewVisualizer::dropped() const noexcept
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
+
+void PreviewVisualizer::run()
+{
+    using namespace std::chrono_literals;
+    std::vector<std::pair<std::string, cv::Mat>> to_show;
+
+    while (!stop.load(std::memory_order_acquire)) {
+        to_show.clear();
+        {
+            std::unique_lock<std::mutex> lck{m};
+            // a post wakes this up at once, otherwise wake up periodically
+            // anyway so the windows stay responsive
+            cv.wait_for(lck, 30ms, [&] { return posted || stop.load(std::memory_order_acquire); });
+            posted = false;
+
+            for (auto& [name, box] : windows) {
+                if (box.fresh) {
+                    cv::swap(box.pending, box.shown);
+                    box.fresh = false;
+                    to_show.emplace_back(name, box.shown);
+                }
+            }
+        }
+
+        // HighGUI calls happen outside the lock, only this thread touches shown
+        for (auto& [name, img] : to_show)
+            cv::imshow(name, img);
+        cv::waitKey(1);
+    }
+    cv::destroyAllWindows();
+}
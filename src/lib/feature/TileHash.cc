@@ -0,0 +1,92 @@
+#include "TileHash.h"
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+namespace {
+    constexpr std::uint64_t hash_seed = 0xcbf29ce484222325ULL;
+    constexpr std::uint64_t hash_prime = 0x100000001b3ULL;
+
+    inline std::uint64_t mix(std::uint64_t h, std::uint64_t word)
+    {
+        h ^= word;
+        h *= hash_prime;
+        return h ^ (h >> 29);
+    }
+
+    // hash a row segment 8 bytes at a time, the tail is zero padded
+    inline std::uint64_t hash_bytes(std::uint64_t h, const std::uint8_t *p, std::size_t n)
+    {
+        std::uint64_t word;
+        for (; n >= sizeof(word); n -= sizeof(word), p += sizeof(word)) {
+            std::memcpy(&word, p, sizeof(word));
+            h = mix(h, word);
+        }
+        if (n) {
+            word = 0;
+            std::memcpy(&word, p, n);
+            h = mix(h, word);
+        }
+        return h;
+    }
+}
+
+void hash_tiles(const cv::Mat& img,
+                const std::vector<int>& col_edges,
+                const std::vector<int>& row_edges,
+                std::vector<std::uint64_t>& hashes)
+{
+    const std::size_t n_cols = col_edges.size() - 1;
+    const std::size_t n_rows = row_edges.size() - 1;
+    const std::size_t pixel_size = img.elemSize();
+
+    hashes.assign(n_cols * n_rows, hash_seed);
+
+    // walk the image row by row so every source row is read only once
+    for (std::size_t j = 0; j != n_rows; ++j) {
+        for (int y = row_edges[j]; y != row_edges[j + 1]; ++y) {
+            const std::uint8_t *row = img.ptr<std::uint8_t>(y);
+            for (std::size_t i = 0; i != n_cols; ++i) {
+                auto& h = hashes[i * n_rows + j];
+                h = hash_bytes(h,
+                               row + col_edges[i] * pixel_size,
+                               (col_edges[i + 1] - col_edges[i]) * pixel_size);
+            }
+        }
+    }
+}
+
+void hash_tiles(const cv::Mat& img,
+                const std::vector<cv::Range>& cols,
+                const std::vector<cv::Range>& rows,
+                std::vector<std::uint64_t>& hashes)
+{
+    const std::size_t n_cols = cols.size();
+    const std::size_t n_rows = rows.size();
+    const std::size_t pixel_size = img.elemSize();
+
+    hashes.assign(n_cols * n_rows, hash_seed);
+
+    for (std::size_t j = 0; j != n_rows; ++j) {
+        for (int y = rows[j].start; y != rows[j].end; ++y) {
+            const std::uint8_t *row = img.ptr<std::uint8_t>(y);
+            for (std::size_t i = 0; i != n_cols; ++i) {
+                auto& h = hashes[i * n_rows + j];
+                h = hash_bytes(h,
+                               row + cols[i].start * pixel_size,
+                               (cols[i].end - cols[i].start) * pixel_size);
+            }
+        }
+    }
+}
+
+std::vector<int> uniform_tile_edges(int length, int tile)
+{
+    std::vector<int> edges;
+    for (int edge = 0; edge < length; edge += tile)
+        edges.push_back(edge);
+    edges.push_back(length);
+    return edges;
+}
@@ -0,0 +1,130 @@
+#include "mlchange.h"
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <opencv2/opencv.hpp> // must include opencv before X11 lib
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+#include "mldisplay.h"
+#include "feature/TileHash.h"
+
+/**
+ * damage_tracker owns the damage object watching the root window.
+ */
+struct damage_tracker {
+	damage_tracker(Display *dpy, Window window, int event_base)
+		: dpy(dpy),
+		  damage(XDamageCreate(dpy, window, XDamageReportBoundingBox)),
+		  event_base(event_base)
+	{}
+
+	~damage_tracker()
+	{
+		XDamageDestroy(dpy, damage);
+		XFlush(dpy);
+	}
+
+	Display *dpy;
+	Damage damage;
+	int event_base;
+};
+
+MlChangeDetector::MlChangeDetector(MlDisplay& display, const cv::Rect& area, change_mode mode)
+	: display(display), area(area), mode(mode), primed(false), dirty(false), carry(false)
+{
+	auto dpy = display.display_ptr.get();
+	int event_base, error_base;
+
+	if (mode == change_mode::DAMAGE) {
+		if (XDamageQueryExtension(dpy, &event_base, &error_base)) {
+			damage = std::make_unique<damage_tracker>(dpy, display.window, event_base);
+		} else {
+			std::cerr << "DAMAGE is not available, fall back to tile hashing." << std::endl;
+			this->mode = change_mode::TILE_HASH;
+		}
+	}
+}
+
+MlChangeDetector::~MlChangeDetector() = default;
+
+void MlChangeDetector::set_area(const cv::Rect& new_area)
+{
+	area = new_area;
+	primed = false;
+	dirty = carry = false;
+}
+
+void MlChangeDetector::before_capture()
+{
+	if (mode != change_mode::DAMAGE)
+		return;
+
+	// damage up to here is in the frame about to be captured
+	dirty = drain_damage() || dirty;
+}
+
+bool MlChangeDetector::changed(const cv::Mat& frame)
+{
+	bool result = mode == change_mode::DAMAGE ? damage_changed() : tile_hash_changed(frame);
+
+	// nothing to compare the first frame with
+	if (!primed) {
+		primed = true;
+		return true;
+	}
+	return result;
+}
+
+change_mode MlChangeDetector::get_mode() const noexcept
+{
+	return mode;
+}
+
+bool MlChangeDetector::damage_changed()
+{
+	// damage drained after the capture may have hit the screen while it
+	// was being grabbed, so it's in this frame, or after it, so it's in
+	// the next one: it counts for both
+	bool late = drain_damage();
+	bool result = dirty || late || carry;
+	dirty = false;
+	carry = late;
+	return result;
+}
+
+bool MlChangeDetector::drain_damage()
+{
+	auto dpy = damage->dpy;
+	XEvent xevent;
+	bool result = false;
+
+	// make sure every damage reported so far has arrived
+	XSync(dpy, False);
+	while (XCheckTypedEvent(dpy, damage->event_base + XDamageNotify, &xevent)) {
+		auto& notify = *reinterpret_cast<XDamageNotifyEvent*>(&xevent);
+		cv::Rect damaged(notify.area.x, notify.area.y, notify.area.width, notify.area.height);
+
+		if ((damaged & area).area() > 0)
+			result = true;
+	}
+	// acknowledge what has been seen so far, the server reports new damage
+	// with new events
+	XDamageSubtract(dpy, damage->damage, None, None);
+
+	return result;
+}
+
+bool MlChangeDetector::tile_hash_changed(const cv::Mat& frame)
+{
+	if (col_edges.empty() || col_edges.back() != frame.cols || row_edges.back() != frame.rows) {
+		col_edges = uniform_tile_edges(frame.cols, tile_size);
+		row_edges = uniform_tile_edges(frame.rows, tile_size);
+		prev_hashes.clear();
+	}
+
+	hash_tiles(frame, col_edges, row_edges, hashes);
+	bool result = hashes != prev_hashes;
+	hashes.swap(prev_hashes);
+
+	return result;
+}
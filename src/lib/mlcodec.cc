@@ -0,0 +1,173 @@
+#include "mlcodec.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+    char* put_varint(char* out, std::uint64_t v) noexcept
+    {
+        while (v >= 0x80) {
+            *out++ = static_cast<char>(v | 0x80);
+            v >>= 7;
+        }
+        *out++ = static_cast<char>(v);
+        return out;
+    }
+
+    const char* get_varint(const char* p, const char* end, std::uint64_t& v)
+    {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p == end)
+                throw std::runtime_error("encoded record is cut short.");
+            auto byte = static_cast<std::uint8_t>(*p++);
+            v |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return p;
+        }
+        throw std::runtime_error("encoded record has an overlong varint.");
+    }
+
+    std::uint64_t zigzag(std::int64_t v) noexcept
+    {
+        return (static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63);
+    }
+
+    std::int64_t unzigzag(std::uint64_t v) noexcept
+    {
+        return static_cast<std::int64_t>(v >> 1) ^ -static_cast<std::int64_t>(v & 1);
+    }
+
+    std::uint16_t zigzag16(std::uint16_t delta) noexcept
+    {
+        auto d = static_cast<std::int16_t>(delta);
+        return static_cast<std::uint16_t>((delta << 1) ^ (d >> 15));
+    }
+
+    std::uint16_t unzigzag16(std::uint16_t v) noexcept
+    {
+        return static_cast<std::uint16_t>((v >> 1) ^ -(v & 1));
+    }
+
+    std::uint16_t quantize(float v) noexcept
+    {
+        if (!(v > 0.0f))
+            return 0;
+        if (v >= 65535.0f)
+            return 65535;
+        return static_cast<std::uint16_t>(std::lrint(v));
+    }
+
+    // prev += delta, features = prev; 8 features a step with SSE2
+    void apply_deltas(std::uint16_t* prev, const std::uint16_t* delta, float* features, std::size_t n) noexcept
+    {
+        std::size_t i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= n; i += 8) {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(delta + i));
+            p = _mm_add_epi16(p, d);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(prev + i), p);
+            _mm_storeu_ps(features + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(p, zero)));
+            _mm_storeu_ps(features + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(p, zero)));
+        }
+#endif
+        for (; i != n; ++i) {
+            prev[i] = static_cast<std::uint16_t>(prev[i] + delta[i]);
+            features[i] = prev[i];
+        }
+    }
+}
+
+FeatureEncoder::FeatureEncoder(std::size_t features)
+    : prev(features)
+{
+    reset();
+}
+
+void FeatureEncoder::reset()
+{
+    std::fill(prev.begin(), prev.end(), 0);
+    prev_timestamp = 0;
+    prev_label = 0;
+}
+
+std::size_t FeatureEncoder::encode(const float* features, int label, std::int64_t timestamp, char* out)
+{
+    char* p = out;
+    p = put_varint(p, zigzag(timestamp - prev_timestamp));
+    p = put_varint(p, zigzag(static_cast<std::int64_t>(label) - prev_label));
+    prev_timestamp = timestamp;
+    prev_label = label;
+
+    std::size_t n = prev.size();
+    std::size_t i = 0;
+    while (i != n) {
+        std::size_t run = i;
+        std::uint16_t q = 0;
+        for (; i != n; ++i) {
+            q = quantize(features[i]);
+            if (q != prev[i])
+                break;
+        }
+        p = put_varint(p, i - run);
+        if (i == n)
+            break;
+        p = put_varint(p, zigzag16(static_cast<std::uint16_t>(q - prev[i])));
+        prev[i++] = q;
+    }
+
+    return static_cast<std::size_t>(p - out);
+}
+
+std::size_t FeatureEncoder::max_record_size(std::size_t features) noexcept
+{
+    // timestamp and label, a run and a 3 byte delta per feature, a last run
+    return 10 + 10 + 4 * features + 10;
+}
+
+FeatureDecoder::FeatureDecoder(std::size_t features)
+    : prev(features), delta(features)
+{
+    reset();
+}
+
+void FeatureDecoder::reset()
+{
+    std::fill(prev.begin(), prev.end(), 0);
+    prev_timestamp = 0;
+    prev_label = 0;
+}
+
+const char* FeatureDecoder::decode(const char* p, const char* end, float* features, int& label, std::int64_t& timestamp)
+{
+    std::uint64_t v;
+    p = get_varint(p, end, v);
+    timestamp = prev_timestamp += unzigzag(v);
+    p = get_varint(p, end, v);
+    label = prev_label += static_cast<int>(unzigzag(v));
+
+    // runs of unchanged features stay 0, the changes are summed up below
+    std::size_t n = prev.size();
+    std::fill(delta.begin(), delta.end(), 0);
+    for (std::size_t i = 0; i != n; ) {
+        p = get_varint(p, end, v);
+        if (v > n - i)
+            throw std::runtime_error("encoded record has a run past its features.");
+        i += v;
+        if (i == n)
+            break;
+        p = get_varint(p, end, v);
+        delta[i++] = unzigzag16(static_cast<std::uint16_t>(v));
+    }
+    apply_deltas(prev.data(), delta.data(), features, n);
+
+    return p;
+}
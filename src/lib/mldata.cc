@@ -0,0 +1,227 @@
+#include "mldata.h"
+#include "feature/ParallelFor.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    // chunks are about this large, but at least a few per thread
+    constexpr std::size_t chunk_bytes = 1 << 22;
+
+    class mapped_file {
+    public:
+        explicit mapped_file(const std::string& path)
+            : data(nullptr), length(0)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                throw std::runtime_error("can't open " + path + ": " + std::strerror(errno));
+
+            struct stat st;
+            if (::fstat(fd, &st) == -1) {
+                ::close(fd);
+                throw std::runtime_error("can't stat " + path + ": " + std::strerror(errno));
+            }
+            length = static_cast<std::size_t>(st.st_size);
+            if (length) {
+                void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p == MAP_FAILED) {
+                    ::close(fd);
+                    throw std::runtime_error("can't map " + path + ": " + std::strerror(errno));
+                }
+                data = static_cast<const char*>(p);
+                ::madvise(p, length, MADV_WILLNEED);
+            }
+            // the mapping stays valid without the descriptor
+            ::close(fd);
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file()
+        {
+            if (data)
+                ::munmap(const_cast<char*>(data), length);
+        }
+
+        const char* begin() const noexcept { return data; }
+        const char* end() const noexcept { return data + length; }
+        std::size_t size() const noexcept { return length; }
+
+    private:
+        const char* data;
+        std::size_t length;
+    };
+
+    struct chunk {
+        const char* begin;
+        const char* end;
+        std::size_t first_row;
+        std::size_t rows;
+    };
+
+    // end of the line starting at p, without '\r'
+    const char* line_end(const char* p, const char* end, const char*& next) noexcept
+    {
+        auto nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        next = nl ? nl + 1 : end;
+        const char* e = nl ? nl : end;
+        if (e != p && e[-1] == '\r')
+            --e;
+        return e;
+    }
+
+    const char* skip_blank(const char* p, const char* e) noexcept
+    {
+        while (p != e && (*p == ' ' || *p == '\t'))
+            ++p;
+        return p;
+    }
+
+    bool blank(const char* p, const char* e) noexcept
+    {
+        return skip_blank(p, e) == e;
+    }
+
+    std::size_t count_rows(const char* p, const char* end) noexcept
+    {
+        std::size_t rows = 0;
+        while (p != end) {
+            const char* next;
+            const char* e = line_end(p, end, next);
+            if (!blank(p, e))
+                ++rows;
+            p = next;
+        }
+        return rows;
+    }
+
+    std::size_t count_fields(const char* p, const char* e) noexcept
+    {
+        return 1 + static_cast<std::size_t>(std::count(p, e, ','));
+    }
+
+    // chunk boundaries are moved forward to the start of the next line
+    std::vector<chunk> split_lines(const char* begin, const char* end, std::size_t threads)
+    {
+        std::size_t size = end - begin;
+        std::size_t n = std::max<std::size_t>(size / chunk_bytes, 4 * std::max<std::size_t>(threads, 1));
+        n = std::max<std::size_t>(std::min(n, size), 1);
+
+        std::vector<chunk> chunks;
+        const char* p = begin;
+        for (std::size_t i = 1; i <= n && p != end; ++i) {
+            const char* q = i == n ? end : begin + size / n * i;
+            if (q < p)
+                continue;
+            if (q != end) {
+                auto nl = static_cast<const char*>(std::memchr(q, '\n', end - q));
+                q = nl ? nl + 1 : end;
+            }
+            chunks.push_back({ p, q, 0, 0 });
+            p = q;
+        }
+        return chunks;
+    }
+}
+
+FeatureMatrix load_csv(const std::string& path, std::size_t threads)
+{
+    mapped_file file(path);
+    if (!file.size())
+        return FeatureMatrix();
+
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    auto chunks = split_lines(file.begin(), file.end(), threads);
+
+    // the first pass only counts rows, so every chunk knows where its rows go
+    parallel_for(chunks.size(), threads, [&](std::size_t i) {
+        chunks[i].rows = count_rows(chunks[i].begin, chunks[i].end);
+    });
+    std::size_t rows = 0, cols = 0;
+    for (auto& c : chunks) {
+        c.first_row = rows;
+        rows += c.rows;
+    }
+    if (!rows)
+        return FeatureMatrix();
+
+    for (const char* p = file.begin(); p != file.end(); ) {
+        const char* next;
+        const char* e = line_end(p, file.end(), next);
+        if (!blank(p, e)) {
+            cols = count_fields(p, e);
+            break;
+        }
+        p = next;
+    }
+    FeatureMatrix csv(rows, cols);
+
+    parallel_for(chunks.size(), threads, [&](std::size_t i) {
+        const auto& c = chunks[i];
+        float* out = csv[c.first_row].data();
+        std::size_t row = c.first_row;
+
+        for (const char* p = c.begin; p != c.end; ) {
+            const char* next;
+            const char* e = line_end(p, c.end, next);
+            if (blank(p, e)) {
+                p = next;
+                continue;
+            }
+
+            std::size_t fields = 0;
+            const char* q = p;
+            while (true) {
+                if (fields == cols)
+                    throw std::runtime_error(path + ": row " + std::to_string(row) + " has more than " +
+                                             std::to_string(cols) + " fields.");
+                q = skip_blank(q, e);
+                float value;
+                auto [ptr, ec] = std::from_chars(q, e, value);
+                if (ec != std::errc())
+                    throw std::runtime_error(path + ": row " + std::to_string(row) + " has a field which is not a number.");
+                *out++ = value;
+                ++fields;
+                q = skip_blank(ptr, e);
+                if (q == e)
+                    break;
+                if (*q != ',')
+                    throw std::runtime_error(path + ": row " + std::to_string(row) + " has a field which is not a number.");
+                ++q;
+            }
+            if (fields != cols)
+                throw std::runtime_error(path + ": row " + std::to_string(row) + " has " + std::to_string(fields) +
+                                         " fields instead of " + std::to_string(cols) + '.');
+            ++row;
+            p = next;
+        }
+    });
+
+    return csv;
+}
+
+std::tuple<FeatureMatrix, std::vector<int>>
+load_matrix(const std::string& X_path, const std::string& Y_path)
+{
+    auto X = load_csv(X_path);
+    auto Y_csv = load_csv(Y_path);
+    std::vector<int> Y(Y_csv.data(), Y_csv.data() + Y_csv.rows() * Y_csv.cols());
+
+    return std::make_tuple(std::move(X), std::move(Y));
+}
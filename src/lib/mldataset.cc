@@ -0,0 +1,789 @@
+#include "mldataset.h"
+#include "feature/ParallelFor.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    constexpr char MAGIC[4] = { 'E', 'L', 'D', 'S' };
+
+    std::int64_t to_microseconds(std::chrono::system_clock::time_point t) noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+    }
+}
+
+dataset_header dataset_header::make(const dataset_geometry& dataset, dataset_dtype type)
+{
+    dataset_header h{};
+    const auto& geometry = dataset.geometry;
+
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.byte_order = byte_order_mark;
+    h.version = current_version;
+    h.dtype = static_cast<std::uint16_t>(type);
+    h.channels = dataset.features == geometry.size() ? 2 : 1;
+    h.cols = geometry.cols();
+    h.rows = geometry.rows();
+    h.roi_w = geometry.roi_w;
+    h.roi_h = geometry.roi_h;
+    h.features = static_cast<std::uint32_t>(dataset.features);
+    h.mode = static_cast<std::uint16_t>(dataset.mode);
+    h.record_size = type == dataset_dtype::FLOAT32 ?
+                    static_cast<std::uint32_t>(record_head + dataset.features * sizeof(float)) : 0;
+    return h;
+}
+
+void dataset_header::check(const std::string& path) const
+{
+    if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw std::runtime_error(path + " is not a binary dataset.");
+    if (byte_order != byte_order_mark)
+        throw std::runtime_error(path + " was written with another byte order.");
+    if (version != current_version)
+        throw std::runtime_error(path + " has unsupported version " + std::to_string(version) + '.');
+    if (dtype != static_cast<std::uint16_t>(dataset_dtype::FLOAT32) &&
+        dtype != static_cast<std::uint16_t>(dataset_dtype::DELTA_U16))
+        throw std::runtime_error(path + " has unsupported dtype " + std::to_string(dtype) + '.');
+    if (features == 0 || record_size != (compressed() ? 0 : record_head + features * sizeof(float)))
+        throw std::runtime_error(path + " has an inconsistent record size.");
+    if (!geometry().geometry.valid())
+        throw std::runtime_error(path + " has an invalid grid geometry.");
+    if (mode > static_cast<std::uint16_t>(feature_mode::LUT))
+        throw std::runtime_error(path + " has unknown feature mode " + std::to_string(mode) + '.');
+}
+
+dataset_geometry dataset_header::geometry() const noexcept
+{
+    auto geometry = grid_geometry::from_grid(static_cast<int>(cols), static_cast<int>(rows),
+                                             static_cast<int>(roi_w), static_cast<int>(roi_h));
+    return { geometry, features, static_cast<feature_mode>(mode) };
+}
+
+bool dataset_header::compressed() const noexcept
+{
+    return dtype == static_cast<std::uint16_t>(dataset_dtype::DELTA_U16);
+}
+
+void dataset_header::encode(const std::vector<float>& features, int label,
+                            std::chrono::system_clock::time_point captured, char* out) const
+{
+    std::int64_t timestamp = to_microseconds(captured);
+    std::int32_t label32 = label;
+    std::int32_t reserved32 = 0;
+
+    std::memcpy(out, &timestamp, sizeof(timestamp));
+    std::memcpy(out + 8, &label32, sizeof(label32));
+    std::memcpy(out + 12, &reserved32, sizeof(reserved32));
+    std::memcpy(out + record_head, features.data(), features.size() * sizeof(float));
+}
+
+MlDatasetWriter::MlDatasetWriter(const std::string& path, const dataset_geometry& dataset, dataset_dtype type)
+    : path(path),
+      fs(path, std::ios::out | std::ios::binary | std::ios::trunc),
+      head(dataset_header::make(dataset, type)),
+      record(head.compressed() ? FeatureEncoder::max_record_size(head.features) : head.record_size, 0),
+      count(0),
+      encoder(head.features),
+      block_head{ 0, 0 }
+{
+    fs.write(reinterpret_cast<const char*>(&head), sizeof(head));
+    if (!fs)
+        throw std::runtime_error("can't write " + path + '.');
+    if (head.compressed())
+        block.reserve(block_records * record.size());
+}
+
+MlDatasetWriter::~MlDatasetWriter()
+{
+    try {
+        write_block();
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+void MlDatasetWriter::write(const std::vector<float>& features, int label, time_point captured)
+{
+    if (features.size() != head.features)
+        throw std::invalid_argument("sample of " + std::to_string(features.size()) +
+                                    " features doesn't match " + path + '.');
+
+    if (head.compressed()) {
+        auto n = encoder.encode(features.data(), label, to_microseconds(captured), record.data());
+        block.insert(block.end(), record.data(), record.data() + n);
+        ++block_head.records;
+        ++count;
+        if (block_head.records == block_records)
+            write_block();
+        return;
+    }
+
+    head.encode(features, label, captured, record.data());
+    fs.write(record.data(), record.size());
+    if (!fs)
+        throw std::runtime_error("can't write " + path + '.');
+    ++count;
+}
+
+void MlDatasetWriter::flush()
+{
+    write_block();
+    fs.flush();
+}
+
+void MlDatasetWriter::write_block()
+{
+    if (!block_head.records)
+        return;
+
+    block_head.bytes = static_cast<std::uint32_t>(block.size());
+    fs.write(reinterpret_cast<const char*>(&block_head), sizeof(block_head));
+    fs.write(block.data(), block.size());
+    block.clear();
+    block_head.records = 0;
+    encoder.reset();
+    if (!fs)
+        throw std::runtime_error("can't write " + path + '.');
+}
+
+std::size_t MlDatasetWriter::size() const noexcept
+{
+    return count;
+}
+
+const dataset_header& MlDatasetWriter::header() const noexcept
+{
+    return head;
+}
+
+MlAsyncDatasetWriter::MlAsyncDatasetWriter(const std::string& path,
+                                           const dataset_geometry& dataset,
+                                           const async_writer_options& options)
+    : path(path),
+      head(dataset_header::make(dataset, options.dtype)),
+      opts(options),
+      fd(-1),
+      encoder(head.features),
+      filling(nullptr),
+      writing(0),
+      written_count(0),
+      dropped_count(0),
+      high_water_mark(0),
+      stop(false)
+{
+    if (opts.buffers < 2 || opts.buffer_records == 0)
+        throw std::invalid_argument("MlAsyncDatasetWriter requires at least 2 buffers of 1 record.");
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw std::runtime_error("can't open " + path + ": " + std::strerror(errno));
+
+    // a compressed buffer is one block, its header filled in by run()
+    std::size_t buffer_bytes = head.compressed() ?
+        sizeof(block_header) + opts.buffer_records * FeatureEncoder::max_record_size(head.features) :
+        opts.buffer_records * head.record_size;
+    buffers.resize(opts.buffers);
+    for (auto& b : buffers) {
+        b.data.resize(buffer_bytes);
+        free_buffers.push_back(&b);
+    }
+
+    try {
+        write_out(reinterpret_cast<const char*>(&head), sizeof(head));
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+
+    local_thread = std::thread([this] { run(); });
+}
+
+MlAsyncDatasetWriter::~MlAsyncDatasetWriter()
+{
+    try {
+        close();
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+bool MlAsyncDatasetWriter::write(const std::vector<float>& features, int label, time_point captured)
+{
+    if (features.size() != head.features)
+        throw std::invalid_argument("sample of " + std::to_string(features.size()) +
+                                    " features doesn't match " + path + '.');
+
+    std::unique_lock<std::mutex> lck{m};
+    if (error)
+        std::rethrow_exception(error);
+    if (stop)
+        throw std::logic_error("MlAsyncDatasetWriter is closed but being written.");
+
+    if (!filling) {
+        if (free_buffers.empty()) {
+            dropped_count.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        filling = free_buffers.back();
+        free_buffers.pop_back();
+        start_buffer(*filling);
+    }
+
+    char* out = filling->data.data() + filling->bytes;
+    if (head.compressed()) {
+        filling->bytes += encoder.encode(features.data(), label, to_microseconds(captured), out);
+    } else {
+        head.encode(features, label, captured, out);
+        filling->bytes += head.record_size;
+    }
+    if (++filling->records == opts.buffer_records) {
+        full_buffers.push_back(filling);
+        filling = nullptr;
+        std::size_t waiting = full_buffers.size() + writing;
+        if (waiting > high_water_mark.load(std::memory_order_relaxed))
+            high_water_mark.store(waiting, std::memory_order_relaxed);
+        lck.unlock();
+        cv.notify_one();
+    }
+    return true;
+}
+
+void MlAsyncDatasetWriter::close()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        stop = true;
+    }
+    cv.notify_one();
+    if (local_thread.joinable())
+        local_thread.join();
+
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    if (error)
+        std::rethrow_exception(std::exchange(error, nullptr));
+}
+
+std::size_t MlAsyncDatasetWriter::size() const noexcept
+{
+    return written_count.load(std::memory_order_relaxed);
+}
+
+std::size_t MlAsyncDatasetWriter::dropped() const noexcept
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
+
+std::size_t MlAsyncDatasetWriter::high_water() const noexcept
+{
+    return high_water_mark.load(std::memory_order_relaxed);
+}
+
+const dataset_header& MlAsyncDatasetWriter::header() const noexcept
+{
+    return head;
+}
+
+const async_writer_options& MlAsyncDatasetWriter::options() const noexcept
+{
+    return opts;
+}
+
+void MlAsyncDatasetWriter::start_buffer(buffer& b)
+{
+    if (head.compressed()) {
+        encoder.reset();
+        b.bytes = sizeof(block_header);
+    } else {
+        b.bytes = 0;
+    }
+}
+
+void MlAsyncDatasetWriter::run()
+{
+    std::vector<buffer*> to_write;
+    auto deadline = std::chrono::steady_clock::now() + opts.flush_interval;
+
+    while (true) {
+        bool last, failed;
+        {
+            std::unique_lock<std::mutex> lck{m};
+            cv.wait_until(lck, deadline, [&] { return !full_buffers.empty() || stop; });
+
+            // a partly filled buffer goes out once the interval is over
+            bool due = std::chrono::steady_clock::now() >= deadline;
+            if ((due || stop) && filling && filling->records) {
+                full_buffers.push_back(filling);
+                filling = nullptr;
+            }
+            if (due)
+                deadline = std::chrono::steady_clock::now() + opts.flush_interval;
+
+            to_write.assign(full_buffers.begin(), full_buffers.end());
+            full_buffers.clear();
+            writing = to_write.size();
+            failed = static_cast<bool>(error);
+            last = stop;
+        }
+
+        // the disk is only touched outside the lock, write() keeps filling.
+        // after an error the samples are lost, but write() still never waits
+        std::size_t records = 0;
+        std::exception_ptr failure;
+        if (!failed) {
+            try {
+                for (auto b : to_write) {
+                    if (head.compressed()) {
+                        block_header block{ static_cast<std::uint32_t>(b->bytes - sizeof(block_header)),
+                                            static_cast<std::uint32_t>(b->records) };
+                        std::memcpy(b->data.data(), &block, sizeof(block));
+                    }
+                    write_out(b->data.data(), b->bytes);
+                    records += b->records;
+                }
+                if (opts.sync && !to_write.empty() && ::fsync(fd) == -1)
+                    throw std::runtime_error("can't sync " + path + ": " + std::strerror(errno));
+            } catch (...) {
+                failure = std::current_exception();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lck{m};
+            written_count.fetch_add(records, std::memory_order_relaxed);
+            if (failure && !error)
+                error = failure;
+            for (auto b : to_write) {
+                b->records = b->bytes = 0;
+                free_buffers.push_back(b);
+            }
+            writing = 0;
+        }
+        if (last)
+            return;
+    }
+}
+
+void MlAsyncDatasetWriter::write_out(const char* p, std::size_t left)
+{
+    while (left) {
+        ssize_t n = ::write(fd, p, left);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("can't write " + path + ": " + std::strerror(errno));
+        }
+        p += n;
+        left -= static_cast<std::size_t>(n);
+    }
+}
+
+bool is_binary_dataset(const std::string& path)
+{
+    std::ifstream fs(path, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+
+    return fs.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+namespace {
+    struct block_span {
+        const char* begin;
+        const char* end;
+        std::size_t first_row;
+        std::size_t rows;
+    };
+
+    // opens a dataset and reads its header, returns the bytes after it
+    std::size_t open_dataset(std::ifstream& fs, const std::string& path, dataset_header& header)
+    {
+        fs.open(path, std::ios::binary | std::ios::ate);
+        if (!fs)
+            throw std::runtime_error("can't open " + path + '.');
+        std::size_t file_size = fs.tellg();
+        fs.seekg(0);
+
+        if (file_size < sizeof(dataset_header) ||
+            !fs.read(reinterpret_cast<char*>(&header), sizeof(dataset_header)))
+            throw std::runtime_error(path + " is not a binary dataset.");
+        header.check(path);
+        return file_size - sizeof(dataset_header);
+    }
+
+    // the records of a dataset as read from the file, counted but not
+    // decoded yet; spans are the blocks of a compressed one
+    struct record_bytes {
+        std::vector<char> data;
+        std::vector<block_span> spans;
+        std::size_t records = 0;
+    };
+
+    record_bytes read_records(std::ifstream& fs, std::size_t size, const std::string& path, const dataset_header& header)
+    {
+        record_bytes bytes;
+        // a record cut short by an interrupted collection is ignored
+        if (!header.compressed())
+            size = size / header.record_size * header.record_size;
+        bytes.data.resize(size);
+        if (!fs.read(bytes.data.data(), bytes.data.size()))
+            throw std::runtime_error("can't read " + path + '.');
+
+        if (!header.compressed()) {
+            bytes.records = size / header.record_size;
+            return bytes;
+        }
+        // and so is a block cut short
+        for (const char* p = bytes.data.data(), * end = p + size; end - p >= static_cast<std::ptrdiff_t>(sizeof(block_header)); ) {
+            block_header block;
+            std::memcpy(&block, p, sizeof(block));
+            p += sizeof(block);
+            if (static_cast<std::size_t>(end - p) < block.bytes)
+                break;
+            bytes.spans.push_back({ p, p + block.bytes, bytes.records, block.records });
+            bytes.records += block.records;
+            p += block.bytes;
+        }
+        return bytes;
+    }
+
+    // decodes the records into the rows of dataset from first_row on.
+    // blocks don't depend on one another, so they are decoded in parallel
+    void decode_records(const record_bytes& bytes, const dataset_header& header, const std::string& path,
+                        MlDataset& dataset, std::size_t first_row, std::size_t threads)
+    {
+        if (!header.compressed()) {
+            std::size_t row_bytes = header.features * sizeof(float);
+            for (std::size_t i = 0; i != bytes.records; ++i) {
+                const char* p = bytes.data.data() + i * header.record_size;
+                std::size_t row = first_row + i;
+                std::int32_t label;
+                std::memcpy(&dataset.timestamps[row], p, sizeof(std::int64_t));
+                std::memcpy(&label, p + 8, sizeof(label));
+                dataset.labels[row] = label;
+                std::memcpy(dataset.features[row].data(), p + dataset_header::record_head, row_bytes);
+            }
+            return;
+        }
+
+        parallel_for(bytes.spans.size(), threads, [&](std::size_t i) {
+            const auto& span = bytes.spans[i];
+            FeatureDecoder decoder(header.features);
+            const char* p = span.begin;
+            for (std::size_t row = first_row + span.first_row; row != first_row + span.first_row + span.rows; ++row)
+                p = decoder.decode(p, span.end, dataset.features[row].data(), dataset.labels[row], dataset.timestamps[row]);
+            if (p != span.end)
+                throw std::runtime_error(path + " has a block of more bytes than records.");
+        });
+    }
+}
+
+MlDataset load_dataset(const std::string& path)
+{
+    std::ifstream fs;
+    MlDataset dataset;
+    std::size_t size = open_dataset(fs, path, dataset.header);
+    auto bytes = read_records(fs, size, path, dataset.header);
+
+    dataset.features = FeatureMatrix(bytes.records, dataset.header.features);
+    dataset.labels.resize(bytes.records);
+    dataset.timestamps.resize(bytes.records);
+    decode_records(bytes, dataset.header, path, dataset, 0, 0);
+
+    return dataset;
+}
+
+void load_dataset_rows(const std::string& path, MlDataset& dataset, std::size_t first_row, std::size_t rows)
+{
+    std::ifstream fs;
+    dataset_header header;
+    std::size_t size = open_dataset(fs, path, header);
+    if (header.geometry() != dataset.header.geometry())
+        throw std::runtime_error(path + " has another geometry or feature mode than the dataset it's read into.");
+    auto bytes = read_records(fs, size, path, header);
+    if (bytes.records != rows)
+        throw std::runtime_error(path + " has " + std::to_string(bytes.records) + " records instead of " +
+                                 std::to_string(rows) + '.');
+    if (first_row + rows > dataset.size())
+        throw std::out_of_range("rows of " + path + " are beyond the dataset.");
+
+    // callers read several files at once, so each one is decoded here
+    decode_records(bytes, header, path, dataset, first_row, 1);
+}
+
+namespace {
+    std::uint64_t splitmix64(std::uint64_t x) noexcept
+    {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    // uniform in [0, 1), the same for the same record and seed
+    double record_hash(std::size_t record, std::uint64_t seed) noexcept
+    {
+        return (splitmix64(record ^ splitmix64(seed)) >> 11) * 0x1.0p-53;
+    }
+}
+
+MlDatasetStream::MlDatasetStream(const std::string& path, const stream_options& options)
+    : path(path),
+      fs(path, std::ios::binary | std::ios::ate),
+      records(0),
+      opts(options),
+      chunk_records(0),
+      chunk_pos(0),
+      chunk_first(0),
+      next_chunk(0),
+      decoder(0),
+      pool_size(0),
+      engine(options.seed ? options.seed : std::random_device{}())
+{
+    if (!fs)
+        throw std::runtime_error("can't open " + path + '.');
+    std::size_t file_size = fs.tellg();
+    fs.seekg(0);
+    if (file_size < sizeof(dataset_header) ||
+        !fs.read(reinterpret_cast<char*>(&head), sizeof(dataset_header)))
+        throw std::runtime_error(path + " is not a binary dataset.");
+    head.check(path);
+
+    // with a shuffle buffer the reads get an eighth of the memory
+    std::size_t read_bytes = opts.shuffle ? opts.memory / 8 : opts.memory;
+    std::size_t row_bytes = head.features * sizeof(float) + sizeof(int);
+    if (head.compressed()) {
+        // blocks are read whole, the read buffer grows to the largest one
+        decoder = FeatureDecoder(head.features);
+        decoded = FeatureMatrix(0, head.features);
+        block_header block;
+        for (std::size_t pos = sizeof(dataset_header); file_size - pos >= sizeof(block); pos += block.bytes) {
+            if (!fs.read(reinterpret_cast<char*>(&block), sizeof(block)))
+                throw std::runtime_error("can't read " + path + '.');
+            pos += sizeof(block);
+            if (file_size - pos < block.bytes)
+                break;
+            records += block.records;
+            fs.seekg(pos + block.bytes);
+        }
+    } else {
+        records = (file_size - sizeof(dataset_header)) / head.record_size;
+        chunk.resize(std::max<std::size_t>(read_bytes / head.record_size, 1) * head.record_size);
+    }
+    if (opts.shuffle) {
+        std::size_t pool_rows = std::max<std::size_t>((opts.memory - std::min(opts.memory, read_bytes)) / row_bytes, 1);
+        pool = FeatureMatrix(pool_rows, head.features);
+        pool_labels.resize(pool_rows);
+    }
+    rewind();
+}
+
+const dataset_header& MlDatasetStream::header() const noexcept
+{
+    return head;
+}
+
+std::size_t MlDatasetStream::size() const noexcept
+{
+    return records;
+}
+
+void MlDatasetStream::set_filter(filter_type new_filter)
+{
+    filter = std::move(new_filter);
+}
+
+void MlDatasetStream::rewind()
+{
+    pass_filter = filter;
+    chunk_records = chunk_pos = chunk_first = 0;
+    next_chunk = head.compressed() ? sizeof(dataset_header) : 0;
+    pool_size = 0;
+}
+
+bool MlDatasetStream::fill()
+{
+    if (head.compressed())
+        return fill_block();
+    if (next_chunk == records)
+        return false;
+
+    std::size_t n = std::min(chunk.size() / head.record_size, records - next_chunk);
+    fs.clear();
+    fs.seekg(sizeof(dataset_header) + next_chunk * head.record_size);
+    if (!fs.read(chunk.data(), n * head.record_size))
+        throw std::runtime_error("can't read " + path + '.');
+
+    chunk_first = next_chunk;
+    chunk_records = n;
+    chunk_pos = 0;
+    next_chunk += n;
+    return true;
+}
+
+bool MlDatasetStream::fill_block()
+{
+    // blocks of no records are skipped, the truncated last one isn't counted
+    block_header block{ 0, 0 };
+    std::size_t first = chunk_first + chunk_records;
+    while (first != records && !block.records) {
+        fs.clear();
+        fs.seekg(next_chunk);
+        if (!fs.read(reinterpret_cast<char*>(&block), sizeof(block)))
+            throw std::runtime_error("can't read " + path + '.');
+        chunk.resize(block.bytes);
+        if (!fs.read(chunk.data(), chunk.size()))
+            throw std::runtime_error("can't read " + path + '.');
+        next_chunk += sizeof(block) + block.bytes;
+    }
+    if (!block.records)
+        return false;
+
+    decoded.resize(block.records);
+    decoded_labels.resize(block.records);
+    decoder.reset();
+    const char* p = chunk.data();
+    const char* end = p + chunk.size();
+    std::int64_t timestamp;
+    for (std::size_t i = 0; i != block.records; ++i)
+        p = decoder.decode(p, end, decoded[i].data(), decoded_labels[i], timestamp);
+    if (p != end)
+        throw std::runtime_error(path + " has a block of more bytes than records.");
+
+    chunk_first = first;
+    chunk_records = block.records;
+    chunk_pos = 0;
+    return true;
+}
+
+bool MlDatasetStream::next_record(const char*& record, int& label_out)
+{
+    while (true) {
+        if (chunk_pos == chunk_records && !fill())
+            return false;
+
+        std::size_t index = chunk_first + chunk_pos;
+        const char* p;
+        std::int32_t label;
+        if (head.compressed()) {
+            p = reinterpret_cast<const char*>(decoded[chunk_pos].data());
+            label = decoded_labels[chunk_pos];
+        } else {
+            p = chunk.data() + chunk_pos * head.record_size;
+            std::memcpy(&label, p + 8, sizeof(label));
+            p += dataset_header::record_head;
+        }
+        ++chunk_pos;
+        if (!pass_filter || pass_filter(index, label)) {
+            record = p;
+            label_out = label;
+            return true;
+        }
+    }
+}
+
+std::size_t MlDatasetStream::next(FeatureMatrix& X, std::vector<int>& Y, std::size_t n)
+{
+    std::size_t row_bytes = head.features * sizeof(float);
+    const char* record;
+    int label;
+    std::size_t count = 0;
+
+    if (X.empty() && X.cols() != head.features)
+        X = FeatureMatrix(0, head.features);
+    if (X.cols() != head.features)
+        throw std::invalid_argument("FeatureMatrix of " + std::to_string(X.cols()) +
+                                    " columns can't take records of " + path + '.');
+    X.reserve(X.rows() + n);
+    Y.reserve(Y.size() + n);
+
+    if (!opts.shuffle) {
+        while (count != n && next_record(record, label)) {
+            X.resize(X.rows() + 1);
+            std::memcpy(X[X.rows() - 1].data(), record, row_bytes);
+            Y.push_back(label);
+            ++count;
+        }
+        return count;
+    }
+
+    // the first records of a pass only fill the shuffle buffer
+    while (pool_size != pool.rows() && next_record(record, label)) {
+        std::memcpy(pool[pool_size].data(), record, row_bytes);
+        pool_labels[pool_size++] = label;
+    }
+    // then a random one is handed out and its place taken by the next one
+    while (count != n && pool_size) {
+        std::size_t j = std::uniform_int_distribution<std::size_t>(0, pool_size - 1)(engine);
+        X.push_back(pool[j]);
+        Y.push_back(pool_labels[j]);
+        ++count;
+
+        if (next_record(record, label)) {
+            std::memcpy(pool[j].data(), record, row_bytes);
+            pool_labels[j] = label;
+        } else if (j != --pool_size) {
+            std::memcpy(pool[j].data(), pool[pool_size].data(), row_bytes);
+            pool_labels[j] = pool_labels[pool_size];
+        }
+    }
+    return count;
+}
+
+std::map<int, std::size_t> MlDatasetStream::count_labels()
+{
+    std::map<int, std::size_t> counts;
+    auto saved = std::move(filter);
+
+    filter = nullptr;
+    rewind();
+    const char* record;
+    int label;
+    while (next_record(record, label))
+        ++counts[label];
+
+    filter = std::move(saved);
+    rewind();
+    return counts;
+}
+
+MlDatasetStream::filter_type split_filter(double percent, bool cv, std::uint64_t seed)
+{
+    return [=](std::size_t record, int) {
+        return (record_hash(record, seed) < percent) == cv;
+    };
+}
+
+MlDatasetStream::filter_type balance_filter(const std::map<int, std::size_t>& counts, std::uint64_t seed)
+{
+    std::size_t n = 0;
+    for (const auto& [label, count] : counts)
+        n += count;
+
+    for (const auto& [label, count] : counts) {
+        if (count != n && static_cast<double>(count) / n > 0.75) {
+            double keep = 0.7 * n / count;
+            int striped = label;
+            // a different seed than the split, so both don't pick the same records
+            return [=](std::size_t record, int record_label) {
+                return record_label != striped || record_hash(record, ~seed) < keep;
+            };
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,97 @@
+#include "mldedup.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+    // FNV-1a over the coarse features
+    std::uint64_t hash_coarse(const std::vector<std::uint16_t>& coarse) noexcept
+    {
+        std::uint64_t h = 0xcbf29ce484222325ull;
+        for (auto v : coarse) {
+            h = (h ^ (v & 0xff)) * 0x100000001b3ull;
+            h = (h ^ (v >> 8)) * 0x100000001b3ull;
+        }
+        return h;
+    }
+}
+
+double dedup_stats::reduction_ratio() const noexcept
+{
+    return seen ? 1.0 - static_cast<double>(kept) / seen : 0.0;
+}
+
+MlDuplicateFilter::MlDuplicateFilter(const dedup_options& options)
+    : opts(options), prev_label(0), primed(false)
+{
+    if (!(opts.step > 0.0f) || opts.window == 0)
+        throw std::invalid_argument("MlDuplicateFilter requires a positive step and window.");
+}
+
+bool MlDuplicateFilter::keep(const std::vector<float>& features, int label)
+{
+    ++counters.seen;
+    coarse.resize(features.size());
+    for (std::size_t i = 0; i != features.size(); ++i)
+        coarse[i] = static_cast<std::uint16_t>(std::clamp(features[i] / opts.step, 0.0f, 65535.0f));
+    std::uint64_t hash = hash_coarse(coarse);
+
+    bool label_changed = !primed || label != prev_label;
+    prev_label = label;
+    primed = true;
+    if (!label_changed && near_recent(hash))
+        return false;
+
+    // the oldest recent sample makes room, its buffer is reused
+    recent_sample sample;
+    if (recent.size() == opts.window) {
+        sample = std::move(recent.front());
+        recent.pop_front();
+    }
+    sample.hash = hash;
+    sample.coarse.swap(coarse);
+    recent.push_back(std::move(sample));
+    ++counters.kept;
+    return true;
+}
+
+bool MlDuplicateFilter::near_recent(std::uint64_t hash)
+{
+    for (const auto& sample : recent) {
+        if (sample.hash == hash) {
+            ++counters.exact;
+            return true;
+        }
+    }
+    for (const auto& sample : recent) {
+        if (sample.coarse.size() != coarse.size())
+            continue;
+        std::size_t differing = 0;
+        for (std::size_t i = 0; i != coarse.size() && differing <= opts.threshold; ++i)
+            differing += sample.coarse[i] != coarse[i];
+        if (differing <= opts.threshold) {
+            ++counters.near;
+            return true;
+        }
+    }
+    return false;
+}
+
+void MlDuplicateFilter::reset()
+{
+    recent.clear();
+    primed = false;
+}
+
+const dedup_stats& MlDuplicateFilter::stats() const noexcept
+{
+    return counters;
+}
+
+const dedup_options& MlDuplicateFilter::options() const noexcept
+{
+    return opts;
+}
@@ -0,0 +1,164 @@
+#include "mlframe.h"
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+struct MlFrame::slot_type {
+	cv::Mat mat;
+	std::atomic<int> refs{0};
+	std::size_t index = 0;
+};
+
+struct MlFrame::pool_state {
+	pool_state(std::size_t n, const cv::Size& size, int type)
+		: slots(n), size(size), type(type)
+	{
+		free_slots.reserve(n);
+		for (std::size_t i = 0; i != n; ++i) {
+			slots[i].mat.create(size, type);
+			slots[i].index = i;
+			free_slots.push_back(i);
+		}
+	}
+
+	void give_back(slot_type *slot)
+	{
+		{
+			std::lock_guard<std::mutex> lck{m};
+			free_slots.push_back(slot->index);
+		}
+		cv.notify_one();
+	}
+
+	std::vector<slot_type> slots;
+	std::vector<std::size_t> free_slots;
+	cv::Size size;
+	int type;
+	mutable std::mutex m;
+	std::condition_variable cv;
+};
+
+// MlFrame implementation
+MlFrame::MlFrame(std::shared_ptr<pool_state> pool, slot_type *slot) noexcept
+	: pool(std::move(pool)), slot(slot)
+{
+	slot->refs.store(1, std::memory_order_relaxed);
+}
+
+MlFrame::MlFrame(const MlFrame& other) noexcept
+	: pool(other.pool), slot(other.slot)
+{
+	if (slot)
+		slot->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+MlFrame::MlFrame(MlFrame&& other) noexcept
+	: pool(std::move(other.pool)), slot(other.slot)
+{
+	other.slot = nullptr;
+}
+
+MlFrame& MlFrame::operator=(const MlFrame& other) noexcept
+{
+	if (this != &other) {
+		MlFrame tmp(other);
+		*this = std::move(tmp);
+	}
+	return *this;
+}
+
+MlFrame& MlFrame::operator=(MlFrame&& other) noexcept
+{
+	if (this != &other) {
+		release();
+		pool = std::move(other.pool);
+		slot = other.slot;
+		other.slot = nullptr;
+	}
+	return *this;
+}
+
+MlFrame::~MlFrame()
+{
+	release();
+}
+
+cv::Mat& MlFrame::mat() noexcept
+{
+	return slot->mat;
+}
+
+const cv::Mat& MlFrame::mat() const noexcept
+{
+	return slot->mat;
+}
+
+MlFrame::operator bool() const noexcept
+{
+	return slot != nullptr;
+}
+
+void MlFrame::release() noexcept
+{
+	if (!slot)
+		return;
+	if (slot->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		pool->give_back(slot);
+	slot = nullptr;
+	pool.reset();
+}
+
+// MlFramePool implementation
+MlFramePool::MlFramePool(std::size_t n, const cv::Size& size, int type)
+	: state(std::make_shared<MlFrame::pool_state>(n, size, type))
+{
+	if (n == 0)
+		throw std::invalid_argument("MlFramePool requires at least 1 frame.");
+}
+
+MlFrame MlFramePool::acquire()
+{
+	std::unique_lock<std::mutex> lck{state->m};
+	state->cv.wait(lck, [&] { return !state->free_slots.empty(); });
+
+	auto index = state->free_slots.back();
+	state->free_slots.pop_back();
+	return MlFrame(state, &state->slots[index]);
+}
+
+MlFrame MlFramePool::try_acquire()
+{
+	std::lock_guard<std::mutex> lck{state->m};
+	if (state->free_slots.empty())
+		return MlFrame();
+
+	auto index = state->free_slots.back();
+	state->free_slots.pop_back();
+	return MlFrame(state, &state->slots[index]);
+}
+
+std::size_t MlFramePool::available() const
+{
+	std::lock_guard<std::mutex> lck{state->m};
+	return state->free_slots.size();
+}
+
+std::size_t MlFramePool::size() const noexcept
+{
+	return state->slots.size();
+}
+
+cv::Size MlFramePool::frame_size() const noexcept
+{
+	return state->size;
+}
+
+int MlFramePool::frame_type() const noexcept
+{
+	return state->type;
+}
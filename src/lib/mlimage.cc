@@ -7,18 +7,128 @@
 #include <cstdint>
 #include <future>
 #include <condition_variable>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <cmath>
+#include <mutex>
 #include "./feature/ExtractFeatureExecutor.h"
+#include "./feature/ParallelFor.h"
 #include <iostream>
 
+namespace {
+    // a batch already keeps every core busy with frames, OpenCV running
+    // its own threads within a frame only adds contention
+    void single_threaded_opencv()
+    {
+        cv::setNumThreads(1);
+    }
+
+    // restores the OpenCV threads of the process once a batch is done
+    struct batch_opencv_threads {
+        batch_opencv_threads() : threads(cv::getNumThreads()) {}
+        ~batch_opencv_threads() { cv::setNumThreads(threads); }
+        int threads;
+    };
+
+    // grid_x_no / grid_y_no boxes over roi_width x roi_height,
+    // the roi defaults to 480 x 840
+    grid_geometry parse_geometry(const rapidjson::Value& d, const std::string& path)
+    {
+        if (!d.HasMember("grid_x_no") || !d.HasMember("grid_y_no"))
+            throw std::runtime_error(path + " has no grid_x_no and grid_y_no.");
+
+        int roi_w = d.HasMember("roi_width") ? d["roi_width"].GetInt() : default_geometry::roi_w;
+        int roi_h = d.HasMember("roi_height") ? d["roi_height"].GetInt() : default_geometry::roi_h;
+        int cols = d["grid_x_no"].GetInt();
+        int rows = d["grid_y_no"].GetInt();
+
+        auto geometry = grid_geometry::from_grid(cols, rows, roi_w, roi_h);
+        if (!geometry.valid() || geometry.cols() != cols || geometry.rows() != rows)
+            throw std::runtime_error(path + ": grid_x_no and grid_y_no have to divide roi_width and roi_height.");
+        return geometry;
+    }
+
+    rapidjson::Document parse_file(const std::string& path)
+    {
+        rapidjson::Document d;
+        std::ifstream fs(path);
+        if (!fs)
+            throw std::runtime_error("can't open " + path + '.');
+        rapidjson::IStreamWrapper isw(fs);
+
+        d.ParseStream(isw);
+        if (d.HasParseError() || !d.IsObject())
+            throw std::runtime_error(path + " is not a valid json object.");
+        return d;
+    }
+}
+
+void save_dataset_geometry(const std::string& path, const dataset_geometry& dataset)
+{
+    std::ofstream fs(path);
+    const auto& geometry = dataset.geometry;
+
+    fs << "{\n"
+       << "    \"grid_x_no\": " << geometry.cols() << ",\n"
+       << "    \"grid_y_no\": " << geometry.rows() << ",\n"
+       << "    \"roi_width\": " << geometry.roi_w << ",\n"
+       << "    \"roi_height\": " << geometry.roi_h << ",\n"
+       << "    \"features\": " << dataset.features << ",\n"
+       << "    \"feature_mode\": " << static_cast<int>(dataset.mode) << "\n"
+       << "}\n";
+    if (!fs)
+        throw std::runtime_error("can't write " + path + '.');
+}
+
+dataset_geometry load_dataset_geometry(const std::string& path)
+{
+    auto d = parse_file(path);
+    dataset_geometry dataset{ parse_geometry(d, path), 0 };
+
+    dataset.features = d.HasMember("features") ? d["features"].GetUint64() : dataset.geometry.size();
+    if (d.HasMember("feature_mode"))
+        dataset.mode = static_cast<feature_mode>(d["feature_mode"].GetInt());
+    return dataset;
+}
+
 MlImageProcessor::MlImageProcessor(const std::string& setting_path)
+    : geometry(default_geometry())
 {
     load_settings(setting_path);
+    do_extract_feature.set_geometry(geometry);
+
+    // grids of feature_mode::MULTI_SCALE: 40, 20, 80 and 20x14 pixel boxes
+    // over the 480x840 roi of default_geometry. They don't follow the
+    // settings file, so the multi-scale features keep their length and
+    // layout whatever grid it sets
+    std::vector<grid_size> grids{ {12, 21}, {24, 42}, {6, 10}, {24, 60} };
+    do_extract_feature.set_grids(grids);
 }
 
-void MlImageProcessor::set_roi(const cv::Mat& img)
+MlImageProcessor::MlImageProcessor(const std::string& setting_path,
+                                   std::size_t workers,
+                                   std::size_t capacity,
+                                   backpressure policy)
+    : MlImageProcessor(setting_path)
+{
+    if (workers > 1) {
+        do_extract_feature_pool = std::make_unique<ExtractFeaturePool>(workers, capacity, policy);
+        do_extract_feature_pool->set_geometry(geometry);
+        do_extract_feature_pool->set_grids(do_extract_feature.get_grids());
+    }
+}
+
+cv::Rect MlImageProcessor::find_roi(const cv::Mat& img, bool preview, double scale)
 {
     cv::Mat thr;
-    cv::cvtColor(img, thr, cv::COLOR_BGR2GRAY);
+    if (scale != 1.0) {
+        cv::resize(img, thr, cv::Size(), scale, scale, cv::INTER_AREA);
+        cv::cvtColor(thr, thr, cv::COLOR_BGR2GRAY);
+    } else {
+        cv::cvtColor(img, thr, cv::COLOR_BGR2GRAY);
+    }
     threshold(thr, thr, 25, 255, cv::THRESH_BINARY);
 
     std::vector<contour_type> contours;
@@ -26,7 +136,7 @@ void MlImageProcessor::set_roi(const cv::Mat& img)
     cv::findContours(thr, contours, cv::RETR_CCOMP, cv::CHAIN_APPROX_SIMPLE);
     cv::Mat img2 = img;
 
-    const contour_type* largest_contour_ptr;
+    const contour_type* largest_contour_ptr = nullptr;
     double largest_area = 0.0;
 
     int i = 0, index = 0;;
@@ -40,12 +150,141 @@ void MlImageProcessor::set_roi(const cv::Mat& img)
         }
         ++i;
     }
-    cv::drawContours(img2, contours, index, cv::Scalar(0, 255, 0));
-    cv::imshow("Test", img2);
-    cv::waitKey(0);
+    if (!largest_contour_ptr)
+        throw std::runtime_error("no roi found in the image.");
+    if (preview && scale == 1.0) {
+        cv::drawContours(img2, contours, index, cv::Scalar(0, 255, 0));
+        cv::imshow("Test", img2);
+        cv::waitKey(0);
+    }
+
+    cv::Rect found = cv::boundingRect(*largest_contour_ptr);
+    if (scale == 1.0)
+        return found;
+
+    // scale back up, rounding outwards, and stay within the image
+    cv::Point tl(static_cast<int>(std::floor(found.x / scale)),
+                 static_cast<int>(std::floor(found.y / scale)));
+    cv::Point br(static_cast<int>(std::ceil(found.br().x / scale)),
+                 static_cast<int>(std::ceil(found.br().y / scale)));
+    return cv::Rect(tl, br) & cv::Rect(0, 0, img.cols, img.rows);
+}
+
+void MlImageProcessor::set_roi(const cv::Mat& img, bool preview)
+{
+    set_roi(find_roi(img, preview));
+}
+
+void MlImageProcessor::set_roi(const cv::Rect& cropper)
+{
+    {
+        std::lock_guard<std::mutex> lck{roi_m};
+        roi = cropper;
+    }
+    if (do_extract_feature_pool) {
+        do_extract_feature_pool->start(cropper, settings);
+        // batches take their options from the executor
+        do_extract_feature.set_cropper(cropper);
+    } else {
+        do_extract_feature.start(cropper, settings);
+    }
+}
 
-    do_extract_feature.start(cv::boundingRect(*largest_contour_ptr), settings);
+void MlImageProcessor::update_roi(const cv::Rect& cropper)
+{
+    std::lock_guard<std::mutex> lck{roi_m};
+    roi = cropper;
+    do_extract_feature.set_cropper(roi);
+    if (do_extract_feature_pool)
+        do_extract_feature_pool->set_cropper(roi);
+}
 
+cv::Rect MlImageProcessor::get_roi() const
+{
+    std::lock_guard<std::mutex> lck{roi_m};
+    return roi;
+}
+
+void MlImageProcessor::set_feature_mode(feature_mode mode)
+{
+    do_extract_feature.set_mode(mode);
+    if (do_extract_feature_pool)
+        do_extract_feature_pool->set_mode(mode);
+}
+
+feature_mode MlImageProcessor::get_feature_mode()
+{
+    return do_extract_feature.get_mode();
+}
+
+void MlImageProcessor::set_grids(const std::vector<grid_size>& grids)
+{
+    do_extract_feature.set_grids(grids);
+    if (do_extract_feature_pool)
+        do_extract_feature_pool->set_grids(grids);
+}
+
+std::vector<grid_size> MlImageProcessor::get_grids()
+{
+    return do_extract_feature.get_grids();
+}
+
+void MlImageProcessor::set_visualizer(std::shared_ptr<PreviewVisualizer> visualizer)
+{
+    if (do_extract_feature_pool)
+        do_extract_feature_pool->set_visualizer(visualizer);
+    do_extract_feature.set_visualizer(std::move(visualizer));
+}
+
+std::size_t MlImageProcessor::get_workers() const noexcept
+{
+    return do_extract_feature_pool ? do_extract_feature_pool->size() : 1;
+}
+
+std::size_t MlImageProcessor::dropped() const noexcept
+{
+    return do_extract_feature_pool ? do_extract_feature_pool->dropped() : 0;
+}
+
+grid_size MlImageProcessor::get_setting_grid() const
+{
+    return { geometry.cols(), geometry.rows() };
+}
+
+grid_geometry MlImageProcessor::get_geometry() const
+{
+    return geometry;
+}
+
+const MlImageProcessor::settings_type& MlImageProcessor::get_settings() const noexcept
+{
+    return settings;
+}
+
+void MlImageProcessor::set_incremental(incremental_mode incremental)
+{
+    do_extract_feature.set_incremental(incremental);
+    if (do_extract_feature_pool)
+        do_extract_feature_pool->set_incremental(incremental);
+}
+
+incremental_mode MlImageProcessor::get_incremental()
+{
+    return do_extract_feature.get_incremental();
+}
+
+std::shared_ptr<const incremental_stats> MlImageProcessor::get_incremental_stats() const noexcept
+{
+    if (do_extract_feature_pool)
+        return do_extract_feature_pool->get_incremental_stats();
+    return do_extract_feature.get_incremental_stats();
+}
+
+std::size_t MlImageProcessor::get_feature_size()
+{
+    if (get_feature_mode() == feature_mode::MULTI_SCALE)
+        return IntegralBoxCounter::size(get_grids());
+    return geometry.size();
 }
 
 std::vector<float> MlImageProcessor::extract_feature(const cv::Mat& img)
@@ -56,44 +295,122 @@ std::vector<float> MlImageProcessor::extract_feature(const cv::Mat& img)
 std::future<std::vector<float>> 
 MlImageProcessor::extract_feature_async(const cv::Mat& img)
 {
+    if (do_extract_feature_pool)
+        return (*do_extract_feature_pool)(img);
     return do_extract_feature(img);
 }
 
-void MlImageProcessor::load_settings(const std::string& setting_path)
+std::vector<float> MlImageProcessor::extract_feature(MlFrame frame)
 {
-    rapidjson::Document d;
-    std::ifstream fs("setting.json");
-    rapidjson::IStreamWrapper isw(fs);
+    return extract_feature_async(std::move(frame)).get();
+}
 
-    d.ParseStream(isw);
-    const rapidjson::Value& val = d["rgb"];
+std::future<std::vector<float>> 
+MlImageProcessor::extract_feature_async(MlFrame frame)
+{
+    if (do_extract_feature_pool)
+        return (*do_extract_feature_pool)(std::move(frame));
+    return do_extract_feature(std::move(frame));
+}
 
-    for (auto& setting : val.GetObject()) {
-        settings_type::mapped_type subsettings;
+cv::Mat MlImageProcessor::extract_features_batch(const std::vector<cv::Mat>& frames, std::size_t threads)
+{
+    batch_opencv_threads opencv_threads;
+    ParallelWorkers workers(threads, single_threaded_opencv);
+    return extract_features_batch(frames, workers);
+}
 
-        for (auto& subsetting: setting.value.GetObject()) {
-            auto subsetting_name = subsetting.name.GetString();
-            settings_type::mapped_type::mapped_type rgb;
+cv::Mat MlImageProcessor::extract_features_batch(const std::vector<cv::Mat>& frames, ParallelWorkers& workers)
+{
+    auto options = do_extract_feature.get_task_options();
+    if (options.cropper.empty())
+        throw std::logic_error("roi has to be set before extracting features.");
+    options.visualizer = nullptr;
+    const std::size_t n_features = get_feature_size();
 
-            auto itr = subsetting.value.Begin();
-            int r = itr->GetInt();
-            ++itr;
-            int g = itr->GetInt();
-            ++itr;
-            int b = itr->GetInt();
-            std::cout << r << ' ' << g << ' ' << b << std::endl;
+    // every row is written by exactly one thread
+    cv::Mat features(static_cast<int>(frames.size()), static_cast<int>(n_features), CV_32F);
+    workers.run(frames.size(), [&](std::size_t i) {
+        auto row = ExtractFeatureExecutor::extract(frames[i], options.cropper, settings, options);
+        if (row.size() != n_features)
+            throw std::logic_error("feature size changed during batch extraction.");
+        std::copy(row.begin(), row.end(), features.ptr<float>(static_cast<int>(i)));
+    });
+    return features;
+}
 
-            subsettings[subsetting_name] = cv::Scalar(b, g, r);
-        }
-        settings[setting.name.GetString()] = std::move(subsettings);
-    }
-    for (auto& p : settings) {
-        std::cout << p.first << std::endl;
-        for (auto& sub : p.second) {
+cv::Mat MlImageProcessor::extract_features_batch(MlFrameSource& source, std::size_t threads, std::size_t chunk)
+{
+    if (chunk == 0)
+        throw std::invalid_argument("chunk has to hold at least one frame.");
 
-            std::cout << sub.first << ' ' << sub.second << std::endl;
+    // one chunk being extracted, one being decoded
+    MlFramePool frames(2 * chunk, source.get_frame_size());
+    std::vector<MlFrame> current, next;
+    auto decode = [&](std::vector<MlFrame>& batch) {
+        batch.clear();
+        while (batch.size() != chunk) {
+            auto frame = source.next_frame(frames);
+            if (!frame)
+                break;
+            batch.push_back(std::move(frame));
         }
+    };
+
+    // the same workers extract every chunk, so what they keep per thread
+    // is built once and incremental counting goes on across chunks
+    batch_opencv_threads opencv_threads;
+    ParallelWorkers workers(threads, single_threaded_opencv);
 
+    cv::Mat features(0, static_cast<int>(get_feature_size()), CV_32F);
+    decode(current);
+    while (!current.empty()) {
+        std::vector<cv::Mat> mats;
+        for (const auto& frame : current)
+            mats.push_back(frame.mat());
+
+        auto result = std::async(std::launch::async, [&] {
+            return extract_features_batch(mats, workers);
+        });
+        decode(next);
+        features.push_back(result.get());
+        current.swap(next);
     }
+    return features;
 }
 
+void MlImageProcessor::load_settings(const std::string& setting_path)
+{
+    auto d = parse_file(setting_path);
+    geometry = parse_geometry(d, setting_path);
+
+    if (!d.HasMember("rgb") || !d["rgb"].IsObject())
+        throw std::runtime_error(setting_path + " has no rgb settings.");
+    const rapidjson::Value& val = d["rgb"];
+
+    // colours are written as [r, g, b] but tested in b, g, r order
+    auto to_range = [&](const char *name) {
+        if (!val.HasMember(name))
+            throw std::runtime_error(setting_path + " has no rgb setting of " + name + '.');
+        const rapidjson::Value& setting = val[name];
+
+        color_range range;
+        const std::pair<const char *, std::uint8_t *> bounds[] = { { "min", range.min }, { "max", range.max } };
+        for (auto& [bound, bgr] : bounds) {
+            if (!setting.HasMember(bound) || !setting[bound].IsArray() || setting[bound].Size() != 3)
+                throw std::runtime_error(std::string(name) + '.' + bound + " has to be an array of 3 values.");
+            auto& rgb = setting[bound];
+
+            for (rapidjson::SizeType c = 0; c != 3; ++c) {
+                if (!rgb[c].IsInt() || rgb[c].GetInt() < 0 || rgb[c].GetInt() > 255)
+                    throw std::runtime_error(std::string(name) + '.' + bound + " has to be in [0, 255].");
+                bgr[2 - c] = static_cast<std::uint8_t>(rgb[c].GetInt());
+            }
+        }
+        if (!range.valid())
+            throw std::runtime_error(std::string(name) + ".min is above " + name + ".max.");
+        return range;
+    };
+
+    settings = { to_range("path"), to_range("coin"), to_range("player") };
+}
@@ -0,0 +1,109 @@
+#include "mlmatrix.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+FeatureMatrix::FeatureMatrix() noexcept
+    : n_rows(0), n_cols(0), capacity(0)
+{}
+
+FeatureMatrix::FeatureMatrix(std::size_t rows, std::size_t cols)
+    : n_rows(0), n_cols(cols), capacity(0)
+{
+    resize(rows);
+}
+
+FeatureMatrix::FeatureMatrix(const FeatureMatrix& other)
+    : n_rows(0), n_cols(other.n_cols), capacity(0)
+{
+    reallocate(other.n_rows);
+    if (other.bytes())
+        std::memcpy(data(), other.data(), other.bytes());
+    n_rows = other.n_rows;
+}
+
+FeatureMatrix::FeatureMatrix(FeatureMatrix&& other) noexcept
+    : buffer(std::move(other.buffer)),
+      n_rows(std::exchange(other.n_rows, 0)),
+      n_cols(std::exchange(other.n_cols, 0)),
+      capacity(std::exchange(other.capacity, 0))
+{}
+
+FeatureMatrix& FeatureMatrix::operator=(const FeatureMatrix& other)
+{
+    if (this != &other) {
+        FeatureMatrix copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+FeatureMatrix& FeatureMatrix::operator=(FeatureMatrix&& other) noexcept
+{
+    buffer = std::move(other.buffer);
+    n_rows = std::exchange(other.n_rows, 0);
+    n_cols = std::exchange(other.n_cols, 0);
+    capacity = std::exchange(other.capacity, 0);
+    return *this;
+}
+
+void FeatureMatrix::reserve(std::size_t rows)
+{
+    if (rows > capacity)
+        reallocate(rows);
+}
+
+void FeatureMatrix::resize(std::size_t rows)
+{
+    reserve(rows);
+    if (rows > n_rows)
+        std::fill(data() + n_rows * n_cols, data() + rows * n_cols, 0.0f);
+    n_rows = rows;
+}
+
+void FeatureMatrix::clear() noexcept
+{
+    n_rows = 0;
+}
+
+void FeatureMatrix::push_back(const_row_view row)
+{
+    if (n_rows == 0 && n_cols == 0) {
+        // whatever was reserved was sized for rows of no features
+        n_cols = row.size();
+        buffer.reset();
+        capacity = 0;
+    }
+    if (row.size() != n_cols)
+        throw std::invalid_argument("row of " + std::to_string(row.size()) +
+                                    " features appended to a FeatureMatrix of " +
+                                    std::to_string(n_cols) + " columns.");
+
+    if (n_rows == capacity) {
+        // the row may be one of this matrix
+        std::less_equal<const float*> le;
+        bool own = buffer && le(data(), row.data()) && le(row.data(), data() + n_rows * n_cols);
+        std::size_t offset = own ? row.data() - data() : 0;
+        reallocate(std::max<std::size_t>(2 * capacity, 16));
+        if (own)
+            row = const_row_view(data() + offset, n_cols);
+    }
+    std::memcpy(data() + n_rows * n_cols, row.data(), n_cols * sizeof(float));
+    ++n_rows;
+}
+
+void FeatureMatrix::reallocate(std::size_t rows)
+{
+    std::size_t elements = std::max<std::size_t>(rows * n_cols, 1);
+    std::unique_ptr<float[], aligned_delete> new_buffer(
+        static_cast<float*>(::operator new(elements * sizeof(float), std::align_val_t(alignment))));
+
+    if (bytes())
+        std::memcpy(new_buffer.get(), data(), bytes());
+    buffer = std::move(new_buffer);
+    capacity = rows;
+}
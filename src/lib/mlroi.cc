@@ -0,0 +1,130 @@
+#include "mlroi.h"
+#include "mlimage.h"
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <pthread.h>
+#include <sched.h>
+
+MlRoiTracker::MlRoiTracker(source_type source,
+                           callback_type callback,
+                           const cv::Rect& roi,
+                           std::chrono::milliseconds interval,
+                           double scale,
+                           int tolerance)
+    : source(std::move(source)),
+      callback(std::move(callback)),
+      roi(roi),
+      initial_size(roi.size()),
+      interval(interval),
+      scale(scale),
+      tolerance(tolerance >= 0 ? tolerance : static_cast<int>(std::ceil(2 / scale))),
+      move_count(0),
+      stop(false)
+{
+    if (scale <= 0.0 || scale > 1.0)
+        throw std::invalid_argument("scale of MlRoiTracker has to be in (0, 1].");
+
+    local_thread = std::thread([this] { run(); });
+
+    // detection only uses cycles nobody else wants
+    sched_param param{};
+    pthread_setschedparam(local_thread.native_handle(), SCHED_IDLE, &param);
+}
+
+MlRoiTracker::~MlRoiTracker()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        stop.store(true, std::memory_order_release);
+    }
+    cv.notify_one();
+    if (local_thread.joinable())
+        local_thread.join();
+}
+
+cv::Rect MlRoiTracker::get_roi() const
+{
+    std::lock_guard<std::mutex> lck{m};
+    return roi;
+}
+
+std::size_t MlRoiTracker::moves() const noexcept
+{
+    return move_count.load(std::memory_order_relaxed);
+}
+
+bool MlRoiTracker::moved(const cv::Rect& found) const noexcept
+{
+    return std::abs(found.x - roi.x) > tolerance ||
+           std::abs(found.y - roi.y) > tolerance ||
+           std::abs(found.br().x - roi.br().x) > tolerance ||
+           std::abs(found.br().y - roi.br().y) > tolerance;
+}
+
+cv::Rect MlRoiTracker::refine(const cv::Mat& img, const cv::Rect& coarse) const
+{
+    // a downsampled pixel puts every edge up to 1 / scale pixels off, the
+    // full resolution search only covers the coarse roi and that margin
+    const int margin = static_cast<int>(std::ceil(1 / scale)) + 1;
+    const cv::Rect image(0, 0, img.cols, img.rows);
+    cv::Rect window = cv::Rect(coarse.x - margin, coarse.y - margin,
+                               coarse.width + 2 * margin, coarse.height + 2 * margin) & image;
+
+    cv::Rect found = MlImageProcessor::find_roi(img(window), false);
+    found.x += window.x;
+    found.y += window.y;
+
+    // a moved window doesn't change the size of the game, so the startup
+    // size is kept unless the size really changed
+    if (std::abs(found.width - initial_size.width) <= tolerance &&
+        std::abs(found.height - initial_size.height) <= tolerance) {
+        found = cv::Rect(found.tl(), initial_size);
+        if (found.br().x > img.cols)
+            found.x = img.cols - found.width;
+        if (found.br().y > img.rows)
+            found.y = img.rows - found.height;
+        found &= image;
+    }
+    return found;
+}
+
+void MlRoiTracker::run()
+{
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lck{m};
+            if (cv.wait_for(lck, interval, [&] { return stop.load(std::memory_order_acquire); }))
+                return;
+        }
+
+        cv::Rect found;
+        try {
+            cv::Mat img = source();
+            found = MlImageProcessor::find_roi(img, false, scale);
+            {
+                std::lock_guard<std::mutex> lck{m};
+                if (!moved(found))
+                    continue;
+            }
+            found = refine(img, found);
+        } catch (std::exception& ex) {
+            // the game may be covered for a moment, try again next time
+            std::cerr << "roi detection failed: " << ex.what() << std::endl;
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lck{m};
+            if (found == roi)
+                continue;
+            roi = found;
+        }
+        move_count.fetch_add(1, std::memory_order_relaxed);
+        callback(found);
+    }
+}
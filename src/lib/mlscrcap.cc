@@ -3,20 +3,119 @@
 #include <stdexcept>
 #include <iostream>
 #include <cstdint>
+#include <cstring>
 #include <tuple>
+#include <memory>
+#include <utility>
 #include <opencv2/opencv.hpp> // must include opencv before X11 lib
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include "mldisplay.h"
+#include "mlframe.h"
 #include "mltimer.h"
 
+/**
+ * shm_segment owns a MIT-SHM XImage together with its shared memory segment.
+ * The segment is detached from both the X server and this process on
+ * destruction.
+ */
+struct shm_segment {
+	shm_segment(std::shared_ptr<Display>, int, int);
+	~shm_segment();
+
+	std::shared_ptr<Display> display_ptr;
+	XShmSegmentInfo info;
+	XImage *image;
+	bool attached;
+};
+
+namespace {
+	// X reports a failed XShmAttach (e.g. BadAccess on a remote display)
+	// asynchronously through the error handler rather than a return value.
+	bool shm_attach_failed = false;
+
+	int shm_attach_error_handler(Display*, XErrorEvent*)
+	{
+		shm_attach_failed = true;
+		return 0;
+	}
+}
+
+shm_segment::shm_segment(std::shared_ptr<Display> display, int width, int height)
+	: display_ptr(std::move(display)), image(nullptr), attached(false)
+{
+	auto dpy = display_ptr.get();
+	auto screen = DefaultScreen(dpy);
+
+	info.shmid = -1;
+	info.shmaddr = reinterpret_cast<char*>(-1);
+	image = XShmCreateImage(dpy,
+				DefaultVisual(dpy, screen),
+				DefaultDepth(dpy, screen),
+				ZPixmap,
+				nullptr,
+				&info,
+				width,
+				height);
+	if (!image)
+		return;
+
+	info.shmid = shmget(IPC_PRIVATE,
+			    image->bytes_per_line * image->height,
+			    IPC_CREAT | 0600);
+	if (info.shmid < 0)
+		return;
+
+	info.shmaddr = image->data = static_cast<char*>(shmat(info.shmid, nullptr, 0));
+	if (info.shmaddr == reinterpret_cast<char*>(-1))
+		return;
+	info.readOnly = False;
+
+	XSync(dpy, False);
+	shm_attach_failed = false;
+	auto prev_handler = XSetErrorHandler(shm_attach_error_handler);
+	XShmAttach(dpy, &info);
+	XSync(dpy, False);
+	XSetErrorHandler(prev_handler);
+	attached = !shm_attach_failed;
+
+	// the segment is destroyed automatically once both sides have detached
+	shmctl(info.shmid, IPC_RMID, nullptr);
+}
+
+shm_segment::~shm_segment()
+{
+	auto dpy = display_ptr.get();
+
+	if (attached) {
+		XShmDetach(dpy, &info);
+		XSync(dpy, False);
+	}
+	if (image) {
+		// the data belongs to the segment, XDestroyImage must not free() it
+		image->data = nullptr;
+		XDestroyImage(image);
+	}
+	if (info.shmaddr != reinterpret_cast<char*>(-1))
+		shmdt(info.shmaddr);
+	else if (info.shmid >= 0)
+		shmctl(info.shmid, IPC_RMID, nullptr);
+}
 	
-MlScreenCapturer::MlScreenCapturer(MlDisplay& display)
-	: display(display), size_captured(false)
+MlScreenCapturer::MlScreenCapturer(MlDisplay& display, capture_mode mode)
+	: display(display), size_captured(false), mode(mode)
 {
 	auto screen = ScreenOfDisplay(display.display_ptr.get(), 0);
 	positions[1] = { screen->width, screen->height };
+
+	if (mode == capture_mode::SHM && !XShmQueryExtension(display.display_ptr.get())) {
+		std::cerr << "MIT-SHM is not available, fall back to XGetImage." << std::endl;
+		this->mode = capture_mode::XGETIMAGE;
+	}
 }
 
 
@@ -26,6 +125,72 @@ ScreenArea MlScreenCapturer::get_screen_coordinate() const
 	return {positions[0], positions[1]};
 }
 
+capture_mode MlScreenCapturer::get_capture_mode() const noexcept
+{
+	return mode;
+}
+
+cv::Size MlScreenCapturer::get_capture_size() const noexcept
+{
+	return cv::Size(positions[1].x - positions[0].x,
+			positions[1].y - positions[0].y);
+}
+
+cv::Rect MlScreenCapturer::get_capture_area() const noexcept
+{
+	return cv::Rect(cv::Point(positions[0].x, positions[0].y), get_capture_size());
+}
+
+void MlScreenCapturer::set_capture_area(const cv::Rect& area)
+{
+	auto screen = ScreenOfDisplay(display.display_ptr.get(), 0);
+	auto clipped = area & cv::Rect(0, 0, screen->width, screen->height);
+
+	if (clipped.area() == 0)
+		throw std::invalid_argument("capture area is outside of the screen.");
+
+	positions[0] = { clipped.x, clipped.y };
+	positions[1] = { clipped.x + clipped.width, clipped.y + clipped.height };
+	size_captured = true;
+}
+
+MlFrame MlScreenCapturer::screenshot(MlFramePool& pool)
+{
+	if (pool.frame_size() != get_capture_size() || pool.frame_type() != CV_8UC4)
+		throw std::logic_error("frame of MlFramePool doesn't fit the capture area.");
+
+	auto frame = pool.acquire();
+	auto& dst = frame.mat();
+	int scr_width = dst.cols;
+	int scr_height = dst.rows;
+
+	// the pixels go straight into the slot, nothing is allocated here
+	if (use_shm(scr_width, scr_height)) {
+		auto image = screenshot_shm();
+		auto src = reinterpret_cast<const std::uint8_t*>(image->data);
+		std::size_t row_bytes = static_cast<std::size_t>(scr_width) * 4;
+		if (dst.isContinuous() && static_cast<std::size_t>(image->bytes_per_line) == row_bytes) {
+			std::memcpy(dst.data, src, row_bytes * scr_height);
+		} else {
+			for (int y = 0; y != scr_height; ++y)
+				std::memcpy(dst.ptr(y), src + y * image->bytes_per_line, row_bytes);
+		}
+	} else {
+		screenshot_xgetimage(dst);
+	}
+	return frame;
+}
+
+MlFrame MlScreenCapturer::next_frame(MlFramePool& pool)
+{
+	return screenshot(pool);
+}
+
+cv::Size MlScreenCapturer::get_frame_size() const
+{
+	return get_capture_size();
+}
+
 cv::Mat MlScreenCapturer::screenshot()
 {
     /*
@@ -36,6 +201,107 @@ cv::Mat MlScreenCapturer::screenshot()
 	int scr_width = positions[1].x - positions[0].x;
 	int scr_height = positions[1].y - positions[0].y;
 
+	if (use_shm(scr_width, scr_height)) {
+		auto image = screenshot_shm();
+		return cv::Mat(scr_height,
+			       scr_width,
+			       CV_8UC4,
+			       image->data,
+			       image->bytes_per_line);
+	}
+	return screenshot_xgetimage(scr_width, scr_height);
+}
+
+bool MlScreenCapturer::use_shm(int scr_width, int scr_height)
+{
+	if (mode != capture_mode::SHM)
+		return false;
+	if (prepare_shm_segment(scr_width, scr_height))
+		return true;
+
+	std::cerr << "MIT-SHM segment can't be attached, fall back to XGetImage." << std::endl;
+	mode = capture_mode::XGETIMAGE;
+	segment.reset();
+	return false;
+}
+
+bool MlScreenCapturer::prepare_shm_segment(int scr_width, int scr_height)
+{
+	if (segment &&
+	    segment->image->width == scr_width &&
+	    segment->image->height == scr_height)
+		return true;
+
+	// release the old segment before attaching a new one
+	segment.reset();
+	auto new_segment = std::make_shared<shm_segment>(display.display_ptr,
+							 scr_width,
+							 scr_height);
+	if (!new_segment->attached)
+		return false;
+
+	segment = std::move(new_segment);
+	return true;
+}
+
+XImage* MlScreenCapturer::screenshot_shm()
+{
+	auto image = segment->image;
+
+	if (!XShmGetImage(display.display_ptr.get(),
+			  display.window,
+			  image,
+			  positions[0].x,
+			  positions[0].y,
+			  AllPlanes))
+		throw std::runtime_error("XShmGetImage failed.");
+
+	return image;
+}
+
+void MlScreenCapturer::screenshot_xgetimage(cv::Mat& dst)
+{
+	auto dpy = display.display_ptr.get();
+	auto screen = DefaultScreen(dpy);
+	auto visual = DefaultVisual(dpy, screen);
+
+	// an XImage header on the stack describing the slot, XInitImage()
+	// only fills in its functions
+	XImage image{};
+	image.width = dst.cols;
+	image.height = dst.rows;
+	image.xoffset = 0;
+	image.format = ZPixmap;
+	image.data = reinterpret_cast<char*>(dst.data);
+	image.byte_order = ImageByteOrder(dpy);
+	image.bitmap_unit = BitmapUnit(dpy);
+	image.bitmap_bit_order = BitmapBitOrder(dpy);
+	image.bitmap_pad = 32;
+	image.depth = DefaultDepth(dpy, screen);
+	image.bytes_per_line = static_cast<int>(dst.step);
+	image.bits_per_pixel = 32;
+	image.red_mask = visual->red_mask;
+	image.green_mask = visual->green_mask;
+	image.blue_mask = visual->blue_mask;
+	if (!XInitImage(&image))
+		throw std::runtime_error("XInitImage failed for the frame of MlFramePool.");
+
+	if (!XGetSubImage(dpy,
+			  display.window,
+			  positions[0].x,
+			  positions[0].y,
+			  dst.cols,
+			  dst.rows,
+			  AllPlanes,
+			  ZPixmap,
+			  &image,
+			  0,
+			  0))
+		throw std::runtime_error("XGetSubImage failed.");
+}
+
+cv::Mat MlScreenCapturer::screenshot_xgetimage(int scr_width, int scr_height)
+{
 	// Get screenshot
 	auto scr_shot = XGetImage(display.display_ptr.get(),
 				    display.window,
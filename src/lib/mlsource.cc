@@ -0,0 +1,105 @@
+#include "mlsource.h"
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "mlframe.h"
+
+namespace {
+	/**
+	 * convert a decoded image of any channel count into the BGRA frame
+	 * the feature extractor expects, without reallocating the frame.
+	 */
+	void to_bgra(const cv::Mat& img, cv::Mat& frame)
+	{
+		if (img.size() != frame.size())
+			throw std::runtime_error("frame size changed in the middle of a frame source.");
+
+		switch (img.channels()) {
+		case 4:
+			img.copyTo(frame);
+			break;
+		case 3:
+			cv::cvtColor(img, frame, cv::COLOR_BGR2BGRA);
+			break;
+		case 1:
+			cv::cvtColor(img, frame, cv::COLOR_GRAY2BGRA);
+			break;
+		default:
+			throw std::runtime_error("unsupported channel count of frame.");
+		}
+	}
+
+	void check_pool(const MlFramePool& pool, const cv::Size& size)
+	{
+		if (pool.frame_size() != size || pool.frame_type() != CV_8UC4)
+			throw std::logic_error("frame of MlFramePool doesn't fit the frame source.");
+	}
+}
+
+// MlImageDirSource implementation
+MlImageDirSource::MlImageDirSource(const std::string& dir, const std::string& pattern)
+	: next(0)
+{
+	cv::glob(dir + '/' + pattern, files, false);
+	if (files.empty())
+		throw std::runtime_error("no image matches " + dir + '/' + pattern + '.');
+	std::sort(files.begin(), files.end());
+
+	frame_size = cv::imread(files.front(), cv::IMREAD_UNCHANGED).size();
+}
+
+MlFrame MlImageDirSource::next_frame(MlFramePool& pool)
+{
+	check_pool(pool, frame_size);
+	if (next == files.size())
+		return MlFrame();
+
+	auto img = cv::imread(files[next], cv::IMREAD_UNCHANGED);
+	if (img.empty())
+		throw std::runtime_error("failed to read image " + files[next] + '.');
+	++next;
+
+	auto frame = pool.acquire();
+	to_bgra(img, frame.mat());
+	return frame;
+}
+
+cv::Size MlImageDirSource::get_frame_size() const
+{
+	return frame_size;
+}
+
+std::size_t MlImageDirSource::size() const noexcept
+{
+	return files.size();
+}
+
+// MlVideoSource implementation
+MlVideoSource::MlVideoSource(const std::string& path)
+	: capture(path)
+{
+	if (!capture.isOpened())
+		throw std::runtime_error("failed to open video " + path + '.');
+
+	frame_size = cv::Size(static_cast<int>(capture.get(cv::CAP_PROP_FRAME_WIDTH)),
+			      static_cast<int>(capture.get(cv::CAP_PROP_FRAME_HEIGHT)));
+}
+
+MlFrame MlVideoSource::next_frame(MlFramePool& pool)
+{
+	check_pool(pool, frame_size);
+	// decoded frames land in a reused buffer, then get converted into the pool
+	if (!capture.read(buffer) || buffer.empty())
+		return MlFrame();
+
+	auto frame = pool.acquire();
+	to_bgra(buffer, frame.mat());
+	return frame;
+}
+
+cv::Size MlVideoSource::get_frame_size() const
+{
+	return frame_size;
+}
@@ -0,0 +1,484 @@
+#include "mlstore.h"
+#include "feature/ParallelFor.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <rapidjson/document.h>
+#include <rapidjson/istreamwrapper.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    constexpr int manifest_version = 1;
+
+    std::string quoted(const std::string& s)
+    {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escape[8];
+                std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+                out += escape;
+            } else {
+                out += c;
+            }
+        }
+        return out + '"';
+    }
+
+    std::string base_name(const std::string& path)
+    {
+        auto slash = path.rfind('/');
+        return slash == std::string::npos ? path : path.substr(slash + 1);
+    }
+
+    // exclusive flock of <dir>/.lock, serializes manifest updates of
+    // every process sharing the store
+    class store_lock {
+    public:
+        explicit store_lock(const std::string& dir)
+            : fd(::open((dir + "/.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644))
+        {
+            if (fd == -1)
+                throw std::runtime_error("can't open " + dir + "/.lock: " + std::strerror(errno));
+            while (::flock(fd, LOCK_EX) == -1) {
+                if (errno != EINTR) {
+                    int error = errno;
+                    ::close(fd);
+                    throw std::runtime_error("can't lock " + dir + "/.lock: " + std::strerror(error));
+                }
+            }
+        }
+        store_lock(const store_lock&) = delete;
+        store_lock& operator=(const store_lock&) = delete;
+
+        // closing the file releases the lock
+        ~store_lock() { ::close(fd); }
+
+    private:
+        int fd;
+    };
+
+    // number of a file named shard-<number>.bin, or -1
+    long shard_number(const std::string& file)
+    {
+        unsigned long id;
+        int end = 0;
+        if (std::sscanf(file.c_str(), "shard-%lu.bin%n", &id, &end) == 1 &&
+            static_cast<std::size_t>(end) == file.size())
+            return static_cast<long>(id);
+        return -1;
+    }
+
+    // the manifest has the keys of setting.json for the geometry
+    dataset_geometry parse_geometry(const rapidjson::Value& d, const std::string& path)
+    {
+        if (!d.HasMember("grid_x_no") || !d.HasMember("grid_y_no") || !d.HasMember("roi_width") ||
+            !d.HasMember("roi_height") || !d.HasMember("features"))
+            throw std::runtime_error(path + " has no geometry.");
+
+        dataset_geometry dataset{ grid_geometry::from_grid(d["grid_x_no"].GetInt(), d["grid_y_no"].GetInt(),
+                                                           d["roi_width"].GetInt(), d["roi_height"].GetInt()),
+                                  d["features"].GetUint64() };
+        if (d.HasMember("feature_mode"))
+            dataset.mode = static_cast<feature_mode>(d["feature_mode"].GetInt());
+        if (!dataset.geometry.valid() || dataset.features == 0)
+            throw std::runtime_error(path + " has an invalid geometry.");
+        return dataset;
+    }
+
+    shard_info parse_shard(const rapidjson::Value& v, const std::string& path)
+    {
+        if (!v.IsObject() || !v.HasMember("file") || !v.HasMember("records") || !v.HasMember("labels"))
+            throw std::runtime_error(path + " has a shard without file, records or labels.");
+
+        shard_info shard;
+        shard.file = v["file"].GetString();
+        shard.session = v.HasMember("session") ? v["session"].GetString() : "";
+        shard.records = v["records"].GetUint64();
+        for (const auto& label : v["labels"].GetObject())
+            shard.labels[std::stoi(label.name.GetString())] = label.value.GetUint64();
+        return shard;
+    }
+}
+
+MlDatasetStore::MlDatasetStore(const std::string& directory)
+    : dir(directory), dataset{ {}, 0 }, next_id(0)
+{
+    while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    if (::mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+        throw std::runtime_error("can't create " + dir + ": " + std::strerror(errno));
+
+    store_lock lock(dir);
+    load();
+}
+
+void MlDatasetStore::load()
+{
+    std::string path = dir + "/manifest.json";
+    std::ifstream fs(path);
+    if (!fs)
+        return;
+
+    rapidjson::Document d;
+    rapidjson::IStreamWrapper isw(fs);
+    d.ParseStream(isw);
+    if (d.HasParseError() || !d.IsObject())
+        throw std::runtime_error(path + " is not a valid json object.");
+    if (!d.HasMember("version") || d["version"].GetInt() != manifest_version)
+        throw std::runtime_error(path + " has an unsupported version.");
+    if (!d.HasMember("shards") || !d["shards"].IsArray())
+        throw std::runtime_error(path + " has no shards.");
+
+    std::vector<shard_info> shards;
+    for (const auto& v : d["shards"].GetArray()) {
+        shards.push_back(parse_shard(v, path));
+        next_id = std::max<std::size_t>(next_id, shard_number(shards.back().file) + 1);
+    }
+    if (!shards.empty())
+        dataset = parse_geometry(d, path);
+    shard_list = std::move(shards);
+}
+
+const std::string& MlDatasetStore::directory() const noexcept
+{
+    return dir;
+}
+
+bool MlDatasetStore::has_geometry() const
+{
+    std::lock_guard<std::mutex> lck{m};
+    return dataset.features != 0;
+}
+
+dataset_geometry MlDatasetStore::geometry() const
+{
+    std::lock_guard<std::mutex> lck{m};
+    return dataset;
+}
+
+std::vector<shard_info> MlDatasetStore::shards() const
+{
+    std::lock_guard<std::mutex> lck{m};
+    return shard_list;
+}
+
+std::size_t MlDatasetStore::size(const filter_type& filter) const
+{
+    std::lock_guard<std::mutex> lck{m};
+    std::size_t n = 0;
+    for (const auto& shard : shard_list)
+        if (!filter || filter(shard))
+            n += shard.records;
+    return n;
+}
+
+std::map<int, std::size_t> MlDatasetStore::count_labels(const filter_type& filter) const
+{
+    std::lock_guard<std::mutex> lck{m};
+    std::map<int, std::size_t> counts;
+    for (const auto& shard : shard_list)
+        if (!filter || filter(shard))
+            for (const auto& [label, count] : shard.labels)
+                counts[label] += count;
+    return counts;
+}
+
+std::string MlDatasetStore::new_shard_path()
+{
+    std::lock_guard<std::mutex> lck{m};
+    // the file is created here, so another process collecting into the
+    // store, or a shard left behind by a crashed session, is never
+    // overwritten
+    while (true) {
+        char file[32];
+        std::snprintf(file, sizeof(file), "shard-%06zu.bin", next_id++);
+        std::string path = dir + '/' + file;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            ::close(fd);
+            return path;
+        }
+        if (errno != EEXIST)
+            throw std::runtime_error("can't create " + path + ": " + std::strerror(errno));
+    }
+}
+
+bool MlDatasetStore::add_shard(const std::string& path, const std::string& session)
+{
+    // the shard is read before the locks are taken
+    MlDatasetStream stream(path);
+    shard_info shard;
+    shard.file = base_name(path);
+    shard.session = session;
+    shard.records = stream.size();
+    if (!shard.records) {
+        std::remove(path.c_str());
+        return false;
+    }
+    shard.labels = stream.count_labels();
+    auto shard_geometry = stream.header().geometry();
+
+    std::lock_guard<std::mutex> lck{m};
+    // shards other processes added since are read back first, so they
+    // stay in the manifest
+    store_lock lock(dir);
+    load();
+    if (dataset.features == 0)
+        dataset = shard_geometry;
+    else if (shard_geometry != dataset)
+        throw std::runtime_error(path + " has another geometry or feature mode than the store in " + dir + '.');
+
+    shard_list.push_back(std::move(shard));
+    try {
+        save();
+    } catch (...) {
+        shard_list.pop_back();
+        throw;
+    }
+    return true;
+}
+
+void MlDatasetStore::save() const
+{
+    std::string path = dir + "/manifest.json";
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream fs(tmp_path, std::ios::trunc);
+        const auto& geometry = dataset.geometry;
+
+        fs << "{\n"
+           << "    \"version\": " << manifest_version << ",\n"
+           << "    \"grid_x_no\": " << geometry.cols() << ",\n"
+           << "    \"grid_y_no\": " << geometry.rows() << ",\n"
+           << "    \"roi_width\": " << geometry.roi_w << ",\n"
+           << "    \"roi_height\": " << geometry.roi_h << ",\n"
+           << "    \"features\": " << dataset.features << ",\n"
+           << "    \"feature_mode\": " << static_cast<int>(dataset.mode) << ",\n"
+           << "    \"shards\": [";
+        for (std::size_t i = 0; i != shard_list.size(); ++i) {
+            const auto& shard = shard_list[i];
+            fs << (i ? ",\n" : "\n")
+               << "        { \"file\": " << quoted(shard.file)
+               << ", \"session\": " << quoted(shard.session)
+               << ", \"records\": " << shard.records
+               << ", \"labels\": {";
+            const char* separator = " ";
+            for (const auto& [label, count] : shard.labels) {
+                fs << separator << '"' << label << "\": " << count;
+                separator = ", ";
+            }
+            fs << " } }";
+        }
+        fs << "\n    ]\n"
+           << "}\n";
+        if (!fs.flush())
+            throw std::runtime_error("can't write " + tmp_path + '.');
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) == -1)
+        throw std::runtime_error("can't replace " + path + ": " + std::strerror(errno));
+}
+
+MlDatasetStore::filter_type session_filter(const std::vector<std::string>& sessions)
+{
+    std::set<std::string> picked(sessions.begin(), sessions.end());
+    return [picked = std::move(picked)](const shard_info& shard) {
+        return picked.count(shard.session) != 0;
+    };
+}
+
+MlDataset load_shards(const MlDatasetStore& store, const MlDatasetStore::filter_type& filter, std::size_t threads)
+{
+    std::vector<shard_info> picked;
+    std::vector<std::size_t> first_row;
+    std::size_t n = 0;
+    for (auto& shard : store.shards()) {
+        if (filter && !filter(shard))
+            continue;
+        first_row.push_back(n);
+        n += shard.records;
+        picked.push_back(std::move(shard));
+    }
+
+    MlDataset dataset;
+    if (!store.has_geometry())
+        return dataset;
+    auto geometry = store.geometry();
+    dataset.header = dataset_header::make(geometry);
+    dataset.features = FeatureMatrix(n, geometry.features);
+    dataset.labels.resize(n);
+    dataset.timestamps.resize(n);
+
+    // every shard is decoded straight into its own rows
+    parallel_for(picked.size(), threads, [&](std::size_t i) {
+        load_dataset_rows(store.directory() + '/' + picked[i].file, dataset, first_row[i], picked[i].records);
+    });
+
+    return dataset;
+}
+
+MlShardWriter::MlShardWriter(MlDatasetStore& store,
+                             const std::string& session,
+                             const dataset_geometry& dataset,
+                             std::size_t shard_records,
+                             const async_writer_options& options)
+    : store(store),
+      session(session),
+      dataset(dataset),
+      shard_records(shard_records),
+      opts(options),
+      accepted(0),
+      stop(false),
+      written_count(0),
+      dropped_count(0),
+      high_water_mark(0),
+      shard_count(0)
+{
+    // a shard of another geometry would only be refused once it's full,
+    // after the collection it holds
+    if (store.has_geometry() && store.geometry() != dataset)
+        throw std::runtime_error("the store in " + store.directory() + " has another geometry or feature mode than the collection.");
+    start();
+    finisher = std::thread([this] { finish(); });
+}
+
+MlShardWriter::~MlShardWriter()
+{
+    try {
+        close();
+    } catch (std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+bool MlShardWriter::write(const std::vector<float>& features, int label, time_point captured)
+{
+    if (!writer)
+        throw std::logic_error("MlShardWriter is closed but being written.");
+    rethrow();
+
+    if (!writer->write(features, label, captured))
+        return false;
+    if (++accepted == shard_records)
+        rotate();
+    return true;
+}
+
+void MlShardWriter::close()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        if (writer)
+            queued.emplace_back(std::move(writer), writer_path);
+        stop = true;
+    }
+    cv.notify_one();
+    if (finisher.joinable())
+        finisher.join();
+    rethrow();
+}
+
+std::size_t MlShardWriter::size() const noexcept
+{
+    std::lock_guard<std::mutex> lck{m};
+    std::size_t n = written_count + (writer ? writer->size() : 0);
+    for (const auto& shard : queued)
+        n += shard.first->size();
+    return n;
+}
+
+std::size_t MlShardWriter::dropped() const noexcept
+{
+    std::lock_guard<std::mutex> lck{m};
+    std::size_t n = dropped_count + (writer ? writer->dropped() : 0);
+    for (const auto& shard : queued)
+        n += shard.first->dropped();
+    return n;
+}
+
+std::size_t MlShardWriter::high_water() const noexcept
+{
+    std::lock_guard<std::mutex> lck{m};
+    std::size_t n = std::max(high_water_mark, writer ? writer->high_water() : 0);
+    for (const auto& shard : queued)
+        n = std::max(n, shard.first->high_water());
+    return n;
+}
+
+std::size_t MlShardWriter::shards() const noexcept
+{
+    return shard_count;
+}
+
+void MlShardWriter::start()
+{
+    writer_path = store.new_shard_path();
+    writer = std::make_unique<MlAsyncDatasetWriter>(writer_path, dataset, opts);
+    accepted = 0;
+    ++shard_count;
+}
+
+void MlShardWriter::rotate()
+{
+    {
+        std::lock_guard<std::mutex> lck{m};
+        queued.emplace_back(std::move(writer), writer_path);
+    }
+    cv.notify_one();
+    start();
+}
+
+void MlShardWriter::finish()
+{
+    std::unique_lock<std::mutex> lck{m};
+    while (true) {
+        cv.wait(lck, [&] { return stop || !queued.empty(); });
+        if (queued.empty())
+            return;
+
+        // stays queued, and so counted, until it's added
+        auto shard = queued.front().first.get();
+        auto path = queued.front().second;
+        lck.unlock();
+        std::exception_ptr failed;
+        try {
+            shard->close();
+            store.add_shard(path, session);
+        } catch (...) {
+            failed = std::current_exception();
+        }
+        lck.lock();
+
+        if (failed && !error)
+            error = failed;
+        written_count += shard->size();
+        dropped_count += shard->dropped();
+        high_water_mark = std::max(high_water_mark, shard->high_water());
+        queued.pop_front();
+    }
+}
+
+void MlShardWriter::rethrow()
+{
+    std::exception_ptr failed;
+    {
+        std::lock_guard<std::mutex> lck{m};
+        std::swap(failed, error);
+    }
+    if (failed)
+        std::rethrow_exception(failed);
+}
@@ -0,0 +1,237 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <string>
+#include <utility>
+#include <cmath>
+#include <algorithm>
+#include <unistd.h>
+#include "mlframe.h"
+#include "mlsource.h"
+#include "mlimage.h"
+using namespace std;
+
+template <typename Data_Con>
+void write_data(ofstream&, Data_Con&&);
+
+void usage(const char*);
+
+int main(int argc, char *argv[])
+{
+    // -v         : the source is a video file instead of an image directory
+    // -p pattern : glob pattern of images in the directory, "*.png" by default
+    // -o path    : write extracted features into a csv file
+    // -f mode    : feature mode, "reference" (default), "fused", "multi" or "lut"
+    // -c         : extract every frame in both modes and report the difference,
+    //              "lut" is compared against "fused", the others against each
+    //              other; all of them compute the reference features, replay
+    //              fails if they aren't equal
+    // -w         : show debug images of extraction in preview windows
+    // -s         : check the SIMD mask kernels are bit-exact against the
+    //              scalar ones and the colour table gives every colour
+    //              exactly its classes of setting.json, then exit, no source
+    //              needed
+    // -i how     : "on" or "verify", recompute only boxes whose source tile
+    //              changed, verify checks reused boxes; multi always
+    //              extracts everything
+    // -j threads : extract the whole source as one batch on given number of
+    //              threads, 0 for one per core
+    bool video = false;
+    bool show_preview = false;
+    bool check = false;
+    incremental_mode incremental = incremental_mode::OFF;
+    bool batch = false;
+    size_t threads = 0;
+    feature_mode mode = feature_mode::REFERENCE;
+    string pattern = "*.png";
+    string out_path;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vp:o:f:cwsi:j:")) != -1) {
+        switch (opt) {
+        case 'v':
+            video = true;
+            break;
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'f':
+            if (string(optarg) == "reference") {
+                mode = feature_mode::REFERENCE;
+            } else if (string(optarg) == "fused") {
+                mode = feature_mode::FUSED;
+            } else if (string(optarg) == "multi") {
+                mode = feature_mode::MULTI_SCALE;
+            } else if (string(optarg) == "lut") {
+                mode = feature_mode::LUT;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            check = true;
+            break;
+        case 'w':
+            show_preview = true;
+            break;
+        case 'i':
+            if (string(optarg) == "on") {
+                incremental = incremental_mode::ON;
+            } else if (string(optarg) == "verify") {
+                incremental = incremental_mode::VERIFY;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'j':
+            batch = true;
+            threads = stoul(optarg);
+            break;
+        case 's': {
+            const char *names[] = { "scalar", "sse4.2", "avx2", "avx512" };
+            auto failed = check_mask_kernels();
+            cout << "mask kernels: " << names[static_cast<int>(best_simd_level())] << endl;
+            for (auto level : failed)
+                cerr << names[static_cast<int>(level)] << " differs from scalar." << endl;
+
+            const pair<uint8_t, const char *> classes[] = {
+                { color_class::PATH, "path" }, { color_class::COIN, "coin" }, { color_class::PLAYER, "player" }
+            };
+            auto errors = check_color_lut(ColorLut(MlImageProcessor("setting.json").get_settings()));
+            for (auto& [bit, name] : classes) {
+                if (errors.lost & bit)
+                    cerr << "colour table loses " << name << " pixels." << endl;
+                if (errors.extra & bit)
+                    cerr << "colour table gives " << name << " to other pixels." << endl;
+            }
+            return failed.empty() && errors.exact() ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind + 1 != argc || (check && (batch || mode == feature_mode::MULTI_SCALE))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unique_ptr<MlFrameSource> source;
+    if (video)
+        source = make_unique<MlVideoSource>(argv[optind]);
+    else
+        source = make_unique<MlImageDirSource>(argv[optind], pattern);
+
+    ofstream data_fs;
+    if (!out_path.empty())
+        data_fs.open(out_path, ios::out);
+
+    MlImageProcessor img_proc("setting.json");
+    MlFramePool frames(3, source->get_frame_size());
+
+    auto frame = source->next_frame(frames);
+    if (!frame) {
+        cerr << "frame source is empty." << endl;
+        return EXIT_FAILURE;
+    }
+    img_proc.set_roi(frame.mat(), false);
+    img_proc.set_feature_mode(mode);
+    img_proc.set_incremental(incremental);
+    if (show_preview)
+        img_proc.set_visualizer(make_shared<PreviewVisualizer>());
+
+    feature_mode other_mode = mode == feature_mode::FUSED ? feature_mode::REFERENCE
+                                                          : feature_mode::FUSED;
+
+    size_t n = 0;
+    float max_diff = 0.0f;
+    double sum_diff = 0.0;
+    auto begin = chrono::steady_clock::now();
+    if (batch) {
+        // the first frame went into finding the roi, the rest is one batch
+        auto first = img_proc.extract_feature(std::move(frame));
+        cv::Mat features = img_proc.extract_features_batch(*source, threads);
+        if (data_fs.is_open()) {
+            write_data(data_fs, first);
+            for (int i = 0; i != features.rows; ++i)
+                write_data(data_fs, vector<float>(features.ptr<float>(i), features.ptr<float>(i) + features.cols));
+        }
+        n = 1 + features.rows;
+    }
+    while (frame) {
+        vector<float> other;
+        if (check) {
+            img_proc.set_feature_mode(other_mode);
+            other = img_proc.extract_feature(frame);
+            img_proc.set_feature_mode(mode);
+        }
+        auto result_future = img_proc.extract_feature_async(std::move(frame));
+        // decode the next frame while the current one is being extracted
+        frame = source->next_frame(frames);
+        auto features = result_future.get();
+        if (data_fs.is_open())
+            write_data(data_fs, features);
+        for (size_t i = 0; i != other.size(); ++i) {
+            float diff = abs(features[i] - other[i]);
+            max_diff = max(max_diff, diff);
+            sum_diff += diff;
+        }
+        ++n;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - begin);
+
+    // every mode compared computes the reference features, any difference is a bug
+    bool mismatch = check && max_diff != 0.0f;
+
+    cout << n << " frames in " << elapsed.count() << " ms";
+    if (elapsed.count())
+        cout << ", " << n * 1000.0 / elapsed.count() << " frames/s";
+    cout << endl;
+    if (check && n) {
+        cout << (mode == feature_mode::LUT ? "lut vs fused" : "fused vs reference")
+             << ": max abs diff " << max_diff
+             << ", mean abs diff " << sum_diff / n << " per frame" << endl;
+    }
+
+    if (incremental != incremental_mode::OFF) {
+        auto stats = img_proc.get_incremental_stats();
+        cout << "incremental: " << stats->reused << " boxes reused, "
+             << stats->recomputed << " recomputed, reuse ratio " << stats->reuse_ratio();
+        if (incremental == incremental_mode::VERIFY)
+            cout << ", " << stats->mismatched << " mismatched";
+        cout << endl;
+    }
+
+    if (mismatch)
+        cerr << (mode == feature_mode::LUT ? "lut features differ from the fused ones."
+                                           : "fused features differ from the reference ones.") << endl;
+    return mismatch ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void usage(const char* prog)
+{
+    cerr << "usage: " << prog << " [-v] [-p pattern] [-o features.csv] [-f reference|fused|multi|lut] [-c] [-w] [-i on|verify] [-j threads] <image dir|video>\n"
+         << "       " << prog << " -s" << endl;
+}
+
+template<typename Data_Con>
+void write_data(ofstream& data_writer, Data_Con&& data)
+{
+    bool not_first_write = false;
+    for (const auto& region : data) {
+        if (not_first_write) {
+            data_writer << ',';
+        } else {
+            not_first_write = true;
+        }
+        data_writer << region;
+    }
+    data_writer << '\n';
+}
@@ -6,45 +6,124 @@
 #include <caffe2/core/db.h>
 #include "mldata.h"
 #include "mlnet.h"
+#include "mlimage.h"
+#include "mldataset.h"
+#include "mlstore.h"
 #include <vector>
+#include <algorithm>
 #include <string>
 using namespace std;
 
-CAFFE2_DEFINE_string(x_path, "", "file path of dataset.");
-CAFFE2_DEFINE_string(y_path, "", "file path of dataset label.");
+CAFFE2_DEFINE_string(data_path, "", "file path of binary dataset written by collect.");
+CAFFE2_DEFINE_string(x_path, "", "file path of csv dataset, if no binary one.");
+CAFFE2_DEFINE_string(y_path, "", "file path of csv dataset label.");
+CAFFE2_DEFINE_string(geometry_path, "data_geometry.json", "file path of csv dataset geometry.");
+CAFFE2_DEFINE_int(stream_memory, 0, "MB of a binary dataset held at once while streaming it, 0 loads it whole.");
+CAFFE2_DEFINE_string(store_path, "", "directory of dataset store written by collect -s, loaded instead of data_path.");
+CAFFE2_DEFINE_string(store_sessions, "", "comma separated sessions of the store to load, all of them if empty.");
 
 void parse_arg(int*, char **argv[]);
 
-template <std::size_t roi_h_n = 21, std::size_t roi_w_n = 12, typename XType, typename YType>
-void create_db(const string& db_type, const string& db_name, XType&& X, YType&& Y);
+vector<string> split_list(const string&);
+
+template <typename XType, typename YType>
+void create_db(const string& db_type,
+               const string& db_name,
+               const dataset_geometry& geometry,
+               const dataset_view<XType, YType>& dataset);
+
+void create_db(const string& db_type,
+               const string& db_name,
+               const dataset_geometry& geometry,
+               MlDatasetStream& stream);
+
+template <typename Row>
+void put_sample(caffe2::db::Transaction& transaction,
+                const dataset_geometry& geometry,
+                std::size_t key,
+                const Row& row,
+                int label);
 
 shared_ptr<MlNet> create_mlp(const std::string& net_name,
                              const std::string& x, 
                              const std::string& y, 
                              const std::string& db_path,
                              const std::string& db_type, 
+                             int input_size,
                              int batch_size);
 
 int main(int argc, char *argv[])
 {
     parse_arg(&argc, &argv);
 
-    
-    auto&& [features, labels] = load_data(FLAGS_x_path, FLAGS_y_path);
+    dataset_geometry geometry;
+    if (!FLAGS_store_path.empty()) {
+        // the manifest picks and sizes the shards, which are read in parallel
+        MlDatasetStore store(FLAGS_store_path);
+        MlDatasetStore::filter_type sessions;
+        if (!FLAGS_store_sessions.empty())
+            sessions = session_filter(split_list(FLAGS_store_sessions));
+        cout << "loading " << store.size(sessions) << " samples of " << FLAGS_store_path << ':';
+        for (const auto& [label, count] : store.count_labels(sessions))
+            cout << ' ' << count << " of label " << label;
+        cout << endl;
 
-    auto&& [X, Y] = balance_dataset(std::move(features), std::move(labels));
+        auto dataset = load_shards(store, sessions);
+        if (!dataset.size()) {
+            cerr << FLAGS_store_path << " has no samples to train on." << endl;
+            return 1;
+        }
+        geometry = dataset.header.geometry();
+        dataset_view<FeatureMatrix, vector<int>> view(dataset.features, dataset.labels);
+        auto [train_set, test_set] = cv_split(balance_dataset(view), 0.4);
 
-    auto&& [train_features, train_labels, test_features, test_labels] = cv_split(X, Y, 0.4);
+        create_db("minidb", "endless_lake_train.minidb", geometry, train_set);
+        create_db("minidb", "endless_lake_test.minidb", geometry, test_set);
+    } else if (!FLAGS_data_path.empty() && FLAGS_stream_memory > 0) {
+        // one pass counts labels, then a shuffled pass per db; every pass
+        // picks its records by balance and split filters
+        stream_options options;
+        options.memory = static_cast<size_t>(FLAGS_stream_memory) << 20;
+        options.shuffle = true;
+        MlDatasetStream stream(FLAGS_data_path, options);
+        geometry = stream.header().geometry();
 
-    create_db("minidb", "endless_lake_train.minidb", train_features, train_labels);
-    create_db("minidb", "endless_lake_test.minidb", test_features, test_labels);
+        auto balance = balance_filter(stream.count_labels());
+        for (bool cv : { false, true }) {
+            auto split = split_filter(0.4, cv);
+            stream.set_filter([=](size_t record, int label) {
+                return (!balance || balance(record, label)) && split(record, label);
+            });
+            stream.rewind();
+            create_db("minidb", cv ? "endless_lake_test.minidb" : "endless_lake_train.minidb", geometry, stream);
+        }
+    } else {
+        FeatureMatrix features;
+        vector<int> labels;
+        if (!FLAGS_data_path.empty()) {
+            auto dataset = load_dataset(FLAGS_data_path);
+            geometry = dataset.header.geometry();
+            features = std::move(dataset.features);
+            labels = std::move(dataset.labels);
+        } else {
+            geometry = load_dataset_geometry(FLAGS_geometry_path);
+            tie(features, labels) = load_matrix(FLAGS_x_path, FLAGS_y_path);
+        }
+
+        // balancing and splitting only pick rows, nothing is copied before create_db
+        dataset_view<FeatureMatrix, vector<int>> dataset(features, labels);
+        auto [train_set, test_set] = cv_split(balance_dataset(dataset), 0.4);
+
+        create_db("minidb", "endless_lake_train.minidb", geometry, train_set);
+        create_db("minidb", "endless_lake_test.minidb", geometry, test_set);
+    }
 
 
     // model description:
-    // width: 12 boxes; height: 21 boxes
+    // width: grid_x_no boxes; height: grid_y_no boxes, path and player each
 
     // so layer 1 :  3x3 kernel
-    auto net = create_mlp("mlp", "data", "action", ".", "minidb", 300);
+    auto net = create_mlp("mlp", "data", "action", ".", "minidb", geometry.features, 300);
     
 
     return 0;
@@ -53,6 +132,20 @@ int main(int argc, char *argv[])
 void parse_arg(int* argcp, char **argvp[])
 {
     caffe2::GlobalInit(argcp, argvp);
+    if (!FLAGS_store_path.empty()) {
+        if (!ifstream(FLAGS_store_path + "/manifest.json")) {
+            cerr << FLAGS_store_path << " is not a dataset store." << endl;
+            exit(1);
+        }
+        return;
+    }
+    if (!FLAGS_data_path.empty()) {
+        if (!is_binary_dataset(FLAGS_data_path)) {
+            cerr << FLAGS_data_path << " is not a binary dataset." << endl;
+            exit(1);
+        }
+        return;
+    }
     if (!ifstream(FLAGS_x_path)) {
         cerr << "path of dataset not provided." << endl;
         exit(1);
@@ -64,27 +157,84 @@ void parse_arg(int* argcp, char **argvp[])
 
 }
 
-template <std::size_t roi_h_n, std::size_t roi_w_n, typename XType, typename YType>
-void create_db(const string& db_type, const string& db_name, XType&& X, YType&& Y)
+vector<string> split_list(const string& list)
+{
+    vector<string> items;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = min(list.find(',', begin), list.size());
+        if (end != begin)
+            items.push_back(list.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+template <typename XType, typename YType>
+void create_db(const string& db_type,
+               const string& db_name,
+               const dataset_geometry& geometry,
+               const dataset_view<XType, YType>& dataset)
 {
     auto db = caffe2::db::CreateDB(db_type, db_name, caffe2::db::WRITE);
     auto transaction = db->NewTransaction();
-    for (int i = 0; i != X.size(); ++i) {
-        caffe2::TensorProtos features_label;
-        auto feature_proto = features_label.add_protos();
-        feature_proto->add_dims(roi_h_n);
-        feature_proto->add_dims(roi_w_n);
-        for (float feature : X[i])
-            feature_proto->add_float_data(feature);
-        auto label_proto = features_label.add_protos();
-        label_proto->add_dims(1);
-        label_proto->add_float_data(Y[i]);
-        std::string features_label_str;
-        if (!features_label.SerializeToString(&features_label_str))
-            throw std::runtime_error("features and label proto serialization failed.");
-        transaction->Put(std::to_string(i), features_label_str);
+    for (std::size_t i = 0; i != dataset.size(); ++i)
+        put_sample(*transaction, geometry, i, dataset.x(i), dataset.y(i));
+}
+
+void create_db(const string& db_type,
+               const string& db_name,
+               const dataset_geometry& geometry,
+               MlDatasetStream& stream)
+{
+    auto db = caffe2::db::CreateDB(db_type, db_name, caffe2::db::WRITE);
+    auto transaction = db->NewTransaction();
+    FeatureMatrix X;
+    vector<int> Y;
+    std::size_t key = 0;
+
+    // a batch at a time, so only the stream's buffers and one batch are held
+    while (stream.next(X, Y, 1024)) {
+        for (std::size_t i = 0; i != X.size(); ++i)
+            put_sample(*transaction, geometry, key++, X[i], Y[i]);
+        X.clear();
+        Y.clear();
     }
-    
+}
+
+template <typename Row>
+void put_sample(caffe2::db::Transaction& transaction,
+                const dataset_geometry& geometry,
+                std::size_t key,
+                const Row& row,
+                int label)
+{
+    // features of one box grid are 2 x grid_x_no x grid_y_no, column-major
+    // over boxes; anything else (multi scale) is kept flat
+    bool boxes = geometry.features == geometry.geometry.size();
+
+    caffe2::TensorProtos features_label;
+    if (row.size() != geometry.features)
+        throw std::runtime_error("sample " + std::to_string(key) + " doesn't match the dataset geometry.");
+    auto feature_proto = features_label.add_protos();
+    if (boxes) {
+        feature_proto->add_dims(2);
+        feature_proto->add_dims(geometry.geometry.cols());
+        feature_proto->add_dims(geometry.geometry.rows());
+    } else {
+        feature_proto->add_dims(geometry.features);
+    }
+    // one copy of the whole row instead of one call per feature
+    auto float_data = feature_proto->mutable_float_data();
+    float_data->Resize(row.size(), 0.0f);
+    std::copy(row.begin(), row.end(), float_data->mutable_data());
+    auto label_proto = features_label.add_protos();
+    label_proto->add_dims(1);
+    label_proto->add_float_data(label);
+    std::string features_label_str;
+    if (!features_label.SerializeToString(&features_label_str))
+        throw std::runtime_error("features and label proto serialization failed.");
+    transaction.Put(std::to_string(key), features_label_str);
 }
 
 shared_ptr<MlNet> create_mlp(const std::string& net_name,
@@ -92,11 +242,12 @@ shared_ptr<MlNet> create_mlp(const std::string& net_name,
                  const std::string& y, 
                  const std::string& db_path,
                  const std::string& db_type, 
+                 int input_size,
                  int batch_size)
 {
     auto net = make_shared<MlNet>(net_name);
     net->add_database_input(x, y, db_path, db_type, batch_size);
-    net->add_FC_op(x, "fc1", 21 * 12, 50, MlNet::fill_type::MSRA);
+    net->add_FC_op(x, "fc1", input_size, 50, MlNet::fill_type::MSRA);
     net->add_ReLU_op("fc1", "fc1_act");
     net->add_FC_op("fc1_act", "fc2", 50, 10, MlNet::fill_type::MSRA);
     net->add_ReLU_op("fc2", "fc2_act");